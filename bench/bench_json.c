@@ -0,0 +1,12 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// Runs the JSON benchmark of the application on the host.
+
+#include "json_benchmark.h"
+
+int main(void)
+{
+    json_benchmark();
+    return 0;
+}
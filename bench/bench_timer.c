@@ -0,0 +1,300 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// Runs the timer mix of the application for a while on the timer wheel and on one timerfd per
+// timer, the design the wheel replaced, and compares wakeups, syscalls and CPU time.
+//
+// usage: bench_timer [seconds] [fast]
+//   seconds  run time of each design, 10 by default
+//   fast     sample the buttons at the fast input period all the time, as right after a press
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include <applibs/log.h>
+#include "epoll_timerfd_utilities.h"
+
+// periods and delays of main.c, input.c and telemetry.c
+static const uint32_t AzurePollPeriodMs = 5000;
+static const uint32_t DoWorkActivePeriodMs = 100;
+static const uint32_t DoWorkIdleMaxMs = 2000;
+static const uint32_t InputIdlePeriodMs = 20;
+static const uint32_t InputFastPeriodMs = 5;
+static const uint32_t SpoolDrainPeriodMs = 1000;
+static const uint32_t TelemetryMaxAgeMs = 60000;
+
+enum {
+    TimerAzure = 0,
+    TimerDoWork,
+    TimerInput,
+    TimerSpoolDrain,
+    TimerTelemetry,
+    TimerCount
+};
+
+typedef struct {
+    const char *name;
+    // start or restart a timer, a period of 0 fires once after delayMs
+    void (*start)(int timer, uint32_t delayMs, uint32_t periodMs);
+    void (*cancel)(int timer);
+} TimerBackend;
+
+typedef struct {
+    uint32_t loops;
+    uint32_t expirations;
+    uint32_t syscalls;
+    double cpuMs;
+    uint32_t contextSwitches;
+} MixResult;
+
+static const TimerBackend *backend;
+static uint32_t inputPeriodMs;
+static uint32_t doWorkBackoffMs;
+static bool telemetryOpen;
+static uint32_t expirations;
+
+static struct timespec MsToTimespec(uint32_t ms)
+{
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000 * 1000};
+    return ts;
+}
+
+static uint64_t GetMonotonicMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/// <summary>
+///     Reacts to an expiry the way the application does: the poll timer queues telemetry and
+///     requests DoWork, DoWork backs off while idle and the telemetry batch is sealed on age.
+/// </summary>
+static void MixTimerExpired(int timer)
+{
+    expirations++;
+
+    switch (timer) {
+    case TimerAzure:
+        if (!telemetryOpen) {
+            telemetryOpen = true;
+            backend->start(TimerTelemetry, TelemetryMaxAgeMs, 0);
+        }
+        doWorkBackoffMs = DoWorkActivePeriodMs;
+        backend->start(TimerDoWork, 0, 0);
+        break;
+    case TimerDoWork:
+        doWorkBackoffMs *= 2;
+        if (doWorkBackoffMs > DoWorkIdleMaxMs) {
+            doWorkBackoffMs = DoWorkIdleMaxMs;
+        }
+        backend->start(TimerDoWork, doWorkBackoffMs, 0);
+        break;
+    case TimerTelemetry:
+        telemetryOpen = false;
+        break;
+    default:
+        break;
+    }
+}
+
+static void StartMix(void)
+{
+    doWorkBackoffMs = DoWorkActivePeriodMs;
+    telemetryOpen = false;
+    backend->start(TimerAzure, AzurePollPeriodMs, AzurePollPeriodMs);
+    backend->start(TimerDoWork, 0, 0);
+    backend->start(TimerInput, inputPeriodMs, inputPeriodMs);
+    backend->start(TimerSpoolDrain, SpoolDrainPeriodMs, SpoolDrainPeriodMs);
+}
+
+// timer wheel backend: every timer is multiplexed on the single timerfd of the wheel
+static void WheelTimerExpired(WheelTimer *timer);
+static WheelTimer wheelTimers[TimerCount] = {
+    [0 ... TimerCount - 1] = {.handler = &WheelTimerExpired}};
+
+static void WheelTimerExpired(WheelTimer *timer)
+{
+    MixTimerExpired((int)(timer - wheelTimers));
+}
+
+static void WheelStart(int timer, uint32_t delayMs, uint32_t periodMs)
+{
+    struct timespec ts = MsToTimespec(periodMs ? periodMs : delayMs);
+    if (periodMs) {
+        StartWheelTimer(&wheelTimers[timer], &ts);
+    } else {
+        StartWheelTimerOnce(&wheelTimers[timer], &ts);
+    }
+}
+
+static void WheelCancel(int timer)
+{
+    CancelWheelTimer(&wheelTimers[timer]);
+}
+
+static const TimerBackend wheelBackend = {"timer wheel", &WheelStart, &WheelCancel};
+
+// timerfd backend: one timerfd per timer, periodic timers re-armed by the kernel
+static void FdTimerEventHandler(EventData *eventData);
+static EventData fdTimerEvents[TimerCount] = {
+    [0 ... TimerCount - 1] = {.eventHandler = &FdTimerEventHandler, .fd = -1}};
+static uint32_t fdSyscalls;
+
+static void FdTimerEventHandler(EventData *eventData)
+{
+    fdSyscalls++;
+    if (ConsumeTimerFdEvent(eventData->fd) != 0) {
+        return;
+    }
+    MixTimerExpired((int)(eventData - fdTimerEvents));
+}
+
+static void FdStart(int timer, uint32_t delayMs, uint32_t periodMs)
+{
+    struct itimerspec newValue = {.it_value = MsToTimespec(periodMs ? periodMs : delayMs),
+                                  .it_interval = MsToTimespec(periodMs)};
+
+    if ((newValue.it_value.tv_sec == 0) && (newValue.it_value.tv_nsec == 0)) {
+        // a zero it_value disarms a timerfd, fire as soon as possible instead
+        newValue.it_value.tv_nsec = 1;
+    }
+
+    fdSyscalls++;
+    if (timerfd_settime(fdTimerEvents[timer].fd, 0, &newValue, NULL) < 0) {
+        Log_Debug("ERROR: Could not set timerfd: %s (%d).\n", strerror(errno), errno);
+    }
+}
+
+static void FdCancel(int timer)
+{
+    struct itimerspec newValue = {{0, 0}, {0, 0}};
+
+    fdSyscalls++;
+    (void)timerfd_settime(fdTimerEvents[timer].fd, 0, &newValue, NULL);
+}
+
+static const TimerBackend fdBackend = {"timerfd per timer", &FdStart, &FdCancel};
+
+static int OpenFdTimers(int epollFd)
+{
+    for (int i = 0; i < TimerCount; i++) {
+        fdTimerEvents[i].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (fdTimerEvents[i].fd < 0) {
+            Log_Debug("ERROR: Could not create timerfd: %s (%d).\n", strerror(errno), errno);
+            return -1;
+        }
+        if (RegisterEventHandlerToEpoll(epollFd, fdTimerEvents[i].fd, &fdTimerEvents[i], EPOLLIN) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void CloseFdTimers(void)
+{
+    for (int i = 0; i < TimerCount; i++) {
+        CloseFdAndPrintError(fdTimerEvents[i].fd, "FdTimer");
+        fdTimerEvents[i].fd = -1;
+    }
+}
+
+static double GetCpuMs(long *contextSwitches)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *contextSwitches = usage.ru_nvcsw + usage.ru_nivcsw;
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+/// <summary>
+///     Runs the timer mix on one backend and collects its counters. Every pass of the loop is
+///     one epoll_wait that returned, i.e. one wakeup of the main thread.
+/// </summary>
+static int RunMix(const TimerBackend *mixBackend, int epollFd, uint32_t seconds, MixResult *result)
+{
+    long switchesStart, switchesEnd;
+    double cpuStart;
+    uint64_t deadline;
+
+    backend = mixBackend;
+    expirations = 0;
+    fdSyscalls = 0;
+    memset(result, 0, sizeof(*result));
+
+    cpuStart = GetCpuMs(&switchesStart);
+    deadline = GetMonotonicMs() + (uint64_t)seconds * 1000;
+    StartMix();
+    while (GetMonotonicMs() < deadline) {
+        if (WaitForEventAndCallHandler(epollFd) != 0) {
+            return -1;
+        }
+        result->loops++;
+    }
+    for (int i = 0; i < TimerCount; i++) {
+        backend->cancel(i);
+    }
+
+    result->cpuMs = GetCpuMs(&switchesEnd) - cpuStart;
+    result->contextSwitches = (uint32_t)(switchesEnd - switchesStart);
+    result->expirations = expirations;
+    return 0;
+}
+
+static void PrintResult(const char *name, const MixResult *result, uint32_t seconds)
+{
+    // every wakeup also costs the epoll_wait that returned it
+    uint32_t syscalls = result->syscalls + result->loops;
+
+    printf("%-18s %8u %8.1f %8u %8u %8.1f %8.2f %8u\n", name, result->loops,
+           (double)result->loops / seconds, result->expirations, syscalls, (double)syscalls / seconds,
+           result->cpuMs, result->contextSwitches);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seconds = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 10;
+    bool fast = (argc > 2) && (strcmp(argv[2], "fast") == 0);
+    MixResult wheelResult, fdResult;
+    TimerWheelStats wheelStats;
+    int epollFd;
+
+    if (seconds == 0) {
+        seconds = 1;
+    }
+    inputPeriodMs = fast ? InputFastPeriodMs : InputIdlePeriodMs;
+    printf("Timer mix of the application for %u s per design, input sampled every %u ms\n", seconds,
+           inputPeriodMs);
+
+    epollFd = CreateEpollFd();
+    if ((epollFd < 0) || (CreateTimerWheelAndAddToEpoll(epollFd) != 0) ||
+        (RunMix(&wheelBackend, epollFd, seconds, &wheelResult) != 0)) {
+        return EXIT_FAILURE;
+    }
+    GetTimerWheelStats(&wheelStats);
+    wheelResult.syscalls = wheelStats.syscalls;
+    CloseTimerWheel();
+    CloseFdAndPrintError(epollFd, "Epoll");
+
+    epollFd = CreateEpollFd();
+    if ((epollFd < 0) || (OpenFdTimers(epollFd) != 0) ||
+        (RunMix(&fdBackend, epollFd, seconds, &fdResult) != 0)) {
+        return EXIT_FAILURE;
+    }
+    fdResult.syscalls = fdSyscalls;
+    CloseFdTimers();
+    CloseFdAndPrintError(epollFd, "Epoll");
+
+    printf("%-18s %8s %8s %8s %8s %8s %8s %8s\n", "design", "wakeups", "/s", "expired", "syscalls",
+           "/s", "cpu ms", "ctxsw");
+    PrintResult(wheelBackend.name, &wheelResult, seconds);
+    PrintResult(fdBackend.name, &fdResult, seconds);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,208 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// Writes an image to littlefs on a RAM block device with the geometry and caches of the W25Q128
+// volume and verifies it the way the OTA thread does, once per read chunk size. Besides the host
+// time it counts the block device reads and models the time they take on the SPI bus.
+//
+// usage: bench_verify [image KB] [SPI Hz] [us per SPI transfer]
+//   image KB            size of the image, 1024 by default
+//   SPI Hz              bus clock, 8000000 as set by w25q128_init by default
+//   us per SPI transfer cost of one read transfer besides its bytes, 50 by default
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <applibs/log.h>
+#include "littlefs/lfs.h"
+#include "sha256_accel.h"
+
+// geometry and caches of g_w25q128_littlefs_config in littlefs_w25q128.c
+#define W25Q128_PAGE_SIZE (256)
+#define W25Q128_SECTOR_SIZE (16 * W25Q128_PAGE_SIZE)
+#define W25Q128_TOTAL_SIZE (16 * 1024 * 1024)
+#define W25Q128_CACHE_SIZE (4 * W25Q128_PAGE_SIZE)
+// a read is the command byte and a 24 bit address followed by the data
+#define W25Q128_READ_HEADER 4
+
+// chunk sizes OTA_VERIFY_CHUNK accepts, the default is 16384
+static const uint32_t VerifyChunks[] = {1024, 2048, 4096, 8192, 16384, 32768, 65536};
+// bytes per lfs_file_write while the image is written, as a download writes them
+static const uint32_t WriteChunk = 4096;
+
+typedef struct {
+    uint32_t reads;
+    uint64_t bytes;
+} RamReadStats;
+
+static uint8_t *ramFlash;
+static RamReadStats readStats;
+
+static int RamRead(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    readStats.reads++;
+    readStats.bytes += size;
+    memcpy(buffer, &ramFlash[block * c->block_size + off], size);
+    return LFS_ERR_OK;
+}
+
+static int RamProg(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                   lfs_size_t size)
+{
+    // NOR flash only clears bits
+    uint8_t *dst = &ramFlash[block * c->block_size + off];
+    const uint8_t *src = buffer;
+    for (lfs_size_t i = 0; i < size; i++) {
+        dst[i] &= src[i];
+    }
+    return LFS_ERR_OK;
+}
+
+static int RamErase(const struct lfs_config *c, lfs_block_t block)
+{
+    memset(&ramFlash[block * c->block_size], 0xFF, c->block_size);
+    return LFS_ERR_OK;
+}
+
+static int RamSync(const struct lfs_config *c)
+{
+    return LFS_ERR_OK;
+}
+
+static const struct lfs_config ramConfig = {
+    .read = RamRead,
+    .prog = RamProg,
+    .erase = RamErase,
+    .sync = RamSync,
+    .read_size = 16,
+    .prog_size = W25Q128_PAGE_SIZE,
+    .block_size = W25Q128_SECTOR_SIZE,
+    .block_count = W25Q128_TOTAL_SIZE / W25Q128_SECTOR_SIZE,
+    .block_cycles = 500,
+    .cache_size = W25Q128_CACHE_SIZE,
+    .lookahead_size = 16,
+};
+
+static double GetMonotonicMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+}
+
+static int WriteImage(lfs_t *lfs, uint32_t size, sha256_digest *digest)
+{
+    sha256_accel_context ctx;
+    lfs_file_t file;
+    uint8_t *buffer = malloc(WriteChunk);
+    int result = 0;
+
+    if (buffer == NULL) {
+        return -1;
+    }
+    if (lfs_file_open(lfs, &file, "ota.bin", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) != LFS_ERR_OK) {
+        free(buffer);
+        return -1;
+    }
+
+    sha256_accel_init(&ctx);
+    for (uint32_t offset = 0; (offset < size) && (result == 0); offset += WriteChunk) {
+        uint32_t length = (size - offset < WriteChunk) ? size - offset : WriteChunk;
+        for (uint32_t i = 0; i < length; i++) {
+            buffer[i] = (uint8_t)((offset + i) * 31 + ((offset + i) >> 11));
+        }
+        sha256_accel_update(&ctx, buffer, length);
+        if (lfs_file_write(lfs, &file, buffer, length) != (lfs_ssize_t)length) {
+            result = -1;
+        }
+    }
+    sha256_accel_final(&ctx, digest);
+
+    if (lfs_file_close(lfs, &file) != LFS_ERR_OK) {
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+/// <summary>
+///     Hashes the image with reads of one chunk each, as __image_verify in ota.c.
+/// </summary>
+/// <returns>true if the hash matches</returns>
+static bool VerifyImage(lfs_t *lfs, uint32_t chunk, const sha256_digest *expected)
+{
+    sha256_accel_context ctx;
+    sha256_digest digest;
+    lfs_file_t file;
+    lfs_ssize_t nb;
+    uint8_t *buffer = malloc(chunk);
+
+    if (buffer == NULL) {
+        return false;
+    }
+    if (lfs_file_open(lfs, &file, "ota.bin", LFS_O_RDONLY) != LFS_ERR_OK) {
+        free(buffer);
+        return false;
+    }
+
+    sha256_accel_init(&ctx);
+    while ((nb = lfs_file_read(lfs, &file, buffer, chunk)) > 0) {
+        sha256_accel_update(&ctx, buffer, (size_t)nb);
+    }
+    sha256_accel_final(&ctx, &digest);
+
+    (void)lfs_file_close(lfs, &file);
+    free(buffer);
+    return (nb == 0) && sha256_digest_equal(&digest, expected);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t imageSize = ((argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 1024) * 1024;
+    double spiHz = (argc > 2) ? strtod(argv[2], NULL) : 8000000.0;
+    double transferUs = (argc > 3) ? strtod(argv[3], NULL) : 50.0;
+    sha256_digest digest;
+    lfs_t lfs;
+
+    ramFlash = malloc(W25Q128_TOTAL_SIZE);
+    if ((ramFlash == NULL) || (imageSize == 0) || (imageSize > W25Q128_TOTAL_SIZE / 2)) {
+        fprintf(stderr, "ERROR: image must be between 1 KB and %u KB\n", W25Q128_TOTAL_SIZE / 2048);
+        return EXIT_FAILURE;
+    }
+    memset(ramFlash, 0xFF, W25Q128_TOTAL_SIZE);
+
+    if ((lfs_format(&lfs, &ramConfig) != LFS_ERR_OK) || (lfs_mount(&lfs, &ramConfig) != LFS_ERR_OK) ||
+        (WriteImage(&lfs, imageSize, &digest) != 0)) {
+        fprintf(stderr, "ERROR: Could not write the image\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Verify of a %u KB image with the %s kernel, SPI at %.1f MHz and %.0f us per transfer\n",
+           imageSize / 1024, sha256_accel_kernel_name(sha256_accel_selected()), spiHz / 1e6, transferUs);
+    printf("%8s %10s %8s %10s %10s %12s\n", "chunk", "host ms", "reads", "KB read", "SPI ms", "SPI KB/s");
+
+    for (size_t i = 0; i < sizeof(VerifyChunks) / sizeof(VerifyChunks[0]); i++) {
+        double start, hostMs, spiMs;
+
+        memset(&readStats, 0, sizeof(readStats));
+        start = GetMonotonicMs();
+        if (!VerifyImage(&lfs, VerifyChunks[i], &digest)) {
+            fprintf(stderr, "ERROR: Verify with %u byte chunks failed\n", VerifyChunks[i]);
+            return EXIT_FAILURE;
+        }
+        hostMs = GetMonotonicMs() - start;
+
+        // every block device read is one SPI transfer of the read header and the data
+        spiMs = (double)readStats.reads * transferUs / 1000.0 +
+                (double)(readStats.bytes + (uint64_t)readStats.reads * W25Q128_READ_HEADER) * 8.0 / spiHz * 1000.0;
+        printf("%8u %10.2f %8u %10.1f %10.1f %12.1f\n", VerifyChunks[i], hostMs, readStats.reads,
+               (double)readStats.bytes / 1024.0, spiMs, (double)imageSize / 1024.0 / (spiMs / 1000.0));
+    }
+
+    (void)lfs_unmount(&lfs);
+    free(ramFlash);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,20 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// Host stand-in for the applibs logger, so modules of the application build into the host
+// benchmarks unchanged.
+
+#pragma once
+#include <stdarg.h>
+#include <stdio.h>
+
+static inline int Log_Debug(const char *fmt, ...)
+{
+    va_list args;
+    int result;
+
+    va_start(args, fmt);
+    result = vprintf(fmt, args);
+    va_end(args);
+    return result;
+}
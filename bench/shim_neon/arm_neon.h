@@ -0,0 +1,100 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// Portable stand-in for the NEON intrinsics used by the scanner of parson.c, lane by lane in C. It lets
+// the NEON code path build and run on a host without an ARM compiler, to check its results;
+// timings taken with it say nothing about NEON.
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t uint8x16_t __attribute__((vector_size(16)));
+typedef uint8_t uint8x8_t __attribute__((vector_size(8)));
+typedef uint16_t uint16x4_t __attribute__((vector_size(8)));
+
+static inline uint8x16_t vld1q_u8(const uint8_t *p)
+{
+    uint8x16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint8x16_t vdupq_n_u8(uint8_t x)
+{
+    uint8x16_t v;
+    for (int i = 0; i < 16; i++) {
+        v[i] = x;
+    }
+    return v;
+}
+
+static inline uint8x16_t vandq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return a & b;
+}
+
+static inline uint8x16_t vorrq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return a | b;
+}
+
+static inline uint8x16_t vmvnq_u8(uint8x16_t a)
+{
+    return ~a;
+}
+
+static inline uint8x16_t vsubq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return a - b;
+}
+
+// comparisons set all bits of a lane when true
+static inline uint8x16_t vceqq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return (uint8x16_t)(a == b);
+}
+
+static inline uint8x16_t vcleq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return (uint8x16_t)(a <= b);
+}
+
+static inline uint8x16_t vcltq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return (uint8x16_t)(a < b);
+}
+
+static inline uint8x8_t vget_low_u8(uint8x16_t a)
+{
+    uint8x8_t v;
+    memcpy(&v, &a, sizeof(v));
+    return v;
+}
+
+static inline uint8x8_t vget_high_u8(uint8x16_t a)
+{
+    uint8x8_t v;
+    memcpy(&v, (const uint8_t *)&a + 8, sizeof(v));
+    return v;
+}
+
+// sums of adjacent lanes, those of a in the low half of the result and those of b in the high half
+static inline uint8x8_t vpadd_u8(uint8x8_t a, uint8x8_t b)
+{
+    uint8x8_t v;
+    for (int i = 0; i < 4; i++) {
+        v[i] = (uint8_t)(a[2 * i] + a[2 * i + 1]);
+        v[4 + i] = (uint8_t)(b[2 * i] + b[2 * i + 1]);
+    }
+    return v;
+}
+
+static inline uint16x4_t vreinterpret_u16_u8(uint8x8_t a)
+{
+    uint16x4_t v;
+    memcpy(&v, &a, sizeof(v));
+    return v;
+}
+
+#define vget_lane_u16(v, lane) ((uint16_t)(v)[(lane)])
@@ -0,0 +1,23 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef ed25519_h
+#define ed25519_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ Ed25519 signature verification (RFC 8032), used to check OTA manifests against a public key
+ built into the application. Only verification is provided, nothing here handles secrets, so
+ the arithmetic is compact rather than constant time.
+*/
+
+#define ED25519_PUBLIC_KEY_BYTES 32
+#define ED25519_SIGNATURE_BYTES 64
+
+/* 0 if signature is a valid signature of message under public_key, -1 otherwise */
+int ed25519_verify(const uint8_t signature[ED25519_SIGNATURE_BYTES], const uint8_t *message, size_t length,
+                   const uint8_t public_key[ED25519_PUBLIC_KEY_BYTES]);
+
+#endif
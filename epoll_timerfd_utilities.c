@@ -1,7 +1,8 @@
-/* Copyright (c) Microsoft Corporation. All rights reserved.
+﻿/* Copyright (c) Microsoft Corporation. All rights reserved.
    Licensed under the MIT License. */
 
 #include <errno.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
@@ -149,4 +150,377 @@ void CloseFdAndPrintError(int fd, const char *fdName)
             Log_Debug("ERROR: Could not close fd %s: %s (%d).\n", fdName, strerror(errno), errno);
         }
     }
-}
\ No newline at end of file
+}
+
+// Timer wheel: 4 levels of 64 slots with a 1 ms tick, i.e. level L holds timers expiring
+// between 64^L and 64^(L+1) ticks ahead and covers about 4.6 hours. Timers further out are
+// parked in the last level and re-inserted when their slot is cascaded. One bitmap per level
+// records the non-empty slots, so the next event is found without walking the wheel.
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE (1ULL << (WHEEL_LEVELS * WHEEL_SLOT_BITS))
+#define WHEEL_NEVER UINT64_MAX
+
+typedef struct {
+    int timerFd;
+    struct timespec epoch;
+    // all ticks before this one have been processed
+    uint64_t now;
+    // absolute tick the timerfd is armed for, WHEEL_NEVER if disarmed
+    uint64_t armed;
+    // interval the kernel re-arms the timerfd with after 'armed', 0 if it fires once
+    uint64_t armedInterval;
+    // set while handlers run, the timerfd is armed once they are all done
+    bool dispatching;
+    uint64_t occupied[WHEEL_LEVELS];
+    WheelTimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    TimerWheelStats stats;
+} TimerWheel;
+
+static TimerWheel timerWheel = {.timerFd = -1};
+
+static void TimerWheelEventHandler(EventData *eventData);
+static EventData timerWheelEventData = {.eventHandler = &TimerWheelEventHandler};
+
+static uint64_t TimespecToTicks(const struct timespec *ts)
+{
+    // round up so a timer never fires early
+    return (uint64_t)ts->tv_sec * 1000 + ((uint64_t)ts->tv_nsec + 999999) / 1000000;
+}
+
+static uint64_t GetCurrentTick(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t ms = ((int64_t)now.tv_sec - (int64_t)timerWheel.epoch.tv_sec) * 1000 +
+                 ((int64_t)now.tv_nsec - (int64_t)timerWheel.epoch.tv_nsec) / 1000000;
+    return (uint64_t)ms;
+}
+
+static void LinkTimer(WheelTimer *timer)
+{
+    uint64_t expiry = timer->expiry < timerWheel.now ? timerWheel.now : timer->expiry;
+    uint64_t delta = expiry - timerWheel.now;
+    uint8_t level = 0;
+
+    if (delta >= WHEEL_RANGE) {
+        // parked in the last level, re-inserted with its real expiry on cascade
+        expiry = timerWheel.now + WHEEL_RANGE - 1;
+        delta = WHEEL_RANGE - 1;
+    }
+    while (delta >= (1ULL << ((level + 1) * WHEEL_SLOT_BITS))) {
+        level++;
+    }
+
+    uint8_t slot = (uint8_t)((expiry >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK);
+    WheelTimer **head = &timerWheel.slots[level][slot];
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = timer;
+    }
+    *head = timer;
+    timerWheel.occupied[level] |= 1ULL << slot;
+    timer->active = 1;
+}
+
+static void UnlinkTimer(WheelTimer *timer)
+{
+    WheelTimer **head = &timerWheel.slots[timer->level][timer->slot];
+
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *head = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    if (*head == NULL) {
+        timerWheel.occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->active = 0;
+}
+
+/// Returns the first non-empty slot of a level, searching circularly from 'from'.
+static int FindOccupiedSlot(uint8_t level, uint32_t from)
+{
+    uint64_t bits = timerWheel.occupied[level];
+    if (bits == 0) {
+        return -1;
+    }
+
+    from &= WHEEL_SLOT_MASK;
+    uint64_t rotated = from ? ((bits >> from) | (bits << (WHEEL_SLOTS - from))) : bits;
+    return (int)((from + (uint32_t)__builtin_ctzll(rotated)) & WHEEL_SLOT_MASK);
+}
+
+/// Tick at which the next occupied slot of a level needs processing: the expiry itself for
+/// level 0, the cascade of the slot for the other levels.
+static uint64_t NextLevelEvent(uint8_t level)
+{
+    if (level == 0) {
+        int slot = FindOccupiedSlot(0, (uint32_t)timerWheel.now);
+        if (slot < 0) {
+            return WHEEL_NEVER;
+        }
+        return timerWheel.now + (((uint32_t)slot - (uint32_t)timerWheel.now) & WHEEL_SLOT_MASK);
+    }
+
+    uint32_t shift = level * WHEEL_SLOT_BITS;
+    // first cascade point of this level which has not been processed yet
+    uint64_t base = (timerWheel.now + (1ULL << shift) - 1) >> shift;
+    int slot = FindOccupiedSlot(level, (uint32_t)base);
+    if (slot < 0) {
+        return WHEEL_NEVER;
+    }
+    return (base + (((uint32_t)slot - (uint32_t)base) & WHEEL_SLOT_MASK)) << shift;
+}
+
+/// Earliest expiry of all started timers, used to arm the timerfd without waking up for
+/// cascades of empty ranges.
+static uint64_t NextExpiry(void)
+{
+    uint64_t next = NextLevelEvent(0);
+
+    for (uint8_t level = 1; level < WHEEL_LEVELS; level++) {
+        uint64_t cascade = NextLevelEvent(level);
+        if (cascade >= next) {
+            continue;
+        }
+        // all timers of the slot expire within the slot's range, take the earliest
+        uint32_t shift = level * WHEEL_SLOT_BITS;
+        uint8_t slot = (uint8_t)((cascade >> shift) & WHEEL_SLOT_MASK);
+        for (WheelTimer *timer = timerWheel.slots[level][slot]; timer != NULL; timer = timer->next) {
+            if (timer->expiry < next) {
+                next = timer->expiry;
+            }
+        }
+    }
+
+    return next;
+}
+
+/// Period of a periodic timer expiring at a tick, 0 if there is none. A timer is linked in the
+/// slot of its expiry at whatever level it sits, so only one slot per level is looked at.
+static uint64_t PeriodAt(uint64_t tick)
+{
+    if (tick == WHEEL_NEVER) {
+        return 0;
+    }
+
+    for (uint8_t level = 0; level < WHEEL_LEVELS; level++) {
+        uint8_t slot = (uint8_t)((tick >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK);
+        for (WheelTimer *timer = timerWheel.slots[level][slot]; timer != NULL; timer = timer->next) {
+            if ((timer->expiry == tick) && (timer->period > 0)) {
+                return timer->period;
+            }
+        }
+    }
+    return 0;
+}
+
+static void ArmTimerWheel(void)
+{
+    uint64_t next = NextExpiry();
+    if (next == timerWheel.armed) {
+        // includes the expiries the kernel re-armed on its own from the interval
+        return;
+    }
+
+    // When the next expiry is a periodic timer the kernel re-arms the timerfd with its period,
+    // so while that timer is the only one due, a wakeup costs no timerfd_settime. Any other
+    // expiry in between re-arms the timerfd, a spurious wakeup after a cancel does the same.
+    uint64_t interval = PeriodAt(next);
+    struct itimerspec newValue = {.it_interval = {(time_t)(interval / 1000), (long)(interval % 1000) * 1000000},
+                                  .it_value = {0, 0}};
+    if (next != WHEEL_NEVER) {
+        // absolute expiry relative to the wheel epoch, so re-arming does not accumulate drift
+        uint64_t nsec = (uint64_t)timerWheel.epoch.tv_nsec + (next % 1000) * 1000000;
+        newValue.it_value.tv_sec = timerWheel.epoch.tv_sec + (time_t)(next / 1000 + nsec / 1000000000);
+        newValue.it_value.tv_nsec = (long)(nsec % 1000000000);
+    }
+
+    timerWheel.stats.syscalls++;
+    if (timerfd_settime(timerWheel.timerFd, TFD_TIMER_ABSTIME, &newValue, NULL) < 0) {
+        Log_Debug("ERROR: Could not arm timer wheel: %s (%d).\n", strerror(errno), errno);
+        return;
+    }
+    timerWheel.armed = next;
+    timerWheel.armedInterval = interval;
+}
+
+static void CascadeSlot(uint8_t level, uint8_t slot)
+{
+    WheelTimer *timer = timerWheel.slots[level][slot];
+
+    timerWheel.slots[level][slot] = NULL;
+    timerWheel.occupied[level] &= ~(1ULL << slot);
+
+    while (timer != NULL) {
+        WheelTimer *next = timer->next;
+        LinkTimer(timer);
+        timer = next;
+    }
+}
+
+static void ProcessTick(uint64_t tick)
+{
+    uint8_t slot = (uint8_t)(tick & WHEEL_SLOT_MASK);
+
+    // at each boundary of a level, move the timers of the next range one level down
+    for (uint8_t level = 1; level < WHEEL_LEVELS; level++) {
+        uint32_t shift = level * WHEEL_SLOT_BITS;
+        if ((tick & ((1ULL << shift) - 1)) != 0) {
+            break;
+        }
+        CascadeSlot(level, (uint8_t)((tick >> shift) & WHEEL_SLOT_MASK));
+    }
+
+    // handlers may start or cancel any timer, so restart the scan after each one. Timers
+    // re-started by a handler land in later ticks because 'now' has already moved on.
+    timerWheel.now = tick + 1;
+    for (;;) {
+        WheelTimer *timer = timerWheel.slots[0][slot];
+        while ((timer != NULL) && (timer->expiry > tick)) {
+            timer = timer->next;
+        }
+        if (timer == NULL) {
+            break;
+        }
+
+        UnlinkTimer(timer);
+        if (timer->period > 0) {
+            timer->expiry += timer->period;
+            if (timer->expiry <= tick) {
+                // fell behind by more than a period, skip the missed expiries
+                timer->expiry = tick + timer->period;
+            }
+            LinkTimer(timer);
+        }
+
+        timerWheel.stats.expirations++;
+        timer->handler(timer);
+    }
+}
+
+static void TimerWheelEventHandler(EventData *eventData)
+{
+    uint64_t timerData = 0;
+
+    (void)eventData;
+    timerWheel.stats.wakeups++;
+    timerWheel.stats.syscalls++;
+    if (read(timerWheel.timerFd, &timerData, sizeof(timerData)) == -1 && errno != EAGAIN) {
+        Log_Debug("ERROR: Could not read timer wheel %s (%d).\n", strerror(errno), errno);
+    }
+    timerWheel.dispatching = true;
+
+    uint64_t current = GetCurrentTick();
+    if (timerWheel.armed <= current) {
+        if (timerWheel.armedInterval > 0) {
+            // the kernel is armed for the first interval after the expiries it counted
+            uint64_t interval = timerWheel.armedInterval;
+            timerWheel.armed += ((current - timerWheel.armed) / interval + 1) * interval;
+        } else {
+            timerWheel.armed = WHEEL_NEVER;
+        }
+    }
+    while (timerWheel.now <= current) {
+        ProcessTick(timerWheel.now);
+
+        // jump over ticks with nothing to expire or cascade
+        uint64_t next = timerWheel.now;
+        for (uint8_t level = 0; level < WHEEL_LEVELS; level++) {
+            uint64_t event = NextLevelEvent(level);
+            next = (level == 0 || event < next) ? event : next;
+        }
+        timerWheel.now = (next > current) ? current + 1 : next;
+    }
+
+    timerWheel.dispatching = false;
+    ArmTimerWheel();
+}
+
+int CreateTimerWheelAndAddToEpoll(int epollFd)
+{
+    memset(&timerWheel, 0, sizeof(timerWheel));
+    timerWheel.armed = WHEEL_NEVER;
+    clock_gettime(CLOCK_MONOTONIC, &timerWheel.epoch);
+
+    timerWheel.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerWheel.timerFd < 0) {
+        Log_Debug("ERROR: Could not create timerfd: %s (%d).\n", strerror(errno), errno);
+        return -1;
+    }
+
+    if (RegisterEventHandlerToEpoll(epollFd, timerWheel.timerFd, &timerWheelEventData, EPOLLIN) != 0) {
+        CloseTimerWheel();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int StartWheelTimerInternal(WheelTimer *timer, uint64_t delay, uint64_t period)
+{
+    if (timerWheel.timerFd < 0) {
+        Log_Debug("ERROR: Timer wheel is not created.\n");
+        return -1;
+    }
+
+    if (timer->active) {
+        UnlinkTimer(timer);
+    }
+
+    // ticks elapsed since the last wakeup have not been processed yet, count from real time
+    timer->expiry = GetCurrentTick() + delay;
+    timer->period = period;
+    LinkTimer(timer);
+    if (!timerWheel.dispatching) {
+        ArmTimerWheel();
+    }
+
+    return 0;
+}
+
+int StartWheelTimer(WheelTimer *timer, const struct timespec *period)
+{
+    uint64_t ticks = TimespecToTicks(period);
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    return StartWheelTimerInternal(timer, ticks, ticks);
+}
+
+int StartWheelTimerOnce(WheelTimer *timer, const struct timespec *expiry)
+{
+    return StartWheelTimerInternal(timer, TimespecToTicks(expiry), 0);
+}
+
+void CancelWheelTimer(WheelTimer *timer)
+{
+    if (timer->active) {
+        UnlinkTimer(timer);
+        // the timerfd is left armed, an early wakeup finds nothing to expire and re-arms
+    }
+}
+
+void GetTimerWheelStats(TimerWheelStats *stats)
+{
+    *stats = timerWheel.stats;
+}
+
+void CloseTimerWheel(void)
+{
+    CloseFdAndPrintError(timerWheel.timerFd, "TimerWheel");
+    timerWheel.timerFd = -1;
+}
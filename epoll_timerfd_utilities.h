@@ -2,6 +2,7 @@
    Licensed under the MIT License. */
 
 #pragma once
+#include <stdint.h>
 #include <time.h>
 #include <sys/epoll.h>
 #include <unistd.h>
@@ -110,4 +111,87 @@ int WaitForEventAndCallHandler(int epollFd);
 /// </summary>
 /// <param name="fd">File descriptor to close</param>
 /// <param name="name">File descriptor name to use in error message</param>
-void CloseFdAndPrintError(int fd, const char *name);
\ No newline at end of file
+void CloseFdAndPrintError(int fd, const char *name);
+
+/// Forward declaration of the timer type multiplexed on the timer wheel.
+struct WheelTimer;
+
+/// <summary>
+///     Function signature for timer wheel handlers.
+/// </summary>
+/// <param name="timer">The timer which expired</param>
+typedef void (*WheelTimerHandler)(struct WheelTimer *timer);
+
+/// <summary>
+/// <para>A one-shot or periodic timer served by the timer wheel.</para>
+/// <para>Only the handler field needs to be populated, the remaining fields are owned by the
+/// timer wheel. The timer must stay in memory while it is started.</para>
+/// </summary>
+/// <seealso cref="StartWheelTimer" />
+typedef struct WheelTimer {
+    /// <summary>
+    /// Function which is called when the timer expires.
+    /// </summary>
+    WheelTimerHandler handler;
+    struct WheelTimer *next;
+    struct WheelTimer *prev;
+    uint64_t expiry;
+    uint64_t period;
+    uint8_t level;
+    uint8_t slot;
+    uint8_t active;
+} WheelTimer;
+
+/// <summary>
+///     Counters of the timer wheel since it was created.
+/// </summary>
+typedef struct {
+    /// <summary>Number of times the timer wheel's timerfd woke up the epoll loop</summary>
+    uint32_t wakeups;
+    /// <summary>Number of timer handlers called</summary>
+    uint32_t expirations;
+    /// <summary>Number of timerfd_settime and read calls made by the timer wheel</summary>
+    uint32_t syscalls;
+} TimerWheelStats;
+
+/// <summary>
+///     Creates the timer wheel and adds its single timerfd to an epoll instance. All timers
+///     started with StartWheelTimer or StartWheelTimerOnce are multiplexed on this timerfd, with
+///     a resolution of 1 ms.
+/// </summary>
+/// <param name="epollFd">Epoll file descriptor</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int CreateTimerWheelAndAddToEpoll(int epollFd);
+
+/// <summary>
+///     Starts or restarts a periodic timer. The first expiry is one period from now.
+/// </summary>
+/// <param name="timer">Timer with its handler populated</param>
+/// <param name="period">The timer period</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int StartWheelTimer(WheelTimer *timer, const struct timespec *period);
+
+/// <summary>
+///     Starts or restarts a timer to fire once only.
+/// </summary>
+/// <param name="timer">Timer with its handler populated</param>
+/// <param name="expiry">The time elapsed before it expires once, may be zero</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int StartWheelTimerOnce(WheelTimer *timer, const struct timespec *expiry);
+
+/// <summary>
+///     Stops a timer. Does nothing if the timer is not started.
+/// </summary>
+/// <param name="timer">The timer to stop</param>
+void CancelWheelTimer(WheelTimer *timer);
+
+/// <summary>
+///     Gets the counters of the timer wheel.
+/// </summary>
+/// <param name="stats">Receives the counters</param>
+void GetTimerWheelStats(TimerWheelStats *stats);
+
+/// <summary>
+///     Closes the timer wheel's timerfd. Started timers are abandoned.
+/// </summary>
+void CloseTimerWheel(void);
@@ -0,0 +1,160 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+// Applibs does not deliver GPIO edge notifications to high-level applications, so buttons are
+// sampled from a timer. To keep the main thread asleep most of the time the timer runs at a slow
+// idle period and only switches to a fast period for a short while after a button changes state.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "applibs_versions.h"
+#include <applibs/log.h>
+#include <applibs/gpio.h>
+
+#include "epoll_timerfd_utilities.h"
+#include "input.h"
+
+#define MAX_INPUT_BUTTONS 4
+
+// sample period while no button has changed recently. The first press after a quiet period is
+// only seen if it lasts at least this long, so it is kept below the shortest deliberate tap
+// (about 30 ms)
+static const struct timespec InputIdlePeriod = {0, 20 * 1000 * 1000};
+// sample period right after a button changed, to catch quick repeated taps and releases
+static const struct timespec InputFastPeriod = {0, 5 * 1000 * 1000};
+// number of fast samples without any change before going back to idle (1 s)
+static const uint32_t InputFastSamples = 200;
+// wakeup counters are logged once per period
+static const time_t InputStatsPeriodSeconds = 60;
+
+typedef struct {
+    int gpioFd;
+    GPIO_Value_Type state;
+    ButtonPressHandler handler;
+} InputButton;
+
+static InputButton buttons[MAX_INPUT_BUTTONS];
+static uint32_t buttonCount = 0;
+static InputErrorHandler inputErrorHandler = NULL;
+static bool fastMode = false;
+static uint32_t quietSamples = 0;
+static InputStats stats;
+static InputStats lastLoggedStats;
+static time_t lastLoggedTime = 0;
+
+static void InputTimerEventHandler(WheelTimer *timer);
+static WheelTimer inputTimer = {.handler = &InputTimerEventHandler};
+
+static time_t GetMonotonicSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static void LogInputStats(void)
+{
+    time_t now = GetMonotonicSeconds();
+    if (now - lastLoggedTime < InputStatsPeriodSeconds) {
+        return;
+    }
+
+    Log_Debug("INFO: Input wakeups %u/min (%u fast), %u presses\n",
+              (uint32_t)((stats.wakeups - lastLoggedStats.wakeups) * 60 / (now - lastLoggedTime)),
+              stats.fastWakeups - lastLoggedStats.fastWakeups, stats.presses - lastLoggedStats.presses);
+
+    lastLoggedStats = stats;
+    lastLoggedTime = now;
+}
+
+static void SetInputMode(bool fast)
+{
+    if (fast != fastMode) {
+        fastMode = fast;
+        StartWheelTimer(&inputTimer, fast ? &InputFastPeriod : &InputIdlePeriod);
+    }
+}
+
+static void InputTimerEventHandler(WheelTimer *timer)
+{
+    bool changed = false;
+
+    stats.wakeups++;
+    if (fastMode) {
+        stats.fastWakeups++;
+    }
+
+    for (uint32_t i = 0; i < buttonCount; i++) {
+        GPIO_Value_Type newState;
+        if (GPIO_GetValue(buttons[i].gpioFd, &newState) != 0) {
+            Log_Debug("ERROR: Could not read button GPIO: %s (%d).\n", strerror(errno), errno);
+            inputErrorHandler();
+            return;
+        }
+
+        if (newState != buttons[i].state) {
+            changed = true;
+            buttons[i].state = newState;
+            // Button is pressed if it is low and different than last known state.
+            if (newState == GPIO_Value_Low) {
+                stats.presses++;
+                buttons[i].handler();
+            }
+        }
+    }
+
+    if (changed) {
+        quietSamples = 0;
+        SetInputMode(true);
+    } else if (fastMode && (++quietSamples >= InputFastSamples)) {
+        SetInputMode(false);
+    }
+
+    LogInputStats();
+}
+
+int InitInput(InputErrorHandler errorHandler)
+{
+    inputErrorHandler = errorHandler;
+    buttonCount = 0;
+    fastMode = false;
+    quietSamples = 0;
+    memset(&stats, 0, sizeof(stats));
+    memset(&lastLoggedStats, 0, sizeof(lastLoggedStats));
+    lastLoggedTime = GetMonotonicSeconds();
+
+    if (StartWheelTimer(&inputTimer, &InputIdlePeriod) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int AddInputButton(int gpioFd, ButtonPressHandler handler)
+{
+    if (buttonCount >= MAX_INPUT_BUTTONS) {
+        Log_Debug("ERROR: Too many input buttons\n");
+        return -1;
+    }
+
+    buttons[buttonCount].gpioFd = gpioFd;
+    buttons[buttonCount].state = GPIO_Value_High;
+    buttons[buttonCount].handler = handler;
+    buttonCount++;
+
+    return 0;
+}
+
+void GetInputStats(InputStats *outStats)
+{
+    *outStats = stats;
+}
+
+void CloseInput(void)
+{
+    CancelWheelTimer(&inputTimer);
+    buttonCount = 0;
+}
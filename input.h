@@ -0,0 +1,58 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stdint.h>
+
+/// <summary>
+///     Function signature for button press handlers.
+/// </summary>
+typedef void (*ButtonPressHandler)(void);
+
+/// <summary>
+///     Function signature for the handler called when a button can no longer be read.
+/// </summary>
+typedef void (*InputErrorHandler)(void);
+
+/// <summary>
+///     Wakeup counters of the input subsystem since InitInput.
+/// </summary>
+typedef struct {
+    /// <summary>Number of times the main thread was woken up to sample buttons</summary>
+    uint32_t wakeups;
+    /// <summary>Wakeups spent in the fast sampling mode after recent activity</summary>
+    uint32_t fastWakeups;
+    /// <summary>Number of button presses delivered to handlers</summary>
+    uint32_t presses;
+} InputStats;
+
+/// <summary>
+///     Creates the input subsystem and starts its timer on the timer wheel, which must have
+///     been created. Buttons are sampled at a slow idle rate (20 ms) and switch to a fast
+///     rate (5 ms) for a short while after any button changes state. A press that follows
+///     a quiet period must therefore last at least 20 ms to be detected; later presses
+///     within the fast window only need 5 ms.
+/// </summary>
+/// <param name="errorHandler">Called when reading a button fails</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int InitInput(InputErrorHandler errorHandler);
+
+/// <summary>
+///     Adds a button which is active low.
+/// </summary>
+/// <param name="gpioFd">GPIO file descriptor opened as input</param>
+/// <param name="handler">Called each time the button is pressed</param>
+/// <returns>0 on success, or -1 if no more buttons can be added</returns>
+int AddInputButton(int gpioFd, ButtonPressHandler handler);
+
+/// <summary>
+///     Gets the wakeup counters of the input subsystem.
+/// </summary>
+/// <param name="stats">Receives the counters</param>
+void GetInputStats(InputStats *stats);
+
+/// <summary>
+///     Releases the resources of the input subsystem. Button file descriptors are owned
+///     by the caller and are not closed.
+/// </summary>
+void CloseInput(void);
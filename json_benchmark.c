@@ -0,0 +1,512 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <applibs/log.h>
+
+#include "json_benchmark.h"
+#include "json_scan.h"
+#include "parson.h"
+
+// every measurement repeats its operation for at least this long
+#define BENCH_MIN_S 0.05
+#define BENCH_DOC_SIZE 16384
+#define BENCH_MAX_KEYS 4096
+// large enough for any generated request, the peak tells how much of it a parse needed
+#define BENCH_ARENA_SIZE 65536
+// room in front of every counted allocation for its size, keeps the alignment of malloc
+#define BENCH_HEAP_HEADER 16
+
+struct bench_doc_t {
+    char text[BENCH_DOC_SIZE];
+    size_t len;
+};
+
+struct bench_twin_t {
+    const char *name;
+    uint32_t targets; // 0 for the flat form of a single image
+    uint32_t mirrors;
+};
+
+// the flat request of a single image up to the largest request ota.py can deploy
+static const struct bench_twin_t bench_twins[] = {
+    {"1 image", 0, 0},
+    {"4 targets", 4, 0},
+    {"4 + mirrors", 4, 2},
+};
+
+// scanner parson.c was built with, selected by the same conditions
+#if !defined(PARSON_NO_SIMD) && defined(__SSE2__)
+#define BENCH_SCANNER "sse2"
+#elif !defined(PARSON_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define BENCH_SCANNER "neon"
+#else
+#define BENCH_SCANNER "scalar"
+#endif
+
+// strings of the string heavy document, the escapes take the slow path of the scanner
+#define BENCH_STRINGS 48
+#define BENCH_STRING_NOTE "caf\\u00e9 \\\"quoted\\\" C:\\\\ota\\n"
+#define BENCH_STRING_NOTE_DECODED "caf\xc3\xa9 \"quoted\" C:\\ota\n"
+
+// key counts of the objects looked up, the index is built from 16 keys on
+static const uint32_t bench_key_counts[] = {8, 16, 64, 256, 1024, 4096};
+
+// parson allocations while the heap is counted
+static size_t bench_heap_used;
+static size_t bench_heap_peak;
+static uint32_t bench_heap_allocs;
+
+static double __now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// ns per call of fn, called until BENCH_MIN_S elapsed
+static double __bench_ns(void (*fn)(void *), void *arg)
+{
+    uint32_t calls = 0;
+    double start = __now_s();
+    double elapsed;
+
+    do {
+        fn(arg);
+        calls++;
+        elapsed = __now_s() - start;
+    } while (elapsed < BENCH_MIN_S);
+
+    return elapsed * 1e9 / calls;
+}
+
+static void *__bench_malloc(size_t size)
+{
+    char *p_block = malloc(BENCH_HEAP_HEADER + size);
+
+    if (p_block == NULL) {
+        return NULL;
+    }
+    *(size_t *)p_block = size;
+    bench_heap_used += size;
+    bench_heap_allocs++;
+    if (bench_heap_used > bench_heap_peak) {
+        bench_heap_peak = bench_heap_used;
+    }
+    return p_block + BENCH_HEAP_HEADER;
+}
+
+static void __bench_free(void *p)
+{
+    if (p != NULL) {
+        char *p_block = (char *)p - BENCH_HEAP_HEADER;
+        bench_heap_used -= *(size_t *)p_block;
+        free(p_block);
+    }
+}
+
+static void __doc_append(struct bench_doc_t *p_doc, const char *p_format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, p_format);
+    len = vsnprintf(&p_doc->text[p_doc->len], sizeof(p_doc->text) - p_doc->len, p_format, args);
+    va_end(args);
+
+    if (len > 0) {
+        p_doc->len += (size_t)len;
+        if (p_doc->len >= sizeof(p_doc->text)) {
+            p_doc->len = sizeof(p_doc->text) - 1;
+        }
+    }
+}
+
+// upper case hex digits, e.g. of a sha256 or a signature
+static void __doc_hex_digits(struct bench_doc_t *p_doc, uint32_t digits, uint32_t seed)
+{
+    for (uint32_t i = 0; i < digits; i++) {
+        __doc_append(p_doc, "%X", (seed * 2654435761u + i * 40503u) >> 28);
+    }
+}
+
+static void __doc_hex(struct bench_doc_t *p_doc, const char *p_key, uint32_t digits, uint32_t seed)
+{
+    __doc_append(p_doc, "\"%s\":\"", p_key);
+    __doc_hex_digits(p_doc, digits, seed);
+    __doc_append(p_doc, "\",");
+}
+
+static void __doc_image(struct bench_doc_t *p_doc, const char *p_file, uint32_t version, uint32_t seed)
+{
+    __doc_append(p_doc, "\"version\":%u,\"size\":%u,", version, 262144 + seed * 4096);
+    __doc_append(p_doc, "\"url\":\"https://yourstroageaccount.blob.core.windows.net/ota/%s.bin\",", p_file);
+    __doc_hex(p_doc, "sha256", 64, seed);
+    __doc_append(p_doc, "\"manifest\":\"https://yourstroageaccount.blob.core.windows.net/ota/%s.bin.manifest\",",
+                 p_file);
+    __doc_append(p_doc, "\"chunkSize\":16384,");
+    __doc_hex(p_doc, "root", 64, seed + 1);
+}
+
+// extFwInfo as written by ota.py, the targets request is signed
+static void __doc_ext_fw_info(struct bench_doc_t *p_doc, const struct bench_twin_t *p_twin)
+{
+    static const char *mcus[] = {"mcu", "ble", "wifi", "motor"};
+
+    __doc_append(p_doc, "{");
+    if (p_twin->targets == 0) {
+        __doc_image(p_doc, "mcu", 5, 1);
+    } else {
+        __doc_append(p_doc, "\"version\":6,\"targets\":[");
+        for (uint32_t i = 0; i < p_twin->targets; i++) {
+            __doc_append(p_doc, "%s{", (i > 0) ? "," : "");
+            __doc_image(p_doc, mcus[i % 4], 3 + i, 10 + i);
+            __doc_hex(p_doc, "signature", 128, 20 + i);
+            __doc_append(p_doc, "\"mcu\":\"%s\"}", mcus[i % 4]);
+        }
+        __doc_append(p_doc, "],\"concurrency\":2,");
+    }
+    if (p_twin->mirrors > 0) {
+        __doc_append(p_doc, "\"mirrors\":[");
+        for (uint32_t i = 0; i < p_twin->mirrors; i++) {
+            __doc_append(p_doc, "%s\"http://192.168.1.%u:8080\"", (i > 0) ? "," : "", 10 + i);
+        }
+        __doc_append(p_doc, "],\"maxRate\":65536,\"window\":\"01:00-05:00\",\"maxBacklog\":16384,");
+    }
+    __doc_append(p_doc, "\"sas\":\"sv=2020-08-04&ss=b&srt=co&sp=rl&se=2026-11-18T00:00:00Z"
+                        "&st=2026-10-18T00:00:00Z&spr=https&sig=Zm9vYmFyYmF6cXV4Zm9vYmFyYmF6cXV4Zm9vYmFy%%3D\"}");
+}
+
+// full twin as delivered on connect: desired and reported properties of an updated device
+static void __doc_twin(struct bench_doc_t *p_doc, const struct bench_twin_t *p_twin)
+{
+    p_doc->len = 0;
+    __doc_append(p_doc, "{\"desired\":{\"extFwInfo\":");
+    __doc_ext_fw_info(p_doc, p_twin);
+    __doc_append(p_doc, ",\"trace\":{\"mask\":0,\"dump\":false},\"$version\":12},\"reported\":{");
+    __doc_append(p_doc, "\"extFwInfo\":{\"Status\":\"applied\",\"Error\":\"none\",\"Version\":5,"
+                        "\"Progress\":{\"Bytes\":270336,\"Total\":270336,\"Rate\":48211,\"AvgRate\":45102,"
+                        "\"RateCap\":65536,\"Paused\":\"none\",\"Eta\":0}");
+    if (p_twin->targets > 0) {
+        __doc_append(p_doc, ",\"Targets\":{");
+        for (uint32_t i = 0; i < p_twin->targets; i++) {
+            __doc_append(p_doc, "%s\"t%u\":{\"Status\":\"applied\",\"Error\":\"none\",\"Version\":%u,"
+                                "\"Progress\":{\"Bytes\":270336,\"Total\":270336,\"Rate\":0,\"AvgRate\":45102}}",
+                         (i > 0) ? "," : "", i, 3 + i);
+        }
+        __doc_append(p_doc, "}");
+    }
+    __doc_append(p_doc, "},\"trace\":{\"mask\":0},\"$version\":40}}");
+}
+
+struct bench_parse_t {
+    struct bench_doc_t *p_doc;
+    JSON_Slice slice;
+    char slice_text[BENCH_DOC_SIZE];
+    char situ_text[BENCH_DOC_SIZE];
+    JSON_Arena arena;
+    uint64_t arena_block[BENCH_ARENA_SIZE / sizeof(uint64_t)];
+};
+
+// what the twin callback did before the scanner: parse everything, then look up the request
+static void __bench_parse_full(void *arg)
+{
+    struct bench_parse_t *p_parse = arg;
+    JSON_Value *p_root = json_parse_string(p_parse->p_doc->text);
+
+    (void)json_object_dotget_object(json_value_get_object(p_root), "desired.extFwInfo");
+    json_value_free(p_root);
+}
+
+static void __bench_scan(void *arg)
+{
+    struct bench_parse_t *p_parse = arg;
+
+    (void)json_scan_dotget(p_parse->p_doc->text, p_parse->p_doc->len, "desired.extFwInfo", &p_parse->slice);
+}
+
+// locates the request and parses only its slice
+static void __bench_scan_parse(void *arg)
+{
+    struct bench_parse_t *p_parse = arg;
+
+    if (json_scan_dotget(p_parse->p_doc->text, p_parse->p_doc->len, "desired.extFwInfo", &p_parse->slice) ==
+        JSONScanFound) {
+        memcpy(p_parse->slice_text, p_parse->slice.ptr, p_parse->slice.len);
+        p_parse->slice_text[p_parse->slice.len] = 0;
+        json_value_free(json_parse_string(p_parse->slice_text));
+    }
+}
+
+static void __bench_parse_heap(void *arg)
+{
+    struct bench_parse_t *p_parse = arg;
+
+    json_value_free(json_parse_string(p_parse->slice_text));
+}
+
+// the twin callback: the slice is copied and parsed in place with the nodes in the arena
+static void __bench_parse_arena(void *arg)
+{
+    struct bench_parse_t *p_parse = arg;
+
+    memcpy(p_parse->situ_text, p_parse->slice_text, p_parse->slice.len + 1);
+    (void)json_parse_string_in_situ_with_arena(p_parse->situ_text, &p_parse->arena);
+    json_arena_release(&p_parse->arena);
+}
+
+static void __bench_arena(struct bench_parse_t *p_parse)
+{
+    for (size_t i = 0; i < sizeof(bench_twins) / sizeof(bench_twins[0]); i++) {
+        double heap_ns, arena_ns;
+        size_t heap_peak;
+        uint32_t heap_allocs;
+
+        __doc_twin(p_parse->p_doc, &bench_twins[i]);
+        if (json_scan_dotget(p_parse->p_doc->text, p_parse->p_doc->len, "desired.extFwInfo", &p_parse->slice) !=
+            JSONScanFound) {
+            continue;
+        }
+        memcpy(p_parse->slice_text, p_parse->slice.ptr, p_parse->slice.len);
+        p_parse->slice_text[p_parse->slice.len] = 0;
+
+        heap_ns = __bench_ns(__bench_parse_heap, p_parse);
+        bench_heap_used = 0;
+        bench_heap_peak = 0;
+        bench_heap_allocs = 0;
+        json_set_allocation_functions(__bench_malloc, __bench_free);
+        __bench_parse_heap(p_parse);
+        json_set_allocation_functions(malloc, free);
+        heap_peak = bench_heap_peak;
+        heap_allocs = bench_heap_allocs;
+
+        json_arena_init(&p_parse->arena, p_parse->arena_block, sizeof(p_parse->arena_block));
+        arena_ns = __bench_ns(__bench_parse_arena, p_parse);
+
+        Log_Debug("INFO: json extFwInfo %-11s %5zu B: heap %6.1f us, %4u allocs, peak %6zu B; "
+                  "arena %6.1f us, peak %6zu B\n",
+                  bench_twins[i].name, p_parse->slice.len, heap_ns / 1e3, heap_allocs, heap_peak,
+                  arena_ns / 1e3, p_parse->arena.peak);
+    }
+}
+
+struct bench_lookup_t {
+    JSON_Object *p_object;
+    const char *names[BENCH_MAX_KEYS];
+    size_t count;
+};
+
+// every key of the object through json_object_get_value, hashed from INDEX_THRESHOLD keys on
+static void __bench_lookup_index(void *arg)
+{
+    struct bench_lookup_t *p_lookup = arg;
+
+    for (size_t i = 0; i < p_lookup->count; i++) {
+        (void)json_object_get_value(p_lookup->p_object, p_lookup->names[i]);
+    }
+}
+
+// every key of the object with the linear search parson did before the index
+static void __bench_lookup_linear(void *arg)
+{
+    struct bench_lookup_t *p_lookup = arg;
+
+    for (size_t i = 0; i < p_lookup->count; i++) {
+        size_t name_len = strlen(p_lookup->names[i]);
+        for (size_t j = 0; j < json_object_get_count(p_lookup->p_object); j++) {
+            const char *p_name = json_object_get_name(p_lookup->p_object, j);
+            if ((strlen(p_name) == name_len) && (strncmp(p_name, p_lookup->names[i], name_len) == 0)) {
+                (void)json_object_get_value_at(p_lookup->p_object, j);
+                break;
+            }
+        }
+    }
+}
+
+static void __bench_lookup(struct bench_lookup_t *p_lookup)
+{
+    for (size_t i = 0; i < sizeof(bench_key_counts) / sizeof(bench_key_counts[0]); i++) {
+        JSON_Value *p_value;
+        double index_ns, linear_ns;
+
+        p_value = json_value_init_object();
+        p_lookup->p_object = json_value_get_object(p_value);
+        for (uint32_t k = 0; k < bench_key_counts[i]; k++) {
+            char name[16];
+            (void)snprintf(name, sizeof(name), "prop%04u", k);
+            (void)json_object_set_number(p_lookup->p_object, name, k);
+        }
+        p_lookup->count = json_object_get_count(p_lookup->p_object);
+        for (size_t k = 0; k < p_lookup->count; k++) {
+            p_lookup->names[k] = json_object_get_name(p_lookup->p_object, k);
+        }
+
+        index_ns = __bench_ns(__bench_lookup_index, p_lookup) / p_lookup->count;
+        linear_ns = __bench_ns(__bench_lookup_linear, p_lookup) / p_lookup->count;
+        Log_Debug("INFO: json object %4zu keys: lookup %6.1f ns, linear search %8.1f ns\n", p_lookup->count,
+                  index_ns, linear_ns);
+
+        json_value_free(p_value);
+    }
+}
+
+struct bench_report_t {
+    JSON_Value *p_root;
+    JSON_Buffer buffer;
+};
+
+// the reported properties path: one walk into a buffer that is kept across reports
+static void __bench_serialize_buffer(void *arg)
+{
+    struct bench_report_t *p_report = arg;
+
+    (void)json_serialize_to_json_buffer(p_report->p_root, &p_report->buffer);
+}
+
+// the two pass path of parson: a walk to size the string, a malloc and a second walk to fill it
+static void __bench_serialize_string(void *arg)
+{
+    struct bench_report_t *p_report = arg;
+
+    json_free_serialized_string(json_serialize_to_string(p_report->p_root));
+}
+
+static void __bench_serialize(struct bench_parse_t *p_parse)
+{
+    struct bench_report_t report;
+
+    json_buffer_init(&report.buffer);
+    for (size_t i = 0; i < sizeof(bench_twins) / sizeof(bench_twins[0]); i++) {
+        double buffer_ns, string_ns;
+
+        __doc_twin(p_parse->p_doc, &bench_twins[i]);
+        if (json_scan_dotget(p_parse->p_doc->text, p_parse->p_doc->len, "reported", &p_parse->slice) !=
+            JSONScanFound) {
+            continue;
+        }
+        memcpy(p_parse->slice_text, p_parse->slice.ptr, p_parse->slice.len);
+        p_parse->slice_text[p_parse->slice.len] = 0;
+        report.p_root = json_parse_string(p_parse->slice_text);
+        if (report.p_root == NULL) {
+            continue;
+        }
+
+        buffer_ns = __bench_ns(__bench_serialize_buffer, &report);
+        string_ns = __bench_ns(__bench_serialize_string, &report);
+        Log_Debug("INFO: json report %-11s %5zu B: json buffer %6.1f us, size + string %6.1f us\n",
+                  bench_twins[i].name, report.buffer.length, buffer_ns / 1e3, string_ns / 1e3);
+
+        json_value_free(report.p_root);
+    }
+    json_buffer_free(&report.buffer);
+}
+
+// the twin callback path on a whole document, so the time is spent scanning rather than copying
+static void __bench_parse_doc(void *arg)
+{
+    struct bench_parse_t *p_parse = arg;
+
+    memcpy(p_parse->situ_text, p_parse->p_doc->text, p_parse->p_doc->len + 1);
+    (void)json_parse_string_in_situ_with_arena(p_parse->situ_text, &p_parse->arena);
+    json_arena_release(&p_parse->arena);
+}
+
+static void __bench_throughput_run(struct bench_parse_t *p_parse, const char *p_name)
+{
+    Log_Debug("INFO: json parse %-6s %-13s %5zu B: %6.1f MB/s\n", BENCH_SCANNER, p_name, p_parse->p_doc->len,
+              p_parse->p_doc->len / __bench_ns(__bench_parse_doc, p_parse) * 1e3);
+}
+
+// parse throughput of the largest twin, compact and indented, and of long strings with escapes
+static void __bench_throughput(struct bench_parse_t *p_parse)
+{
+    struct bench_doc_t *p_doc = p_parse->p_doc;
+    JSON_Value *p_value;
+    char *p_pretty;
+    const char *p_string;
+
+    json_arena_init(&p_parse->arena, p_parse->arena_block, sizeof(p_parse->arena_block));
+
+    __doc_twin(p_doc, &bench_twins[sizeof(bench_twins) / sizeof(bench_twins[0]) - 1]);
+    __bench_throughput_run(p_parse, "twin");
+
+    p_value = json_parse_string(p_doc->text);
+    p_pretty = json_serialize_to_string_pretty(p_value);
+    json_value_free(p_value);
+    if ((p_pretty != NULL) && (strlen(p_pretty) < sizeof(p_doc->text))) {
+        p_doc->len = strlen(p_pretty);
+        memcpy(p_doc->text, p_pretty, p_doc->len + 1);
+        __bench_throughput_run(p_parse, "indented twin");
+    }
+    json_free_serialized_string(p_pretty);
+
+    p_doc->len = 0;
+    __doc_append(p_doc, "[");
+    for (uint32_t i = 0; i < BENCH_STRINGS; i++) {
+        __doc_append(p_doc, "%s\"%s", (i > 0) ? "," : "", (i % 4 == 0) ? BENCH_STRING_NOTE : "");
+        __doc_hex_digits(p_doc, 128, i);
+        __doc_append(p_doc, "\"");
+    }
+    __doc_append(p_doc, "]");
+
+    // the scanner has to find the end of every string and keep its escapes
+    p_value = json_parse_string(p_doc->text);
+    p_string = json_array_get_string(json_value_get_array(p_value), 0);
+    if ((json_array_get_count(json_value_get_array(p_value)) != BENCH_STRINGS) || (p_string == NULL) ||
+        (strncmp(p_string, BENCH_STRING_NOTE_DECODED, strlen(BENCH_STRING_NOTE_DECODED)) != 0)) {
+        Log_Debug("ERROR: json parse %s decoded the strings wrongly\n", BENCH_SCANNER);
+    }
+    json_value_free(p_value);
+    __bench_throughput_run(p_parse, "strings");
+}
+
+static void __bench_twin_scan(struct bench_parse_t *p_parse)
+{
+    for (size_t i = 0; i < sizeof(bench_twins) / sizeof(bench_twins[0]); i++) {
+        JSON_Value *p_root;
+
+        __doc_twin(p_parse->p_doc, &bench_twins[i]);
+        p_root = json_parse_string(p_parse->p_doc->text);
+        if (p_root == NULL) {
+            Log_Debug("ERROR: Generated twin '%s' is not valid JSON\n", bench_twins[i].name);
+            continue;
+        }
+        json_value_free(p_root);
+
+        Log_Debug("INFO: json twin %-11s %5zu B: parse all %7.1f us, scan %6.1f us, scan + parse extFwInfo %7.1f us\n",
+                  bench_twins[i].name, p_parse->p_doc->len, __bench_ns(__bench_parse_full, p_parse) / 1e3,
+                  __bench_ns(__bench_scan, p_parse) / 1e3, __bench_ns(__bench_scan_parse, p_parse) / 1e3);
+    }
+}
+
+void json_benchmark(void)
+{
+    struct bench_doc_t *p_doc = malloc(sizeof(struct bench_doc_t));
+    struct bench_parse_t *p_parse = malloc(sizeof(struct bench_parse_t));
+    struct bench_lookup_t *p_lookup = malloc(sizeof(struct bench_lookup_t));
+
+    if ((p_doc == NULL) || (p_parse == NULL) || (p_lookup == NULL)) {
+        Log_Debug("ERROR: malloc fail\n");
+        free(p_doc);
+        free(p_parse);
+        free(p_lookup);
+        return;
+    }
+
+    p_parse->p_doc = p_doc;
+    __bench_twin_scan(p_parse);
+    __bench_arena(p_parse);
+    __bench_lookup(p_lookup);
+    __bench_serialize(p_parse);
+    __bench_throughput(p_parse);
+
+    free(p_lookup);
+    free(p_parse);
+    free(p_doc);
+}
@@ -0,0 +1,16 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef json_benchmark_h
+#define json_benchmark_h
+
+/*
+ Timings of the JSON paths the twin handling relies on, measured on generated twin documents
+ shaped like the ones ota.py deploys. Built into the application with -DJSON_BENCHMARK=ON and
+ run at startup, the same code runs on the host from bench/.
+*/
+
+/* Logs the results with Log_Debug, must not run while another thread parses JSON */
+void json_benchmark(void);
+
+#endif
@@ -0,0 +1,189 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+
+#include "json_scan.h"
+
+/* deeper documents are reported as malformed, as parson does for its nesting limit */
+#define JSON_SCAN_MAX_NESTING 2048
+
+typedef struct json_scan_cursor {
+    const char *pos;
+    const char *end;
+} JSON_Scan_Cursor;
+
+static void skip_whitespace(JSON_Scan_Cursor *cur)
+{
+    while (cur->pos < cur->end &&
+           (*cur->pos == ' ' || *cur->pos == '\t' || *cur->pos == '\n' || *cur->pos == '\r')) {
+        cur->pos++;
+    }
+}
+
+/* cursor on the opening quote, leaves it after the closing quote */
+static int skip_string(JSON_Scan_Cursor *cur)
+{
+    cur->pos++;
+    while (cur->pos < cur->end) {
+        if (*cur->pos == '\\') {
+            if (cur->end - cur->pos < 2) {
+                return 0;
+            }
+            cur->pos += 2;
+        } else if (*cur->pos == '\"') {
+            cur->pos++;
+            return 1;
+        } else {
+            cur->pos++;
+        }
+    }
+    return 0;
+}
+
+/* skips one value of any type, nested containers are counted rather than recursed into */
+static int skip_value(JSON_Scan_Cursor *cur)
+{
+    size_t depth = 0;
+
+    skip_whitespace(cur);
+    if (cur->pos >= cur->end) {
+        return 0;
+    }
+
+    if (*cur->pos == '\"') {
+        return skip_string(cur);
+    }
+
+    if (*cur->pos != '{' && *cur->pos != '[') {
+        /* number, true, false or null */
+        const char *start = cur->pos;
+        while (cur->pos < cur->end && strchr(",}] \t\r\n", *cur->pos) == NULL) {
+            cur->pos++;
+        }
+        return cur->pos > start;
+    }
+
+    while (cur->pos < cur->end) {
+        switch (*cur->pos) {
+        case '\"':
+            if (!skip_string(cur)) {
+                return 0;
+            }
+            continue;
+        case '{':
+        case '[':
+            if (++depth > JSON_SCAN_MAX_NESTING) {
+                return 0;
+            }
+            break;
+        case '}':
+        case ']':
+            if (--depth == 0) {
+                cur->pos++;
+                return 1;
+            }
+            break;
+        default:
+            break;
+        }
+        cur->pos++;
+    }
+    return 0;
+}
+
+/* looks up a key among the members of the object under the cursor */
+static JSON_Scan_Result find_member(JSON_Scan_Cursor *cur, const char *key, size_t key_len, JSON_Slice *out)
+{
+    skip_whitespace(cur);
+    if (cur->pos >= cur->end || *cur->pos != '{') {
+        return JSONScanNotFound;
+    }
+    cur->pos++;
+
+    skip_whitespace(cur);
+    if (cur->pos < cur->end && *cur->pos == '}') {
+        return JSONScanNotFound;
+    }
+
+    while (cur->pos < cur->end) {
+        skip_whitespace(cur);
+        if (cur->pos >= cur->end || *cur->pos != '\"') {
+            return JSONScanMalformed;
+        }
+        const char *name = cur->pos + 1;
+        if (!skip_string(cur)) {
+            return JSONScanMalformed;
+        }
+        size_t name_len = (size_t)(cur->pos - 1 - name);
+
+        skip_whitespace(cur);
+        if (cur->pos >= cur->end || *cur->pos != ':') {
+            return JSONScanMalformed;
+        }
+        cur->pos++;
+        skip_whitespace(cur);
+
+        const char *value = cur->pos;
+        if (!skip_value(cur)) {
+            return JSONScanMalformed;
+        }
+
+        if (name_len == key_len && memcmp(name, key, key_len) == 0) {
+            out->ptr = value;
+            out->len = (size_t)(cur->pos - value);
+            return JSONScanFound;
+        }
+
+        skip_whitespace(cur);
+        if (cur->pos < cur->end && *cur->pos == ',') {
+            cur->pos++;
+        } else if (cur->pos < cur->end && *cur->pos == '}') {
+            return JSONScanNotFound;
+        } else {
+            return JSONScanMalformed;
+        }
+    }
+    return JSONScanMalformed;
+}
+
+JSON_Scan_Result json_scan_dotget(const char *json, size_t len, const char *path, JSON_Slice *out)
+{
+    JSON_Slice current;
+    JSON_Scan_Result result;
+
+    if (json == NULL || path == NULL || out == NULL) {
+        return JSONScanNotFound;
+    }
+
+    current.ptr = json;
+    current.len = len;
+
+    do {
+        const char *dot = strchr(path, '.');
+        size_t key_len = dot ? (size_t)(dot - path) : strlen(path);
+        JSON_Scan_Cursor cur = {current.ptr, current.ptr + current.len};
+
+        result = find_member(&cur, path, key_len, &current);
+        if (result != JSONScanFound) {
+            return result;
+        }
+        path = dot ? dot + 1 : NULL;
+    } while (path != NULL);
+
+    *out = current;
+    return JSONScanFound;
+}
+
+JSON_Scan_Result json_scan_slice_dotget(const JSON_Slice *slice, const char *path, JSON_Slice *out)
+{
+    if (slice == NULL) {
+        return JSONScanNotFound;
+    }
+    return json_scan_dotget(slice->ptr, slice->len, path, out);
+}
+
+int json_scan_is_object(const JSON_Slice *slice)
+{
+    return slice != NULL && slice->len >= 2 && slice->ptr[0] == '{';
+}
@@ -0,0 +1,37 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef json_scan_h
+#define json_scan_h
+
+#include <stddef.h>
+
+/*
+ Zero allocation scanner locating values inside a JSON document without building a DOM.
+ The document does not need to be null terminated, all scans are bounded by its length.
+ Only the located slice is meant to be handed to parson, so large documents such as full
+ device twins are never parsed as a whole.
+*/
+
+typedef struct json_slice_t {
+    const char *ptr; /* first character of the value */
+    size_t len;      /* length of the value, including quotes or brackets */
+} JSON_Slice;
+
+typedef enum json_scan_result {
+    JSONScanNotFound = 0,
+    JSONScanFound = 1,
+    JSONScanMalformed = -1
+} JSON_Scan_Result;
+
+/* Locates the value at a dotted path, e.g. "desired.extFwInfo", every component but the
+   last has to be an object. Keys are compared as raw bytes, escape sequences are not decoded. */
+JSON_Scan_Result json_scan_dotget(const char *json, size_t len, const char *path, JSON_Slice *out);
+
+/* Same as json_scan_dotget on the slice of a previous scan */
+JSON_Scan_Result json_scan_slice_dotget(const JSON_Slice *slice, const char *path, JSON_Slice *out);
+
+/* 1 if the slice holds an object */
+int json_scan_is_object(const JSON_Slice *slice);
+
+#endif
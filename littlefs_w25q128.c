@@ -3,6 +3,8 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "applibs_versions.h"
 
@@ -12,18 +14,53 @@
 #include <hw/sample_hardware.h>
 
 #include "delay.h"
+#include "trace.h"
 #include "spiflash_driver/src/spiflash.h"
 #include "littlefs/lfs.h"
 #include "littlefs/lfs_util.h"
+#include "littlefs_w25q128.h"
 
 #define W25Q128_PAGE_SIZE     (256)
 #define W25Q128_SECTOR_SIZE   (16 * W25Q128_PAGE_SIZE)
 #define W25Q128_BLOCK_SIZE    (16 * W25Q128_SECTOR_SIZE)
 #define W25Q128_TOTAL_SIZE    (256 * W25Q128_BLOCK_SIZE)
+// littlefs keeps a read, a program and one cache per open file of this size, a cache miss is
+// filled with one SPI read of up to this many bytes
+#define W25Q128_CACHE_SIZE    (4 * W25Q128_PAGE_SIZE)
+// bytes a stream moves in one turn on the bus while another stream waits, a download programs and
+// erases whole sectors in a turn while an apply reads in between, set with -DW25Q128_BURST_BYTES=<bytes>
+#ifndef W25Q128_BURST_BYTES
+#define W25Q128_BURST_BYTES   (8 * W25Q128_SECTOR_SIZE)
+#endif
+// a stream that made no call for this long hands its turn over, e.g. a download waiting on the network
+#define W25Q128_BURST_IDLE_MS (20)
+#define W25Q128_STREAM_NONE   W25Q128_STREAM_COUNT
+
+// owner of the bus and the bytes it moved in its turn, see w25q128_stream_read/write
+struct w25q128_bus_t {
+    pthread_mutex_t lock;
+    pthread_cond_t turn;        // broadcast at the end of every call of a stream
+    enum w25q128_stream_t owner;
+    uint32_t active;            // calls of the owner in progress, a turn only passes between calls
+    uint32_t burst;
+    uint64_t last_ms;           // end of the last call of the owner
+    uint32_t waiting[W25Q128_STREAM_COUNT];
+    struct w25q128_bus_stats_t stats;
+};
 
 static int spiFd = 0;
 static int gpioFd = 0;
 
+lfs_t g_w25q128_lfs;
+static bool lfs_mounted = false;
+static pthread_mutex_t lfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct w25q128_read_stats_t read_stats;
+static struct w25q128_bus_t bus = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .turn = PTHREAD_COND_INITIALIZER,
+    .owner = W25Q128_STREAM_NONE
+};
+
 int azsphere_spiflash_spi_txrx(struct spiflash_s* spi, const uint8_t* tx_data, uint32_t tx_len, uint8_t* rx_data, uint32_t rx_len);
 void azsphere_spiflash_spi_cs(struct spiflash_s* spi, uint8_t cs);
 void azsphere_spiflash_wait(struct spiflash_s* spi, uint32_t ms);
@@ -98,6 +135,160 @@ int w25q128_init(void)
         &common_spiflash_cmds,
         &azsphere_spiflash_hal,
         NULL, SPIFLASH_SYNCHRONOUS, NULL);
+
+    return 0;
+}
+
+int w25q128_mount(void)
+{
+    int ret = 0;
+
+    w25q128_lfs_lock();
+
+    if (!lfs_mounted) {
+        if (w25q128_init() != 0) {
+            ret = -1;
+        } else if (lfs_mount(&g_w25q128_lfs, &g_w25q128_littlefs_config) != LFS_ERR_OK) {
+            Log_Debug("INFO: LFS Mount fail, try to format and re-mount\n");
+            if ((lfs_format(&g_w25q128_lfs, &g_w25q128_littlefs_config) != LFS_ERR_OK) ||
+                (lfs_mount(&g_w25q128_lfs, &g_w25q128_littlefs_config) != LFS_ERR_OK)) {
+                Log_Debug("ERROR: LFS format and mount failed\n");
+                ret = -1;
+            }
+        }
+        lfs_mounted = (ret == 0);
+    }
+
+    w25q128_lfs_unlock();
+    return ret;
+}
+
+void w25q128_lfs_lock(void)
+{
+    (void)pthread_mutex_lock(&lfs_lock);
+}
+
+bool w25q128_lfs_trylock(void)
+{
+    return pthread_mutex_trylock(&lfs_lock) == 0;
+}
+
+void w25q128_lfs_unlock(void)
+{
+    (void)pthread_mutex_unlock(&lfs_lock);
+}
+
+void w25q128_get_read_stats(struct w25q128_read_stats_t *p_stats)
+{
+    w25q128_lfs_lock();
+    *p_stats = read_stats;
+    w25q128_lfs_unlock();
+}
+
+static uint64_t __bus_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// The owner keeps the bus until it used up its burst while another stream waits, or went idle.
+// Streams that alternate every call would make each read of an apply wait out the page program
+// or sector erase a download just started, and evict each other from the littlefs caches.
+static bool __bus_grantable(enum w25q128_stream_t stream, uint64_t now)
+{
+    bool other_waits = false;
+
+    for (uint32_t s = 0; s < W25Q128_STREAM_COUNT; s++) {
+        if ((s != stream) && (bus.waiting[s] > 0)) {
+            other_waits = true;
+        }
+    }
+
+    if (bus.owner == W25Q128_STREAM_NONE) {
+        return true;
+    } else if (bus.owner == stream) {
+        return !other_waits || (bus.burst < W25Q128_BURST_BYTES);
+    } else {
+        return (bus.active == 0) && ((bus.burst >= W25Q128_BURST_BYTES) || (now - bus.last_ms >= W25Q128_BURST_IDLE_MS));
+    }
+}
+
+static void __bus_acquire(enum w25q128_stream_t stream, uint32_t bytes)
+{
+    struct timespec deadline;
+    uint64_t start_ms = __bus_now_ms();
+    uint64_t now = start_ms;
+
+    (void)pthread_mutex_lock(&bus.lock);
+    bus.waiting[stream]++;
+    while (!__bus_grantable(stream, now)) {
+        // an idle owner does not broadcast, check again once it could have gone idle
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += W25Q128_BURST_IDLE_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        (void)pthread_cond_timedwait(&bus.turn, &bus.lock, &deadline);
+        now = __bus_now_ms();
+    }
+    bus.waiting[stream]--;
+
+    if (bus.owner != stream) {
+        if (bus.owner != W25Q128_STREAM_NONE) {
+            bus.stats.turns++;
+        }
+        bus.owner = stream;
+        bus.burst = 0;
+    }
+    bus.stats.wait_ms[stream] += (uint32_t)(now - start_ms);
+    bus.active++;
+    bus.burst += bytes;
+    (void)pthread_mutex_unlock(&bus.lock);
+}
+
+static void __bus_release(void)
+{
+    (void)pthread_mutex_lock(&bus.lock);
+    bus.active--;
+    bus.last_ms = __bus_now_ms();
+    (void)pthread_cond_broadcast(&bus.turn);
+    (void)pthread_mutex_unlock(&bus.lock);
+}
+
+lfs_ssize_t w25q128_stream_read(enum w25q128_stream_t stream, lfs_file_t *p_file, void *p_buffer, lfs_size_t size)
+{
+    lfs_ssize_t nb;
+
+    __bus_acquire(stream, size);
+    w25q128_lfs_lock();
+    nb = lfs_file_read(&g_w25q128_lfs, p_file, p_buffer, size);
+    w25q128_lfs_unlock();
+    __bus_release();
+
+    return nb;
+}
+
+lfs_ssize_t w25q128_stream_write(enum w25q128_stream_t stream, lfs_file_t *p_file, const void *p_buffer, lfs_size_t size)
+{
+    lfs_ssize_t nb;
+
+    __bus_acquire(stream, size);
+    w25q128_lfs_lock();
+    nb = lfs_file_write(&g_w25q128_lfs, p_file, p_buffer, size);
+    w25q128_lfs_unlock();
+    __bus_release();
+
+    return nb;
+}
+
+void w25q128_get_bus_stats(struct w25q128_bus_stats_t *p_stats)
+{
+    (void)pthread_mutex_lock(&bus.lock);
+    *p_stats = bus.stats;
+    (void)pthread_mutex_unlock(&bus.lock);
 }
 
 int azsphere_spiflash_spi_txrx(struct spiflash_s* spi, const uint8_t* tx_data, uint32_t tx_len, uint8_t* rx_data, uint32_t rx_len)
@@ -113,6 +304,8 @@ int azsphere_spiflash_spi_txrx(struct spiflash_s* spi, const uint8_t* tx_data, u
     int ret;
     SPIMaster_Transfer transfers;
 
+    TRACE(traceSpiTxRx, tx_len, rx_len);
+
     ret = SPIMaster_InitTransfers(&transfers, 1);
     if (ret < 0) {
         return -1;
@@ -163,16 +356,22 @@ void azsphere_spiflash_wait(struct spiflash_s* spi, uint32_t ms)
 
 static int flash_read_wrapper(const struct lfs_config* c, lfs_block_t block, lfs_off_t off, void* buffer, lfs_size_t size) 
 {
+    TRACE(traceLfsBdRead, block, size);
+    read_stats.reads++;
+    read_stats.bytes += size;
+    // littlefs never reads across a block, so size stays within the 4096 byte SPI transfer limit
     return SPIFLASH_read(&spiflash, block * c->block_size + off, size, buffer) == SPIFLASH_OK ? LFS_ERR_OK : LFS_ERR_IO;
 }
 
 int flash_program_wrapper(const struct lfs_config* c, lfs_block_t block, lfs_off_t off, const void* buffer, lfs_size_t size) 
 {
+    TRACE(traceLfsBdProg, block, size);
     return SPIFLASH_write(&spiflash, block * c->block_size + off, size, buffer) == SPIFLASH_OK ? LFS_ERR_OK : LFS_ERR_IO;
 }
 
 int flash_erase_wrapper(const struct lfs_config* c, lfs_block_t block)
 {
+    TRACE(traceLfsBdErase, block, 0);
     return SPIFLASH_erase(&spiflash, block * c->block_size, 4096) == SPIFLASH_OK ? LFS_ERR_OK : LFS_ERR_IO;
 }
 
@@ -192,7 +391,7 @@ const struct lfs_config g_w25q128_littlefs_config = {
     .block_size = W25Q128_SECTOR_SIZE,
     .block_count = W25Q128_TOTAL_SIZE / W25Q128_SECTOR_SIZE,
     .block_cycles = 500,
-    .cache_size = W25Q128_PAGE_SIZE,
+    .cache_size = W25Q128_CACHE_SIZE,
     .lookahead_size = 16,
 };
 
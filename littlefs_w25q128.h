@@ -1,11 +1,45 @@
 ﻿#ifndef LITTLEFS_W25Q128
 #define LITTLEFS_W25Q128
 
+#include <stdbool.h>
 #include "./littlefs/lfs.h"
 
 extern const struct lfs_config g_w25q128_littlefs_config;
 
+// volume shared by the OTA thread and the main thread, littlefs itself is not thread safe
+// so every call on it must be made between w25q128_lfs_lock/trylock and w25q128_lfs_unlock
+extern lfs_t g_w25q128_lfs;
+
+// block device reads issued by littlefs, counted while the volume lock is held
+struct w25q128_read_stats_t {
+    uint32_t reads;
+    uint32_t bytes;
+};
+
+// bulk users of the volume, they take turns on the SPI bus through w25q128_stream_read/write
+// instead of interleaving call by call, small users such as the telemetry spool are not arbitrated
+enum w25q128_stream_t {
+    W25Q128_STREAM_DOWNLOAD = 0,    // OTA images written from the network and read back to verify
+    W25Q128_STREAM_APPLY,           // OTA images read to flash them into an external MCU
+    W25Q128_STREAM_COUNT
+};
+
+// turns handed from one stream to another and the time each stream waited for its turn
+struct w25q128_bus_stats_t {
+    uint32_t turns;
+    uint32_t wait_ms[W25Q128_STREAM_COUNT];
+};
+
 int w25q128_init(void);
+int w25q128_mount(void);
+void w25q128_lfs_lock(void);
+bool w25q128_lfs_trylock(void);
+void w25q128_lfs_unlock(void);
+void w25q128_get_read_stats(struct w25q128_read_stats_t *p_stats);
+// lfs_file_read/lfs_file_write on the volume in the turn of a stream, takes the volume lock itself
+lfs_ssize_t w25q128_stream_read(enum w25q128_stream_t stream, lfs_file_t *p_file, void *p_buffer, lfs_size_t size);
+lfs_ssize_t w25q128_stream_write(enum w25q128_stream_t stream, lfs_file_t *p_file, const void *p_buffer, lfs_size_t size);
+void w25q128_get_bus_stats(struct w25q128_bus_stats_t *p_stats);
 void spiflash_test(void);
 void littlefs_test(void);
 
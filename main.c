@@ -44,6 +44,9 @@
 #include <hw/sample_hardware.h>
 
 #include "epoll_timerfd_utilities.h"
+#include "input.h"
+#include "telemetry.h"
+#include "littlefs_w25q128.h"
 
 // Azure IoT SDK
 #include <iothub_client_core_common.h>
@@ -54,10 +57,13 @@
 #include <azure_sphere_provisioning.h>
 
 #include "ota/ota.h"
+#include "trace.h"
 
 static volatile sig_atomic_t terminationRequired = false;
 
 #include "parson.h" // used to parse Device Twin messages.
+#include "json_scan.h"
+#include "json_benchmark.h"
 
 // Azure IoT Hub/Central defines.
 #define SCOPEID_LENGTH 20
@@ -71,11 +77,18 @@ static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *
 static void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payload,
                          size_t payloadSize, void *userContextCallback);
 static void TwinReportBoolState(const char *propertyName, bool propertyValue);
+static void TraceHandler(const JSON_Object *traceProperties);
+static JSON_Value *ParseTwinSlice(const JSON_Slice *slice, char *buffer, JSON_Arena *arena, bool *onHeap);
+static void HandleTwinSlice(const JSON_Slice *slice, JSON_Arena *arena, void (*handler)(const JSON_Object *));
 static void ReportStatusCallback(int result, void *context);
+static bool SendReportedState(const char *json);
+static bool SendReportedValue(const JSON_Value *root);
 static const char *GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
 static const char *getAzureSphereProvisioningResultString(
     AZURE_SPHERE_PROV_RETURN_VALUE provisioningResult);
-static void SendTelemetry(const unsigned char *key, const unsigned char *value);
+static void SendTelemetry(const unsigned char *key, const unsigned char *value, bool urgent);
+static bool SendTelemetryMessage(const char *message);
+static bool PublishTelemetryBatch(const char *json, size_t length);
 static void SetupAzureClient(void);
 
 // Function to generate simulated Temperature data/telemetry
@@ -95,9 +108,6 @@ static int deviceTwinStatusLedGpioFd = -1;
 static bool statusLedOn = false;
 
 // Timer / polling
-static int buttonPollTimerFd = -1;
-static int azureTimerFd = -1;
-static int azureDoWorkFd = -1;
 static int epollFd = -1;
 
 // Azure IoT poll periods
@@ -107,20 +117,63 @@ static const int AzureIoTMaxReconnectPeriodSeconds = 10 * 60;
 
 static int azureIoTPollPeriodSeconds = -1;
 
-// Button state variables
-static GPIO_Value_Type sendMessageButtonState = GPIO_Value_High;
-static GPIO_Value_Type sendOrientationButtonState = GPIO_Value_High;
+// Azure IoT DoWork scheduling: DoWork runs immediately when a message is enqueued, at the active
+// period while the SDK still has messages in flight or an OTA is running, and otherwise backs
+// off exponentially up to a fraction of the MQTT keepalive period.
+static const int AzureDoWorkActivePeriodMs = 100;
+static const int AzureDoWorkOtaPeriodMs = 1000;
+static const int AzureDoWorkKeepaliveDivider = 10;
+static const time_t AzureDoWorkMetricsPeriodSeconds = 60;
+
+// block the desired properties handled in TwinCallback are parsed into, a property that does not
+// fit is parsed on the heap instead
+#define TWIN_ARENA_SIZE 4096
+
+// Offline telemetry: 256 KiB of flash, drained at 4 KiB/s after a reconnect so the backlog does
+// not crowd out live messages.
+static const TelemetrySpoolConfig telemetrySpoolConfig = {
+    .maxBytes = 256 * 1024, .drainBytesPerPeriod = 4096, .drainPeriodMs = 1000};
+
+static int azureDoWorkBackoffMs = 100;
+static bool azureDoWorkRequested = false;
+
+// DoWork metrics since the last time they were logged
+static uint32_t azureDoWorkWakeups = 0;
+static uint32_t azureMessagesConfirmed = 0;
+static uint32_t azureMessageLatencySumMs = 0;
+static uint32_t azureMessageLatencyMaxMs = 0;
+static time_t azureDoWorkMetricsTime = 0;
+
+// Telemetry messages handed to the IoT SDK and not confirmed yet, the context of each message
+typedef struct {
+    uint32_t enqueueMs;
+    uint32_t length;
+} PendingTelemetry;
+
+// bytes of telemetry handed to the IoT SDK and not confirmed yet
+static uint32_t telemetryPendingBytes = 0;
 
 // Firmware Version
 static const char* extFirmwareVersion = "1.0.0";
 
-static void ButtonPollTimerEventHandler(EventData *eventData);
-static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState);
+// OTA download progress is reported at most once per OtaProgressMinIntervalSeconds, and only
+// when OtaProgressPeriodSeconds has passed or the image advanced by OtaProgressStepPercent
+static const int OtaProgressMinIntervalSeconds = 5;
+static const int OtaProgressPeriodSeconds = 60;
+static const int OtaProgressStepPercent = 10;
+
+static void InputErrorEventHandler(void);
 static void SendMessageButtonHandler(void);
 static void SendOrientationButtonHandler(void);
 static bool deviceIsUp = false; // Orientation
-static void AzureTimerEventHandler(EventData *eventData);
-static void AzureDoWorkEventHandler(EventData* eventData);
+static void AzureTimerEventHandler(WheelTimer *timer);
+static void AzureDoWorkEventHandler(WheelTimer *timer);
+static void RequestAzureDoWork(void);
+static uint32_t GetMonotonicMs(void);
+
+// timers multiplexed on the timer wheel. Only the handler field needs to be populated.
+static WheelTimer azureTimer = {.handler = &AzureTimerEventHandler};
+static WheelTimer azureDoWorkTimer = {.handler = &AzureDoWorkEventHandler};
 
 /// <summary>
 ///     Signal handler for termination requests. This handler must be async-signal-safe.
@@ -138,6 +191,11 @@ int main(int argc, char *argv[])
 {
     Log_Debug("IoT Hub/Central Application starting.\n");
 
+#ifdef JSON_BENCHMARK
+    // before IoT Hub is set up, so no twin update is parsed in the middle of it
+    json_benchmark();
+#endif
+
     if (argc == 2) {
         Log_Debug("Setting Azure Scope ID %s\n", argv[1]);
         strncpy(scopeId, argv[1], SCOPEID_LENGTH);
@@ -165,79 +223,237 @@ int main(int argc, char *argv[])
 }
 
 /// <summary>
-/// Button timer event:  Check the status of buttons A and B
+/// Input error event:  A button could not be read
 /// </summary>
-static void ButtonPollTimerEventHandler(EventData *eventData)
+static void InputErrorEventHandler(void)
 {
-    if (ConsumeTimerFdEvent(buttonPollTimerFd) != 0) {
-        terminationRequired = true;
-        return;
-    }
-    SendMessageButtonHandler();
-    SendOrientationButtonHandler();
+    terminationRequired = true;
 }
 
-static void __otaInfoReport(void)
+static void __otaProgressToJson(JSON_Object *p_extFwInfo, const struct ota_progress_t *p_progress)
 {
-    const char* cOtaStatusString[] = {
-        "downloading",
-        "interrupted",
-        "applying",
-        "applied",
-        "error",
-        "invalid"
+    const char* cOtaPauseString[] = {
+        "",
+        "window",
+        "backlog"
     };
 
-    const char* cOtaErrorString[] = {
-        "SHA256 verify fail",
-        "Http Response > 400",
-        "Network Timeout",
-        "MCU Download fail",
-        "File operation fail",
-        "None"
-    };
+    (void)json_object_dotset_number(p_extFwInfo, "Progress.Bytes", p_progress->downloaded);
+    (void)json_object_dotset_number(p_extFwInfo, "Progress.Total", p_progress->total);
+    (void)json_object_dotset_number(p_extFwInfo, "Progress.Rate", p_progress->rate_now);
+    (void)json_object_dotset_number(p_extFwInfo, "Progress.AvgRate", p_progress->rate_avg);
+    (void)json_object_dotset_number(p_extFwInfo, "Progress.Eta", p_progress->eta);
+    // achieved rate against the cap of the request, 0 without one
+    (void)json_object_dotset_number(p_extFwInfo, "Progress.RateCap", p_progress->rate_cap);
+    (void)json_object_dotset_string(p_extFwInfo, "Progress.Paused", cOtaPauseString[p_progress->paused]);
+}
+
+static const char* cOtaStatusString[] = {
+    "downloading",
+    "interrupted",
+    "applying",
+    "applied",
+    "error",
+    "invalid"
+};
+
+static const char* cOtaErrorString[] = {
+    "SHA256 verify fail",
+    "Http Response > 400",
+    "Network Timeout",
+    "MCU Download fail",
+    "File operation fail",
+    "SAS expired, waiting for a new one",
+    "None"
+};
+
+// status of every external MCU as last reported
+static enum ota_status_t s_lastTargetState[OTA_MAX_TARGETS];
+static bool s_targetStateInit = false;
+
+static void __otaTargetStateInit(void)
+{
+    if (!s_targetStateInit) {
+        for (uint32_t target = 0; target < OTA_MAX_TARGETS; target++) {
+            s_lastTargetState[target] = otaStatusInvalid;
+        }
+        s_targetStateInit = true;
+    }
+}
+
+/// <summary>
+///     Returns true if the status of an external MCU changed since it was last reported.
+/// </summary>
+static bool __otaTargetsChanged(void)
+{
+    __otaTargetStateInit();
+    for (uint32_t target = 0; target < OtaGetTargetCount(); target++) {
+        enum ota_status_t status;
+        enum ota_error_t error;
+
+        OtaGetTargetState(target, &status, &error);
+        if (status != s_lastTargetState[target]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// <summary>
+///     Adds extFwInfo.Targets.&lt;mcu&gt; for every external MCU whose status changed, and the
+///     progress of those downloading when withProgress is set. Returns true if anything was added.
+/// </summary>
+static bool __otaTargetsToJson(JSON_Object *p_extFwInfo, bool withProgress)
+{
+    bool added = false;
+
+    __otaTargetStateInit();
+    for (uint32_t target = 0; target < OtaGetTargetCount(); target++) {
+        enum ota_status_t status;
+        enum ota_error_t error;
+        struct ota_progress_t progress;
+        char path[64];
+
+        OtaGetTargetState(target, &status, &error);
+        bool changed = (status != s_lastTargetState[target]);
+        if (!changed && !(withProgress && (status == otaDownloading))) {
+            continue;
+        }
+        s_lastTargetState[target] = status;
+
+        (void)snprintf(path, sizeof(path), "Targets.%s", OtaGetTargetName(target));
+        (void)json_object_dotset_value(p_extFwInfo, path, json_value_init_object());
+        JSON_Object *p_target = json_object_dotget_object(p_extFwInfo, path);
+        if (p_target == NULL) {
+            continue;
+        }
+        if (changed) {
+            (void)json_object_set_string(p_target, "Status", cOtaStatusString[status]);
+            (void)json_object_set_string(p_target, "Error", cOtaErrorString[error]);
+            (void)json_object_set_number(p_target, "Version", OtaGetTargetVersion(target));
+        }
+        if ((status == otaDownloading) || (status == otaInterrupted)) {
+            OtaGetTargetProgress(target, &progress);
+            __otaProgressToJson(p_target, &progress);
+        }
+        added = true;
+    }
 
-    char buffer[100] = { 0 };
+    return added;
+}
+
+static void __otaInfoReport(void)
+{
+    JSON_Value *root = NULL;
+    JSON_Object *extFwInfo = NULL;
     static enum ota_status_t s_lastOtaState = otaStatusInvalid;
+    static struct timespec s_lastProgressTime = { 0, 0 };
+    static uint32_t s_lastProgressPercent = 0;
+    static uint32_t s_lastPaused = otaPauseNone;
     enum ota_status_t ota_status;
     enum ota_error_t ota_error;
+    struct ota_progress_t progress;
+    struct timespec now;
+    time_t elapsed;
+    uint32_t percent;
     uint32_t applied_version;
 
-    // async report state to Azure IoT
     OtaGetState(&ota_status, &ota_error);
-    if (ota_status != s_lastOtaState) {
-        s_lastOtaState = ota_status;
+    OtaGetProgress(&progress);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = now.tv_sec - s_lastProgressTime.tv_sec;
+    percent = (progress.total > 0) ? (uint32_t)((uint64_t)progress.downloaded * 100 / progress.total) : 0;
+
+    bool statusChanged = (ota_status != s_lastOtaState);
+    // rate-limit progress so slow links are not flooded with reported state updates
+    // a download that pauses or resumes is reported right away
+    bool progressDue = (ota_status == otaDownloading) &&
+                       ((progress.paused != s_lastPaused) ||
+                        ((elapsed >= OtaProgressMinIntervalSeconds) &&
+                         ((elapsed >= OtaProgressPeriodSeconds) ||
+                          (percent >= s_lastProgressPercent + (uint32_t)OtaProgressStepPercent))));
+
+    // called on every DoWork tick, the document is only built when there is something to report
+    if (!statusChanged && !progressDue && !__otaTargetsChanged()) {
+        return;
+    }
+
+    root = json_value_init_object();
+    if (root == NULL) {
+        return;
+    }
+    (void)json_object_set_value(json_value_get_object(root), "extFwInfo", json_value_init_object());
+    extFwInfo = json_object_get_object(json_value_get_object(root), "extFwInfo");
 
-        (void)snprintf(buffer, 100, "{\"extFwInfo\":{\"Status\":\"%s\",\"Error\":\"%s\"}}", cOtaStatusString[ota_status], cOtaErrorString[ota_error]);
-        if (IoTHubDeviceClient_LL_SendReportedState(iothubClientHandle, buffer, strlen(buffer), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
-            Log_Debug("ERROR: IoTHubDeviceClient_LL_SendReportedState call fail\n");
+    // async report state to Azure IoT, progress is batched into the same message
+    if (statusChanged) {
+        s_lastOtaState = ota_status;
+        // the pause state goes out with the status, it must not trigger a second report
+        s_lastPaused = progress.paused;
+
+        (void)json_object_set_string(extFwInfo, "Status", cOtaStatusString[ota_status]);
+        (void)json_object_set_string(extFwInfo, "Error", cOtaErrorString[ota_error]);
+        // the backend answers with a new sas in the desired extFwSas, 0 once none is needed
+        (void)json_object_set_number(extFwInfo, "SasRequest", OtaGetSasRequest());
+        if ((ota_status == otaDownloading) || (ota_status == otaInterrupted)) {
+            __otaProgressToJson(extFwInfo, &progress);
+            s_lastProgressTime = now;
+            s_lastProgressPercent = percent;
         }
 
         if (ota_status == otaApplied) {
+            // batched with the status, a fixed size buffer used to need a second message
             applied_version = OtaGetVersion();
-
-            (void)snprintf(buffer, 100, "{\"extFwInfo\":{\"Version\": %d}}", applied_version);
-            if (IoTHubDeviceClient_LL_SendReportedState(iothubClientHandle, buffer, strlen(buffer), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
-                Log_Debug("ERROR: IoTHubDeviceClient_LL_SendReportedState call fail\n");
-            }
+            (void)json_object_set_number(extFwInfo, "Version", applied_version);
         }
 
-        if ((ota_status == otaInterrupted) && (ota_error == otaErrTimeout)) {
-            iothubConnected = false;
-        }
+        (void)__otaTargetsToJson(extFwInfo, true);
+        (void)SendReportedValue(root);
+    } else if (progressDue) {
+        __otaProgressToJson(extFwInfo, &progress);
+        (void)__otaTargetsToJson(extFwInfo, true);
+        (void)SendReportedValue(root);
+
+        s_lastProgressTime = now;
+        s_lastProgressPercent = percent;
+        s_lastPaused = progress.paused;
+    } else if (__otaTargetsToJson(extFwInfo, false)) {
+        // a target changed while the request as a whole did not, e.g. one finished before the others
+        (void)json_object_set_number(extFwInfo, "SasRequest", OtaGetSasRequest());
+        (void)SendReportedValue(root);
     }
+
+    json_value_free(root);
 }
 
 /// <summary>
-/// Azure timer event:  Check connection status and send telemetry
+/// Publish the phase breakdown of the last OTA attempt as telemetry
 /// </summary>
-static void AzureTimerEventHandler(EventData *eventData)
+static void __otaTimingReport(void)
 {
-    if (ConsumeTimerFdEvent(azureTimerFd) != 0) {
-        terminationRequired = true;
-        return;
+    char buffer[384];
+    struct ota_timing_t timing;
+
+    // targets downloaded at the same time can finish between two calls
+    while (iothubConnected && OtaGetTiming(&timing)) {
+        int len = snprintf(buffer, sizeof(buffer),
+                           "{\"otaTiming\":{\"tgt\":\"%s\",\"ver\":%u,\"st\":%u,\"err\":%u,\"queue\":%u,\"paused\":%u,\"connect\":%u,"
+                           "\"transfer\":%u,\"sync\":%u,\"verify\":%u,\"wait\":%u,\"apply\":%u,\"bytes\":%u,\"size\":%u,\"cap\":%u,\"retry\":%u}}",
+                           OtaGetTargetName(timing.target), timing.version, timing.status, timing.error,
+                           timing.queue_ms, timing.paused_ms, timing.connect_ms, timing.transfer_ms,
+                           timing.sync_ms, timing.verify_ms, timing.wait_ms, timing.apply_ms, timing.bytes,
+                           timing.image_size, timing.rate_cap, timing.retry);
+        if ((len > 0) && (len < (int)sizeof(buffer))) {
+            SendTelemetryMessage(buffer);
+        }
     }
+}
 
+/// <summary>
+/// Azure timer event:  Check connection status and send telemetry
+/// </summary>
+static void AzureTimerEventHandler(WheelTimer *timer)
+{
     bool isNetworkReady = false;
     if (Networking_IsNetworkingReady(&isNetworkReady) != -1) {
         if (isNetworkReady && !iothubConnected) {
@@ -247,30 +463,158 @@ static void AzureTimerEventHandler(EventData *eventData)
         Log_Debug("Failed to get Network state\n");
     }
     
+    // readings taken while disconnected go to the telemetry spool
+    SendSimulatedTemperature();
+
     if (iothubConnected) {
-        SendSimulatedTemperature();
+        // batches sealed while disconnected, then the spool
+        SendPendingTelemetry();
     }
 }
 
 /// <summary>
-/// 100ms event to call DoWork
+///     Returns a monotonic timestamp in milliseconds, wrapping every 49 days.
 /// </summary>
-static void AzureDoWorkEventHandler(EventData* eventData)
+static uint32_t GetMonotonicMs(void)
 {
-    if (ConsumeTimerFdEvent(azureDoWorkFd) != 0) {
-        terminationRequired = true;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000);
+}
+
+/// <summary>
+///     Arms the DoWork timer to fire once after the given delay.
+/// </summary>
+static void ScheduleAzureDoWork(int delayMs)
+{
+    struct timespec expiry = {delayMs / 1000, (delayMs % 1000) * 1000 * 1000};
+    StartWheelTimerOnce(&azureDoWorkTimer, &expiry);
+}
+
+/// <summary>
+///     Requests DoWork to run as soon as possible, e.g. after a message has been enqueued.
+/// </summary>
+static void RequestAzureDoWork(void)
+{
+    azureDoWorkBackoffMs = AzureDoWorkActivePeriodMs;
+    azureDoWorkRequested = true;
+    ScheduleAzureDoWork(0);
+}
+
+/// <summary>
+///     Chooses when DoWork runs next, depending on the outstanding IoT SDK and OTA activity.
+/// </summary>
+static void ScheduleNextAzureDoWork(void)
+{
+    const int idleMaxMs = keepalivePeriodSeconds * 1000 / AzureDoWorkKeepaliveDivider;
+    IOTHUB_CLIENT_STATUS sendStatus = IOTHUB_CLIENT_SEND_STATUS_IDLE;
+    enum ota_status_t otaStatus;
+    enum ota_error_t otaError;
+    int delayMs;
+
+    if (iothubClientHandle != NULL) {
+        (void)IoTHubDeviceClient_LL_GetSendStatus(iothubClientHandle, &sendStatus);
+    }
+    OtaGetState(&otaStatus, &otaError);
+
+    if (azureDoWorkRequested) {
+        // enqueued from a callback that ran inside DoWork
+        delayMs = 0;
+    } else if (sendStatus == IOTHUB_CLIENT_SEND_STATUS_BUSY) {
+        azureDoWorkBackoffMs = AzureDoWorkActivePeriodMs;
+        delayMs = AzureDoWorkActivePeriodMs;
+    } else {
+        azureDoWorkBackoffMs *= 2;
+        if (azureDoWorkBackoffMs > idleMaxMs) {
+            azureDoWorkBackoffMs = idleMaxMs;
+        }
+        delayMs = azureDoWorkBackoffMs;
+
+        // OTA state changes are polled from here
+        if (((otaStatus == otaDownloading) || (otaStatus == otaApplying)) &&
+            (delayMs > AzureDoWorkOtaPeriodMs)) {
+            delayMs = AzureDoWorkOtaPeriodMs;
+        }
+    }
+
+    ScheduleAzureDoWork(delayMs);
+}
+
+/// <summary>
+///     Logs DoWork wakeups per minute and the enqueue-to-confirmation latency of messages.
+/// </summary>
+static void LogAzureDoWorkMetrics(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (now.tv_sec - azureDoWorkMetricsTime < AzureDoWorkMetricsPeriodSeconds) {
         return;
     }
 
+    Log_Debug("INFO: DoWork wakeups %u/min, %u messages confirmed, latency avg %u ms max %u ms\n",
+              (uint32_t)(azureDoWorkWakeups * 60 / (now.tv_sec - azureDoWorkMetricsTime)),
+              azureMessagesConfirmed,
+              azureMessagesConfirmed ? azureMessageLatencySumMs / azureMessagesConfirmed : 0,
+              azureMessageLatencyMaxMs);
+
+    // with one timerfd per timer every expiration costs a wakeup and a read syscall
+    TimerWheelStats wheelStats;
+    GetTimerWheelStats(&wheelStats);
+    Log_Debug("INFO: Timer wheel %u wakeups for %u expirations, %u syscalls\n", wheelStats.wakeups,
+              wheelStats.expirations, wheelStats.syscalls);
+
+    TelemetryStats telemetryStats;
+    GetTelemetryStats(&telemetryStats);
+    Log_Debug("INFO: Telemetry %u readings in %u messages, %u dropped\n", telemetryStats.readings,
+              telemetryStats.published, telemetryStats.dropped);
+    Log_Debug("INFO: Telemetry spool %u bytes, %u batches spooled, %u drained, %u bytes dropped, %u errors\n",
+              telemetryStats.spoolBytes, telemetryStats.spooled, telemetryStats.drained,
+              telemetryStats.spoolDroppedBytes, telemetryStats.spoolErrors);
+
+    azureDoWorkWakeups = 0;
+    azureMessagesConfirmed = 0;
+    azureMessageLatencySumMs = 0;
+    azureMessageLatencyMaxMs = 0;
+    azureDoWorkMetricsTime = now.tv_sec;
+}
+
+/// <summary>
+///     Accounts the latency of a confirmed message.
+/// </summary>
+/// <param name="enqueueMs">GetMonotonicMs when the message was handed to the IoT SDK</param>
+static void RecordMessageLatency(uint32_t enqueueMs)
+{
+    uint32_t latencyMs = GetMonotonicMs() - enqueueMs;
+
+    azureMessagesConfirmed++;
+    azureMessageLatencySumMs += latencyMs;
+    if (latencyMs > azureMessageLatencyMaxMs) {
+        azureMessageLatencyMaxMs = latencyMs;
+    }
+}
+
+/// <summary>
+/// Event to call DoWork, rescheduled after every run
+/// </summary>
+static void AzureDoWorkEventHandler(WheelTimer *timer)
+{
+    azureDoWorkRequested = false;
+    azureDoWorkWakeups++;
+
+    // telemetry waiting for the link, a download with maxBacklog pauses while it is too large
+    TelemetryStats telemetryStats;
+    GetTelemetryStats(&telemetryStats);
+    OtaSetTelemetryBacklog(telemetryStats.spoolBytes + telemetryPendingBytes);
+
     __otaInfoReport();
+    __otaTimingReport();
 
     IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
-}
 
-// event handler data structures. Only the event handler field needs to be populated.
-static EventData buttonPollEventData = {.eventHandler = &ButtonPollTimerEventHandler};
-static EventData azureEventData = {.eventHandler = &AzureTimerEventHandler};
-static EventData azureDoWorkData = { .eventHandler = &AzureDoWorkEventHandler };
+    ScheduleNextAzureDoWork();
+    LogAzureDoWorkMetrics();
+}
 
 /// <summary>
 ///     Set up SIGTERM termination handler, initialize peripherals, and set up event handlers.
@@ -313,29 +657,44 @@ static int InitPeripheralsAndHandlers(void)
         return -1;
     }
 
-    // Set up a timer to poll for button events.
-    struct timespec buttonPressCheckPeriod = {0, 1000 * 1000};
-    buttonPollTimerFd =
-        CreateTimerFdAndAddToEpoll(epollFd, &buttonPressCheckPeriod, &buttonPollEventData, EPOLLIN);
-    if (buttonPollTimerFd < 0) {
+    // All periodic work of the main thread shares the timer wheel's single timerfd.
+    if (CreateTimerWheelAndAddToEpoll(epollFd) != 0) {
         return -1;
     }
 
-    azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-    struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
-    azureTimerFd =
-        CreateTimerFdAndAddToEpoll(epollFd, &azureTelemetryPeriod, &azureEventData, EPOLLIN);
-    if (azureTimerFd < 0) {
+    // Readings are batched into few larger messages, flushed by size or age.
+    if (InitTelemetry(PublishTelemetryBatch) != 0) {
         return -1;
     }
 
-    // create a timer in this thread 
-    struct timespec period = { 0, 100000000 };
-    azureDoWorkFd = CreateTimerFdAndAddToEpoll(epollFd, &period, &azureDoWorkData, EPOLLIN);
-    if (azureDoWorkFd < 0) {
+    // The flash volume is shared by OTA and the telemetry spool, without it readings are
+    // only kept in RAM while disconnected.
+    if ((w25q128_mount() != 0) || (EnableTelemetrySpool(&telemetrySpoolConfig) != 0)) {
+        Log_Debug("WARNING: Telemetry spool not available\n");
+    }
+
+    // Set up the input subsystem to sample buttons at an adaptive rate.
+    if (InitInput(InputErrorEventHandler) != 0) {
+        return -1;
+    }
+    if ((AddInputButton(sendMessageButtonGpioFd, SendMessageButtonHandler) != 0) ||
+        (AddInputButton(sendOrientationButtonGpioFd, SendOrientationButtonHandler) != 0)) {
         return -1;
     }
 
+    azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
+    struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
+    if (StartWheelTimer(&azureTimer, &azureTelemetryPeriod) != 0) {
+        return -1;
+    }
+
+    // DoWork is a one-shot timer, re-armed after every run
+    ScheduleAzureDoWork(AzureDoWorkActivePeriodMs);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    azureDoWorkMetricsTime = now.tv_sec;
+
     OtaInit();
 
     return 0;
@@ -353,9 +712,9 @@ static void ClosePeripheralsAndHandlers(void)
         GPIO_SetValue(deviceTwinStatusLedGpioFd, GPIO_Value_High);
     }
 
-    CloseFdAndPrintError(buttonPollTimerFd, "ButtonTimer");
-    CloseFdAndPrintError(azureTimerFd, "AzureTimer");
-    CloseFdAndPrintError(azureDoWorkFd, "AzureDoWork");
+    CloseInput();
+    CloseTelemetry();
+    CloseTimerWheel();
     CloseFdAndPrintError(sendMessageButtonGpioFd, "SendMessageButton");
     CloseFdAndPrintError(sendOrientationButtonGpioFd, "SendOrientationButton");
     CloseFdAndPrintError(deviceTwinStatusLedGpioFd, "StatusLed");
@@ -407,7 +766,7 @@ static void SetupAzureClient(void)
         }
 
         struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
-        SetTimerFdToPeriod(azureTimerFd, &azureTelemetryPeriod);
+        StartWheelTimer(&azureTimer, &azureTelemetryPeriod);
 
         Log_Debug("ERROR: failure to create IoTHub Handle - will retry in %i seconds.\n",
                   azureIoTPollPeriodSeconds);
@@ -417,7 +776,7 @@ static void SetupAzureClient(void)
     // Successfully connected, so make sure the polling frequency is back to the default
     azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
     struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
-    SetTimerFdToPeriod(azureTimerFd, &azureTelemetryPeriod);
+    StartWheelTimer(&azureTimer, &azureTelemetryPeriod);
 
     if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, OPTION_KEEP_ALIVE,
                                         &keepalivePeriodSeconds) != IOTHUB_CLIENT_OK) {
@@ -441,40 +800,149 @@ static void SetupAzureClient(void)
 static void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payload,
                          size_t payloadSize, void *userContextCallback)
 {
-    size_t nullTerminatedJsonSize = payloadSize + 1;
-    char *nullTerminatedJsonString = (char *)malloc(nullTerminatedJsonSize);
-    if (nullTerminatedJsonString == NULL) {
-        Log_Debug("ERROR: Could not allocate buffer for twin update payload.\n");
-        abort();
+    const char *json = (const char *)payload;
+    JSON_Slice desiredProperties;
+    JSON_Slice slice;
+    size_t parsedSize = 0;
+    struct timespec start, end;
+    bool onHeap;
+    // the properties are parsed into this block one after the other, nothing is allocated
+    static uint64_t arenaBlock[TWIN_ARENA_SIZE / sizeof(uint64_t)];
+    JSON_Arena arena;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    json_arena_init(&arena, arenaBlock, sizeof(arenaBlock));
+
+    // The full twin carries reported properties and tags as well, only the few desired
+    // properties handled here are located in place and parsed.
+    JSON_Scan_Result result = json_scan_dotget(json, payloadSize, "desired", &desiredProperties);
+    if (result == JSONScanMalformed) {
+        Log_Debug("WARNING: Cannot parse the string as JSON content.\n");
+        return;
+    }
+    if (result == JSONScanNotFound) {
+        desiredProperties.ptr = json;
+        desiredProperties.len = payloadSize;
     }
 
-    // Copy the provided buffer to a null terminated buffer.
-    memcpy(nullTerminatedJsonString, payload, payloadSize);
-    // Add the null terminator at the end.
-    nullTerminatedJsonString[nullTerminatedJsonSize - 1] = 0;
+    if (json_scan_slice_dotget(&desiredProperties, "extFwInfo", &slice) == JSONScanFound) {
+        // the OTA request takes this copy, url, sas and sha256 are parsed in place inside it
+        char *storage = (char *)malloc(slice.len + 1);
+        JSON_Value *extFwInfo = ParseTwinSlice(&slice, storage, &arena, &onHeap);
+        if (extFwInfo != NULL) {
+            OtaHandler(json_value_get_object(extFwInfo), storage);
+        } else {
+            free(storage);
+        }
+        if (onHeap) {
+            json_value_free(extFwInfo);
+        }
+        json_arena_release(&arena);
+        parsedSize += slice.len;
+    }
 
-    JSON_Value *rootProperties = NULL;
-    rootProperties = json_parse_string(nullTerminatedJsonString);
-    if (rootProperties == NULL) {
+    if (json_scan_slice_dotget(&desiredProperties, "extFwSas", &slice) == JSONScanFound) {
+        HandleTwinSlice(&slice, &arena, OtaSasHandler);
+        parsedSize += slice.len;
+    }
+
+    if (json_scan_slice_dotget(&desiredProperties, "trace", &slice) == JSONScanFound) {
+        HandleTwinSlice(&slice, &arena, TraceHandler);
+        parsedSize += slice.len;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    Log_Debug("INFO: Twin update of %zu bytes handled in %ld us, %zu bytes parsed, %zu of %zu arena bytes used\n",
+              payloadSize,
+              (long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000),
+              parsedSize, arena.peak, arena.size);
+}
+
+/// <summary>
+///     Parses an object located in the twin document in place, on the heap if it does not fit
+///     the arena.
+/// </summary>
+/// <param name="slice">object within the twin document</param>
+/// <param name="buffer">receives the slice, at least one byte longer, strings of the object point into it</param>
+/// <param name="arena">holds the parsed object</param>
+/// <param name="onHeap">set when the object was parsed on the heap, free it with json_value_free then</param>
+/// <returns>the parsed object, valid until the arena is released, or NULL</returns>
+static JSON_Value *ParseTwinSlice(const JSON_Slice *slice, char *buffer, JSON_Arena *arena, bool *onHeap)
+{
+    *onHeap = false;
+
+    if (!json_scan_is_object(slice)) {
+        return NULL;
+    }
+
+    if (buffer == NULL) {
+        Log_Debug("ERROR: Could not allocate buffer for twin property of %zu bytes.\n", slice->len);
+        return NULL;
+    }
+
+    memcpy(buffer, slice->ptr, slice->len);
+    buffer[slice->len] = 0;
+
+    JSON_Value *value = json_parse_string_in_situ_with_arena(buffer, arena);
+    if ((value == NULL) && arena->exhausted) {
+        Log_Debug("WARNING: Twin property of %zu bytes exceeds the parse arena of %zu bytes, parsing it on the heap.\n",
+                  slice->len, arena->size);
+        // the failed parse already unescaped strings in place, start over from the twin
+        memcpy(buffer, slice->ptr, slice->len);
+        buffer[slice->len] = 0;
+        value = json_parse_string_in_situ(buffer);
+        *onHeap = (value != NULL);
+    }
+    if (value == NULL) {
         Log_Debug("WARNING: Cannot parse the string as JSON content.\n");
-        goto cleanup;
     }
 
-    JSON_Object *rootObject = json_value_get_object(rootProperties);
-    JSON_Object *desiredProperties = json_object_dotget_object(rootObject, "desired");
-    if (desiredProperties == NULL) {
-        desiredProperties = rootObject;
+    return value;
+}
+
+/// <summary>
+///     Parses a desired property and hands it to its handler, the copy of the slice is taken from
+///     the arena unless it does not fit there.
+/// </summary>
+/// <param name="slice">object within the twin document</param>
+/// <param name="arena">empty arena, released again before returning</param>
+/// <param name="handler">takes the parsed object, which is only valid during the call</param>
+static void HandleTwinSlice(const JSON_Slice *slice, JSON_Arena *arena, void (*handler)(const JSON_Object *))
+{
+    char *buffer = json_arena_alloc(arena, slice->len + 1);
+    char *heapBuffer = NULL;
+    bool onHeap;
+
+    if (buffer == NULL) {
+        json_arena_release(arena);
+        buffer = heapBuffer = (char *)malloc(slice->len + 1);
+    }
+
+    JSON_Value *value = ParseTwinSlice(slice, buffer, arena, &onHeap);
+    if (value != NULL) {
+        handler(json_value_get_object(value));
+    }
+    if (onHeap) {
+        json_value_free(value);
     }
+    free(heapBuffer);
+    json_arena_release(arena);
+}
 
-    JSON_Object* extFwInfoProperties = json_object_dotget_object(desiredProperties, "extFwInfo");
-    if (extFwInfoProperties != NULL) {
-        OtaHandler(extFwInfoProperties);
+/// <summary>
+///     Applies the desired 'trace' settings: 'mask' selects the trace categories recorded at
+///     runtime and 'dump' prints the events currently held in the trace buffer.
+/// </summary>
+static void TraceHandler(const JSON_Object *traceProperties)
+{
+    if (json_object_has_value_of_type(traceProperties, "mask", JSONNumber)) {
+        trace_set_mask((uint32_t)json_object_get_number(traceProperties, "mask"));
+        Log_Debug("INFO: Trace mask set to 0x%08X\n", g_trace_mask);
     }
 
-cleanup:
-    // Release the allocated memory.
-    json_value_free(rootProperties);
-    free(nullTerminatedJsonString);
+    if (json_object_get_boolean(traceProperties, "dump") == 1) {
+        trace_dump();
+    }
 }
 
 /// <summary>
@@ -534,35 +1002,72 @@ static const char *getAzureSphereProvisioningResultString(
 }
 
 /// <summary>
-///     Sends telemetry to IoT Hub
+///     Queues telemetry for IoT Hub, readings are sent in batches
 /// </summary>
 /// <param name="key">The telemetry item to update</param>
 /// <param name="value">new telemetry value</param>
-static void SendTelemetry(const unsigned char *key, const unsigned char *value)
+/// <param name="urgent">true to send the batch right away</param>
+static void SendTelemetry(const unsigned char *key, const unsigned char *value, bool urgent)
 {
-    static char eventBuffer[100] = {0};
-    static const char *EventMsgTemplate = "{ \"%s\": \"%s\" }";
-    int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, key, value);
-    if (len < 0)
-        return;
+    AddTelemetry((const char *)key, (const char *)value, urgent);
+}
 
-    Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
+/// <summary>
+///     Telemetry batcher sink, batches are kept by the batcher while disconnected
+/// </summary>
+/// <param name="json">null terminated JSON array of readings</param>
+/// <param name="length">length of the JSON array</param>
+static bool PublishTelemetryBatch(const char *json, size_t length)
+{
+    if (!iothubConnected) {
+        return false;
+    }
 
-    IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
+    return SendTelemetryMessage(json);
+}
 
-    if (messageHandle == 0) {
+/// <summary>
+///     Sends a preformatted JSON telemetry message to IoT Hub
+/// </summary>
+/// <param name="message">null terminated JSON document</param>
+/// <returns>true if IoTHubClient accepted the message</returns>
+static bool SendTelemetryMessage(const char *message)
+{
+    bool accepted = false;
+
+    Log_Debug("Sending IoT Hub Message: %s\n", message);
+
+    IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(message);
+    PendingTelemetry *pending = (PendingTelemetry *)malloc(sizeof(PendingTelemetry));
+
+    if ((messageHandle == 0) || (pending == NULL)) {
         Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-        return;
+        if (messageHandle != 0) {
+            IoTHubMessage_Destroy(messageHandle);
+        }
+        free(pending);
+        return false;
     }
+    pending->enqueueMs = GetMonotonicMs();
+    pending->length = (uint32_t)strlen(message);
+
+    // lets the hub route on the body of the message
+    IoTHubMessage_SetContentTypeSystemProperty(messageHandle, "application/json");
+    IoTHubMessage_SetContentEncodingSystemProperty(messageHandle, "utf-8");
 
     if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-                                             /*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
+                                             pending) != IOTHUB_CLIENT_OK) {
         Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
+        free(pending);
     } else {
         Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
+        telemetryPendingBytes += pending->length;
+        RequestAzureDoWork();
+        accepted = true;
     }
 
     IoTHubMessage_Destroy(messageHandle);
+    return accepted;
 }
 
 /// <summary>
@@ -572,7 +1077,49 @@ static void SendTelemetry(const unsigned char *key, const unsigned char *value)
 /// <param name="context">User specified context</param>
 static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
 {
+    PendingTelemetry *pending = (PendingTelemetry *)context;
+
     Log_Debug("INFO: Message received by IoT Hub. Result is: %d\n", result);
+    // also called for messages discarded when the client is destroyed
+    telemetryPendingBytes -= pending->length;
+    RecordMessageLatency(pending->enqueueMs);
+    free(pending);
+}
+
+/// <summary>
+///     Serializes a reported properties document and sends it, the output buffer is kept and
+///     reused for all reports.
+/// </summary>
+/// <param name="root">reported properties, still owned by the caller</param>
+/// <returns>true if the IoT Hub client accepted the report</returns>
+static bool SendReportedValue(const JSON_Value *root)
+{
+    static JSON_Buffer reportedBuffer;
+
+    if (json_serialize_to_json_buffer(root, &reportedBuffer) != JSONSuccess) {
+        Log_Debug("ERROR: Cannot serialize reported properties\n");
+        return false;
+    }
+
+    return SendReportedState(reportedBuffer.data);
+}
+
+/// <summary>
+///     Enqueues a Device Twin reported properties document and schedules DoWork to send it.
+/// </summary>
+/// <param name="json">null terminated JSON document of reported properties</param>
+/// <returns>true if the IoT Hub client accepted the report</returns>
+static bool SendReportedState(const char *json)
+{
+    if (IoTHubDeviceClient_LL_SendReportedState(iothubClientHandle, (const unsigned char *)json,
+                                                strlen(json), ReportStatusCallback,
+                                                (void *)(uintptr_t)GetMonotonicMs()) != IOTHUB_CLIENT_OK) {
+        Log_Debug("ERROR: IoTHubDeviceClient_LL_SendReportedState call fail\n");
+        return false;
+    }
+
+    RequestAzureDoWork();
+    return true;
 }
 
 /// <summary>
@@ -587,15 +1134,15 @@ static void TwinReportBoolState(const char *propertyName, bool propertyValue)
     if (iothubClientHandle == NULL) {
         Log_Debug("ERROR: client not initialized\n");
     } else {
-        static char reportedPropertiesString[30] = {0};
-        int len = snprintf(reportedPropertiesString, 30, "{\"%s\":%s}", propertyName,
-                           (propertyValue == true ? "true" : "false"));
-        if (len < 0)
+        JSON_Value *root = json_value_init_object();
+        if (root == NULL)
             return;
 
-        if (IoTHubDeviceClient_LL_SendReportedState(
-                iothubClientHandle, (unsigned char *)reportedPropertiesString,
-                strlen(reportedPropertiesString), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
+        (void)json_object_set_boolean(json_value_get_object(root), propertyName, propertyValue);
+        bool sent = SendReportedValue(root);
+        json_value_free(root);
+
+        if (!sent) {
             Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
         } else {
             Log_Debug("INFO: Reported state for '%s' to value '%s'.\n", propertyName,
@@ -610,6 +1157,7 @@ static void TwinReportBoolState(const char *propertyName, bool propertyValue)
 static void ReportStatusCallback(int result, void *context)
 {
     Log_Debug("INFO: Device Twin reported properties update result: HTTP status code %d\n", result);
+    RecordMessageLatency((uint32_t)(uintptr_t)context);
 }
 
 /// <summary>
@@ -628,30 +1176,7 @@ void SendSimulatedTemperature(void)
     char tempBuffer[20];
     int len = snprintf(tempBuffer, 20, "%3.2f", temperature);
     if (len > 0)
-        SendTelemetry("Temperature", tempBuffer);
-}
-
-/// <summary>
-///     Check whether a given button has just been pressed.
-/// </summary>
-/// <param name="fd">The button file descriptor</param>
-/// <param name="oldState">Old state of the button (pressed or released)</param>
-/// <returns>true if pressed, false otherwise</returns>
-static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState)
-{
-    bool isButtonPressed = false;
-    GPIO_Value_Type newState;
-    int result = GPIO_GetValue(fd, &newState);
-    if (result != 0) {
-        Log_Debug("ERROR: Could not read button GPIO: %s (%d).\n", strerror(errno), errno);
-        terminationRequired = true;
-    } else {
-        // Button is pressed if it is low and different than last known state.
-        isButtonPressed = (newState != *oldState) && (newState == GPIO_Value_Low);
-        *oldState = newState;
-    }
-
-    return isButtonPressed;
+        SendTelemetry("Temperature", tempBuffer, false);
 }
 
 /// <summary>
@@ -660,9 +1185,7 @@ static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState)
 /// </summary>
 static void SendMessageButtonHandler(void)
 {
-    if (IsButtonPressed(sendMessageButtonGpioFd, &sendMessageButtonState)) {
-        SendTelemetry("ButtonPress", "True");
-    }
+    SendTelemetry("ButtonPress", "True", true);
 }
 
 /// <summary>
@@ -671,8 +1194,6 @@ static void SendMessageButtonHandler(void)
 /// </summary>
 static void SendOrientationButtonHandler(void)
 {
-    if (IsButtonPressed(sendOrientationButtonGpioFd, &sendOrientationButtonState)) {
-        deviceIsUp = !deviceIsUp;
-        SendTelemetry("Orientation", deviceIsUp ? "Up" : "Down");
-    }
+    deviceIsUp = !deviceIsUp;
+    SendTelemetry("Orientation", deviceIsUp ? "Up" : "Down", true);
 }
@@ -1,20 +1,130 @@
 ﻿/* Copyright (c) Microsoft Corporation. All rights reserved.
    Licensed under the MIT License. */
 
+#include <stdlib.h>
+#include <string.h>
+#include <applibs/log.h>
+
+#include "../littlefs_w25q128.h"
+#include "../littlefs/lfs.h"
 #include "extmcu_hal.h"
 
+// bytes read from the volume and handed to the transport at a time
+#define EXTMCU_APPLY_BLOCK 4096
+
+// Transport of an external MCU. write takes the image in order, block by block, and finish is
+// called once all of it was written, e.g. to check it and reset the MCU into the new image.
+struct extmcu_t {
+    const char* p_name;
+    bool (*write)(uint32_t mcu, uint32_t offset, const uint8_t* p_data, size_t len);
+    bool (*finish)(uint32_t mcu, uint32_t size);
+};
+
+// Stand-in for the bootloader protocol of a board, it only counts the bytes. Replace it with the
+// UART, SPI or I2C transport of each MCU.
+static bool __stub_write(uint32_t mcu, uint32_t offset, const uint8_t* p_data, size_t len)
+{
+    (void)mcu;
+    (void)offset;
+    (void)p_data;
+    (void)len;
+    return true;
+}
+
+static bool __stub_finish(uint32_t mcu, uint32_t size)
+{
+    Log_Debug("INFO: %s took %u bytes, no transport behind it\n", ExtMCU_GetName(mcu), size);
+    return true;
+}
+
+// One entry per co-processor with its transport, the first is the default OTA target. A request
+// naming an MCU missing here is rejected as a whole. "ble" and "wifi" are examples of a board
+// with three MCUs, list the ones of your board instead.
+static const struct extmcu_t cExtMcus[] = {
+    {"mcu", __stub_write, __stub_finish},
+    {"ble", __stub_write, __stub_finish},
+    {"wifi", __stub_write, __stub_finish},
+};
+
+#define EXTMCU_COUNT (sizeof(cExtMcus) / sizeof(cExtMcus[0]))
+
 void ExtMCU_Init(void)
 {
     ;
 }
 
-uint32_t ExtMCU_GetVersion()
+uint32_t ExtMCU_GetCount(void)
 {
-    return 0;
+    return EXTMCU_COUNT;
 }
 
-bool ExtMCU_Download()
+const char* ExtMCU_GetName(uint32_t mcu)
 {
-    return true;
+    return (mcu < EXTMCU_COUNT) ? cExtMcus[mcu].p_name : "";
 }
 
+int ExtMCU_Find(const char* p_name)
+{
+    for (uint32_t mcu = 0; mcu < EXTMCU_COUNT; mcu++) {
+        if (strcmp(cExtMcus[mcu].p_name, p_name) == 0) {
+            return (int)mcu;
+        }
+    }
+    return -1;
+}
+
+uint32_t ExtMCU_GetVersion(uint32_t mcu)
+{
+    return 0;
+}
+
+// reference apply loop: streams the image from the volume into the transport of the MCU
+bool ExtMCU_Download(uint32_t mcu, const char* p_path)
+{
+    lfs_file_t file;
+    uint8_t* buffer;
+    uint32_t offset = 0;
+    lfs_ssize_t nb = 0;
+    bool ok = true;
+
+    if (mcu >= EXTMCU_COUNT) {
+        return false;
+    }
+
+    buffer = malloc(EXTMCU_APPLY_BLOCK);
+    if (buffer == NULL) {
+        Log_Debug("ERROR: malloc fail\n");
+        return false;
+    }
+
+    w25q128_lfs_lock();
+    int open_err = lfs_file_open(&g_w25q128_lfs, &file, p_path, LFS_O_RDONLY);
+    w25q128_lfs_unlock();
+    if (open_err != LFS_ERR_OK) {
+        Log_Debug("ERROR: Unable to open %s file\n", p_path);
+        free(buffer);
+        return false;
+    }
+
+    // the reads take turns on the SPI bus with the downloads of the other targets
+    while (ok && ((nb = w25q128_stream_read(W25Q128_STREAM_APPLY, &file, buffer, EXTMCU_APPLY_BLOCK)) > 0)) {
+        ok = cExtMcus[mcu].write(mcu, offset, buffer, (size_t)nb);
+        offset += (uint32_t)nb;
+    }
+    if (nb < 0) {
+        Log_Debug("ERROR: IO Error reading %s: %d\n", p_path, (int)nb);
+        ok = false;
+    }
+    if (ok) {
+        ok = cExtMcus[mcu].finish(mcu, offset);
+    } else {
+        Log_Debug("ERROR: Flashing %s stopped at offset %u\n", cExtMcus[mcu].p_name, offset);
+    }
+
+    w25q128_lfs_lock();
+    (void)lfs_file_close(&g_w25q128_lfs, &file);
+    w25q128_lfs_unlock();
+    free(buffer);
+
+    return ok;
+}
@@ -7,8 +7,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// names of the external MCUs are at most this long, they name the targets of an OTA request
+#define EXTMCU_NAME_MAX 15
+
 void ExtMCU_Init(void);
-uint32_t ExtMCU_GetVersion();
-bool ExtMCU_Download();
+// external MCUs on the board, index 0 is the one updated by a request without targets
+uint32_t ExtMCU_GetCount(void);
+const char* ExtMCU_GetName(uint32_t mcu);
+// index of the MCU with this name, -1 if the board has none
+int ExtMCU_Find(const char* p_name);
+uint32_t ExtMCU_GetVersion(uint32_t mcu);
+// flashes the image stored at p_path on the littlefs volume into the MCU, the image is read with
+// w25q128_stream_read(W25Q128_STREAM_APPLY, ...) so it takes turns on the flash with downloads
+bool ExtMCU_Download(uint32_t mcu, const char* p_path);
 
 #endif
\ No newline at end of file
@@ -6,16 +6,19 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <applibs/log.h>
 #include <applibs/storage.h>
 
-#include "../sha256/mark2/sha256.h"
+#include "../sha256_accel.h"
+#include "../ed25519.h"
 #include "../littlefs_w25q128.h"
 #include "../littlefs/lfs.h"
+#include "../trace.h"
 
 #include <curl/curl.h>
 #include <curl/easy.h>
@@ -24,40 +27,258 @@
 #include "ota.h"
 
 #define MAX_REQUEST 3
-
-static void OtaSetState(enum ota_status_t status, enum ota_error_t error);
-static void OtaSetVersion(uint32_t version);
+// minimum interval between two rate samples taken in the progress callback
+#define PROGRESS_SAMPLE_MS 1000
+// bytes hashed per lfs_file_read during verify, set with -DOTA_VERIFY_CHUNK=<bytes>
+#ifndef OTA_VERIFY_CHUNK
+#define OTA_VERIFY_CHUNK (16 * 1024)
+#endif
+// smallest chunk tried when the heap cannot hold a larger one
+#define OTA_VERIFY_CHUNK_MIN 1024
+
+#if (OTA_VERIFY_CHUNK > 64 * 1024) || (OTA_VERIFY_CHUNK < 1024) || (OTA_VERIFY_CHUNK % 1024 != 0)
+#error "OTA_VERIFY_CHUNK must be a multiple of 1024 between 1024 and 65536"
+#endif
+// bounds of the chunks listed in an image manifest
+#define OTA_CHUNK_MIN (4 * 1024)
+#define OTA_CHUNK_MAX (1024 * 1024)
+#define OTA_MANIFEST_MAX_CHUNKS 1024
+// rounds of range requests for chunks that keep failing their hash
+#define OTA_CHUNK_REFETCH_ROUNDS 3
+// mirrors tried ahead of blob storage, and how long to wait for one to accept a connection
+#define OTA_MAX_MIRRORS 4
+#define OTA_MIRROR_CONNECT_TIMEOUT 5L
+// interval between checks of the download window and the telemetry backlog while paused
+#define OTA_SCHEDULE_POLL_MS 5000
+// a download paused for the telemetry backlog resumes once it fell below this share of maxBacklog
+#define OTA_BACKLOG_RESUME_PERCENT 50
+// a clock before this year has not been set yet, the download window cannot be evaluated then
+#define OTA_CLOCK_VALID_YEAR 2020
+// automatic retries of a transfer that failed for a transient reason, the backoff doubles from
+// the base up to the cap and is jittered so a fleet that failed together does not retry together
+#define OTA_RETRY_MAX 8
+#define OTA_RETRY_BASE_MS 5000
+#define OTA_RETRY_CAP_MS (10 * 60 * 1000)
+// how long a download rejected with 403 waits for a new sas in extFwSas, and how often one
+// transfer asks for a new sas before the 403 is reported as an error
+#define OTA_SAS_WAIT_MS (30 * 60 * 1000)
+#define OTA_SAS_REFRESH_MAX 2
+// layout of the statement signed by the deploy script: magic, version, size, sha256, chunk size and
+// manifest root, integers big endian, chunk size and root are 0 for an image without a manifest
+#define OTA_STATEMENT_MAGIC "AZSPHERE-OTA-V1"
+#define OTA_STATEMENT_BYTES (sizeof(OTA_STATEMENT_MAGIC) + 3 * sizeof(uint32_t) + 2 * SHA256_ACCEL_BYTES)
+// a target of a request with targets is signed with the name of its MCU appended, zero padded
+#define OTA_STATEMENT_TARGET_MAGIC "AZSPHERE-OTA-V2"
+#define OTA_STATEMENT_NAME_BYTES (EXTMCU_NAME_MAX + 1)
+// littlefs file of the first external MCU, the others get their name in OTA_TARGET_FILE_FORMAT
+#define OTA_DEFAULT_FILE "ota.bin"
+#define OTA_TARGET_FILE_FORMAT "ota_%s.bin"
+#define OTA_TARGET_PATH_MAX (sizeof(OTA_TARGET_FILE_FORMAT) + EXTMCU_NAME_MAX)
+// heap the downloads of one request may hold together, set with -DOTA_MEMORY_BUDGET=<bytes>.
+// A download is estimated at OTA_TRANSFER_MEMORY for curl and its TLS session, plus its manifest
+// and verify buffer; one that needs more than the whole budget runs alone.
+#ifndef OTA_MEMORY_BUDGET
+#define OTA_MEMORY_BUDGET (192 * 1024)
+#endif
+#define OTA_TRANSFER_MEMORY (64 * 1024)
+
+_Static_assert(sizeof(OTA_STATEMENT_TARGET_MAGIC) == sizeof(OTA_STATEMENT_MAGIC), "statement magics differ in length");
+
+// configure with -DOTA_SIGNING_KEY=<64 hex digits> to accept only requests signed with its private key
+#ifdef OTA_SIGNING_KEY
+_Static_assert(sizeof(OTA_SIGNING_KEY) == 2 * ED25519_PUBLIC_KEY_BYTES + 1, "OTA_SIGNING_KEY must be 64 hex digits");
+#endif
+
+static void OtaSetState(uint32_t target, enum ota_status_t status, enum ota_error_t error);
+static void OtaSetVersion(uint32_t target, uint32_t version);
+static void OtaSetTiming(const struct ota_timing_t* p_timing);
+static uint64_t __now_ms(void);
+struct ota_sink_t;
+static void __manifest_hash(struct ota_sink_t* p_sink, const uint8_t* p_data, size_t len);
+
+// one image of a request and the external MCU it is for
+struct ota_target_t {
+    uint32_t mcu;
+    uint32_t version;
+    uint32_t size;
+    const char *p_url;
+    sha256_digest sha256;
+    // optional list of per chunk hashes next to the image, NULL without one
+    const char *p_manifest;
+    uint32_t chunk_size;
+    sha256_digest root;
+    // ed25519 signature of the target, see OTA_STATEMENT_MAGIC
+    bool has_signature;
+    uint8_t signature[ED25519_SIGNATURE_BYTES];
+};
 
 struct ota_request_t {
+    uint64_t enqueue_ms;
+    // version of the deployment, the same as the one of the image for a request without targets
     uint32_t version;
-    uint32_t size;
-    char *p_url;
-    char *p_sas;
-    char *p_sha256;
+    // urls, sas and mirrors point into the twin property buffer owned by the request
+    char *p_storage;
+    const char *p_sas;
+    // a request without targets has the single image of extFwInfo for the first MCU
+    bool has_targets;
+    struct ota_target_t targets[OTA_MAX_TARGETS];
+    uint32_t target_count;
+    // targets downloaded at the same time, 1 downloads them one after another
+    uint32_t concurrency;
+    // caching servers that take the path of url and manifest, tried in order before blob storage.
+    // Only a mirror that opted in gets the sas as well, and only over https.
+    const char *p_mirrors[OTA_MAX_MIRRORS];
+    bool mirror_sas[OTA_MAX_MIRRORS];
+    uint32_t mirror_count;
+    // download policy, 0 for no limit: bytes/s, telemetry bytes waiting and a daily window in
+    // minutes after midnight UTC
+    uint32_t max_rate;
+    uint32_t max_backlog;
+    bool has_window;
+    uint32_t window_start;
+    uint32_t window_end;
+};
+
+// one target of a run, as worked on by one worker
+struct ota_job_t {
+    struct ota_run_t *p_run;
+    const struct ota_target_t *p_target;
+    char path[OTA_TARGET_PATH_MAX];
+    // sas_generation of the run when the last url was built, a 403 with an older one is retried
+    uint32_t sas_generation;
+    uint32_t sas_refreshes;
+    // set by the network worker when the verified image is newer than the MCU, the apply worker
+    // flashes it and reports the timing of the attempt
+    bool apply;
+    uint32_t apply_version;
+    uint64_t verified_ms;
+    struct ota_timing_t timing;
+};
+
+// A request being worked on. Its targets are taken in order by up to concurrency network
+// workers, which download and verify them and queue them for the apply worker, so one target
+// downloads while another one is flashed into its MCU.
+struct ota_run_t {
+    struct ota_request_t req;
+    pthread_mutex_t lock;
+    pthread_cond_t released;    // signalled when a download gives its memory back
+    pthread_cond_t applicable;  // signalled when a job is queued to apply or a network worker ends
+    uint32_t next_target;
+    uint32_t workers;           // network workers, they share max_rate
+    uint32_t workers_running;
+    struct ota_job_t apply_jobs[OTA_MAX_TARGETS];
+    uint32_t apply_count;
+    uint32_t apply_rpos;
+    uint32_t downloads;         // downloads holding memory
+    uint32_t memory;            // bytes taken from OTA_MEMORY_BUDGET
+    // sas from extFwSas that replaced the one of the request, NULL while it has none, and how
+    // often it was replaced
+    char *p_sas_owned;
+    uint32_t sas_generation;
+};
+
+// per chunk hashes of the image, their merkle root is published in the twin
+struct ota_manifest_t {
+    uint32_t chunk_size;
+    uint32_t image_size;
+    uint32_t count;
+    sha256_digest *p_hashes;
+    uint8_t *p_bad;         // one bit per chunk whose data failed its hash
+    uint32_t bad_count;
+};
+
+// where a transfer lands, chunks are hashed on the way when there is a manifest
+struct ota_sink_t {
+    lfs_file_t *p_file;
+    struct ota_manifest_t *p_manifest;
+    uint32_t offset;        // image offset of the next byte
+    uint32_t limit;         // nothing is written at or past this offset
+    sha256_accel_context chunk_ctx;
+    // response of the transfer in progress, checked before its first byte is written
+    bool ranged;            // the request asks for the bytes from offset on
+    bool checked;
+    bool source_bad;        // the source answered with other bytes than requested
+    long status;
+    bool has_range;
+    uint32_t range_start;
+    uint32_t range_end;
+};
+
+struct ota_buffer_t {
+    uint8_t *p_data;
+    size_t length;
+    size_t capacity;
 };
 
 struct ota_queue_t {
-    sem_t semaphr;
     pthread_mutex_t lock;
+    // broadcast on every request queued, the workers of a run also wait on it to be preempted
+    pthread_cond_t queued;
     struct ota_request_t requests[MAX_REQUEST];
+    uint32_t count;
     uint32_t wpos;
     uint32_t rpos;
+    // request of the run in progress, NULL between runs
+    const struct ota_request_t *p_running;
 };
 
-struct ota_state_t {
+struct ota_target_state_t {
     enum ota_status_t status;
     enum ota_error_t error;
+    struct ota_progress_t progress;
+    uint32_t version;       // last version applied
+};
+
+// {"Downloading":x} or {"Completed":x} of one MCU in the local record
+struct ota_record_t {
+    uint32_t version;
+    bool partial;
+};
+
+struct ota_state_t {
+    struct ota_target_state_t targets[OTA_MAX_TARGETS];
+    // targets of the current request, and those of them no worker has started on yet
+    uint32_t run_targets;
+    uint32_t pending_targets;
+    // version reported once the current request is applied, 0 for the version of its only image
+    uint32_t run_version;
+    // finished attempts not taken by OtaGetTiming yet, oldest first
+    struct ota_timing_t timings[OTA_MAX_TARGETS];
+    uint32_t timing_count;
+    uint32_t telemetry_backlog;
+    // version waiting for a new sas after a 403 and the number of targets waiting for it, and
+    // the latest sas from extFwSas not taken by a run yet
+    uint32_t sas_request;
+    uint32_t sas_waiters;
+    uint32_t sas_version;
+    char *p_sas;
+    // copy of the latest sas from extFwSas, taken or not, a twin delivered again repeats it
+    char *p_sas_seen;
     pthread_mutex_t lock;
 };
 
+struct ota_transfer_t {
+    uint32_t resume_offset;
+    uint32_t total;
+    uint64_t start_ms;
+    uint64_t sample_ms;
+    uint32_t sample_bytes;
+    // policy checked from the progress callback, pause is set when it aborted the transfer
+    const struct ota_request_t *p_req;
+    uint32_t target;
+    uint32_t rate_cap;
+    enum ota_pause_t pause;
+};
+
 struct ota_context_t {
     bool is_inited;
     struct ota_state_t ota_state;
-    uint32_t ota_version;
     int local_record_fd;
+    // records of all MCUs, written back to local_record_fd as a whole
+    struct ota_record_t records[OTA_MAX_TARGETS];
+    pthread_mutex_t record_lock;
     pthread_t ota_thread;
     struct ota_queue_t ota_queue;
-    lfs_t lfs
 };
 
 static struct ota_context_t* pOtaContext = NULL;
@@ -65,64 +286,190 @@ static struct ota_context_t* pOtaContext = NULL;
 uint8_t dummy[1024 * 100];
 uint32_t position = 0;
 
-void __OtaEventDequeue(struct ota_request_t* req)
+// absolute CLOCK_REALTIME deadline timeout_ms from now, as taken by the timed waits
+static void __deadline(struct timespec* p_deadline, uint32_t timeout_ms)
 {
-    (void)sem_wait(&pOtaContext->ota_queue.semaphr);
+    clock_gettime(CLOCK_REALTIME, p_deadline);
+    p_deadline->tv_sec += timeout_ms / 1000;
+    p_deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (p_deadline->tv_nsec >= 1000000000) {
+        p_deadline->tv_sec++;
+        p_deadline->tv_nsec -= 1000000000;
+    }
+}
 
+void __OtaEventDequeue(struct ota_request_t* req)
+{
     (void)pthread_mutex_lock(&pOtaContext->ota_queue.lock);
+    while (pOtaContext->ota_queue.count == 0) {
+        (void)pthread_cond_wait(&pOtaContext->ota_queue.queued, &pOtaContext->ota_queue.lock);
+    }
     *req = pOtaContext->ota_queue.requests[pOtaContext->ota_queue.rpos++];
     if (pOtaContext->ota_queue.rpos >= MAX_REQUEST) {
         pOtaContext->ota_queue.rpos = 0;
     }
+    pOtaContext->ota_queue.count--;
+    pOtaContext->ota_queue.p_running = req;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_queue.lock);
+}
+
+// the run of the request taken by __OtaEventDequeue is over, its storage is about to be freed
+static void __OtaEventDone(void)
+{
+    (void)pthread_mutex_lock(&pOtaContext->ota_queue.lock);
+    pOtaContext->ota_queue.p_running = NULL;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_queue.lock);
+}
+
+// true if two requests are for the same images, as when the twin delivers extFwInfo again after
+// a reconnect. Only the version and the images count, a change of policy alone is not a new request.
+static bool __same_request(const struct ota_request_t* p_a, const struct ota_request_t* p_b)
+{
+    if ((p_a->version != p_b->version) || (p_a->has_targets != p_b->has_targets) || (p_a->target_count != p_b->target_count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < p_a->target_count; i++) {
+        if ((p_a->targets[i].mcu != p_b->targets[i].mcu) || (p_a->targets[i].version != p_b->targets[i].version) ||
+            (p_a->targets[i].size != p_b->targets[i].size) || !sha256_digest_equal(&p_a->targets[i].sha256, &p_b->targets[i].sha256)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// waits up to timeout_ms for a request to be queued, true if one is. The request stays queued,
+// the run in progress is preempted by it and returns to the ota thread that takes it.
+static bool __OtaEventWait(uint32_t timeout_ms)
+{
+    struct timespec deadline;
+    bool queued;
+
+    __deadline(&deadline, timeout_ms);
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_queue.lock);
+    while (pOtaContext->ota_queue.count == 0) {
+        if (pthread_cond_timedwait(&pOtaContext->ota_queue.queued, &pOtaContext->ota_queue.lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    queued = (pOtaContext->ota_queue.count > 0);
     (void)pthread_mutex_unlock(&pOtaContext->ota_queue.lock);
+
+    return queued;
 }
 
 void __OtaEventEnqueue(struct ota_request_t *req)
 {
     (void)pthread_mutex_lock(&pOtaContext->ota_queue.lock);
+    // a request for the images of the latest one, queued or running, would only preempt it
+    const struct ota_request_t *p_latest = (pOtaContext->ota_queue.count > 0) ?
+        &pOtaContext->ota_queue.requests[(pOtaContext->ota_queue.wpos + MAX_REQUEST - 1) % MAX_REQUEST] :
+        pOtaContext->ota_queue.p_running;
+    if ((p_latest != NULL) && __same_request(p_latest, req)) {
+        bool running = (pOtaContext->ota_queue.count == 0);
+        (void)pthread_mutex_unlock(&pOtaContext->ota_queue.lock);
+        Log_Debug("INFO: Request for version %u is already %s\n", req->version, running ? "running" : "queued");
+        free(req->p_storage);
+        return;
+    }
+    // a full queue drops its oldest request, a newer one replaces it anyway
+    if (pOtaContext->ota_queue.count == MAX_REQUEST) {
+        free(pOtaContext->ota_queue.requests[pOtaContext->ota_queue.rpos++].p_storage);
+        if (pOtaContext->ota_queue.rpos >= MAX_REQUEST) {
+            pOtaContext->ota_queue.rpos = 0;
+        }
+        pOtaContext->ota_queue.count--;
+    }
     pOtaContext->ota_queue.requests[pOtaContext->ota_queue.wpos++] = *req;
     if (pOtaContext->ota_queue.wpos >= MAX_REQUEST) {
         pOtaContext->ota_queue.wpos = 0;
     }
+    pOtaContext->ota_queue.count++;
+    (void)pthread_cond_broadcast(&pOtaContext->ota_queue.queued);
     (void)pthread_mutex_unlock(&pOtaContext->ota_queue.lock);
+}
 
-    (void)sem_post(&pOtaContext->ota_queue.semaphr);
+// MCUs of the board that can be targets
+static uint32_t __mcu_count(void)
+{
+    return (ExtMCU_GetCount() < OTA_MAX_TARGETS) ? ExtMCU_GetCount() : OTA_MAX_TARGETS;
 }
 
-static void __update_local_record(uint32_t version, bool done)
+// The record holds {"<mcu>":{"Downloading":x}} or {"<mcu>":{"Completed":x}} for every MCU with
+// an image on flash. Only called by the worker of a target, so the version it reads back does
+// not change under it.
+static void __update_local_record(uint32_t mcu, uint32_t version, bool done)
 {
-#define MAX_RECORD_LEN 50
+#define MAX_RECORD_LEN (OTA_MAX_TARGETS * (EXTMCU_NAME_MAX + 32) + 3)
     char temp_buffer[MAX_RECORD_LEN];
+    size_t pos = 0;
     ssize_t len;
 
-    lseek(pOtaContext->local_record_fd, 0, SEEK_SET);
-
-    if (done) {
-        snprintf(temp_buffer, MAX_RECORD_LEN, "{\"Completed\":%d}", version);
-    } else {
-        snprintf(temp_buffer, MAX_RECORD_LEN, "{\"Downloading\":%d}", version);
+    (void)pthread_mutex_lock(&pOtaContext->record_lock);
+    pOtaContext->records[mcu].version = version;
+    pOtaContext->records[mcu].partial = !done;
+
+    pos += (size_t)snprintf(&temp_buffer[pos], MAX_RECORD_LEN - pos, "{");
+    for (uint32_t i = 0; i < __mcu_count(); i++) {
+        if (pOtaContext->records[i].version > 0) {
+            pos += (size_t)snprintf(&temp_buffer[pos], MAX_RECORD_LEN - pos, "%s\"%s\":{\"%s\":%u}",
+                                    (pos > 1) ? "," : "", ExtMCU_GetName(i),
+                                    pOtaContext->records[i].partial ? "Downloading" : "Completed",
+                                    pOtaContext->records[i].version);
+        }
     }
+    (void)snprintf(&temp_buffer[pos], MAX_RECORD_LEN - pos, "}");
 
+    // the terminator ends the record, a longer one written before is ignored after it
+    lseek(pOtaContext->local_record_fd, 0, SEEK_SET);
     len = write(pOtaContext->local_record_fd, temp_buffer, strlen(temp_buffer) + 1);
+    (void)pthread_mutex_unlock(&pOtaContext->record_lock);
+
     Log_Debug("Successfully write %d bytes to file\n", len);
 }
 
-static uint32_t __get_local_record(bool *has_partial_image)
+static uint32_t __get_local_record(uint32_t mcu, bool *has_partial_image)
+{
+    (void)pthread_mutex_lock(&pOtaContext->record_lock);
+    uint32_t version = pOtaContext->records[mcu].version;
+    *has_partial_image = pOtaContext->records[mcu].partial;
+    (void)pthread_mutex_unlock(&pOtaContext->record_lock);
+
+    return version;
+}
+
+static void __parse_record(const JSON_Object* p_object, struct ota_record_t* p_record)
+{
+    p_record->version = (uint32_t)json_object_get_number(p_object, "Downloading");
+    p_record->partial = (p_record->version != 0);
+    // there is no key "Downloading"
+    if (p_record->version == 0) {
+        p_record->version = (uint32_t)json_object_get_number(p_object, "Completed");
+    }
+}
+
+// reads the records of all MCUs once at start, a record from before targets existed is the one
+// of the first MCU
+static void __load_local_records(void)
 {
-    uint32_t version = 0;
+#define LOCAL_RECORD_ARENA_SIZE 2048
     long total = 0;
-    uint8_t *p_file_buffer = NULL;
+    char *p_file_buffer = NULL;
+    // the record and its parse fit in a small block, released at once
+    uint64_t arena_block[LOCAL_RECORD_ARENA_SIZE / sizeof(uint64_t)];
+    JSON_Arena arena;
 
-    *has_partial_image = false;
+    memset(pOtaContext->records, 0, sizeof(pOtaContext->records));
+    json_arena_init(&arena, arena_block, sizeof(arena_block));
 
     total = lseek(pOtaContext->local_record_fd, 0, SEEK_END);
     lseek(pOtaContext->local_record_fd, 0, SEEK_SET);
 
     if (total > 0) {
 
-        p_file_buffer = malloc(total);
+        p_file_buffer = json_arena_alloc(&arena, (size_t)total + 1);
         if (p_file_buffer == NULL) {
-            Log_Debug("ERROR: malloc fail.\n");
+            Log_Debug("ERROR: local record too large.\n");
             goto cleanup;
         }
 
@@ -131,382 +478,2117 @@ static uint32_t __get_local_record(bool *has_partial_image)
             Log_Debug("ERROR: file read: %s (%d).\n", strerror(errno), errno);
             goto cleanup;
         }
+        p_file_buffer[rd] = '\0';
 
         Log_Debug("Local record = %s\n", p_file_buffer);
 
-        JSON_Value* root = json_parse_string(p_file_buffer);
+        JSON_Value* root = json_parse_string_with_arena(p_file_buffer, &arena);
         if (root == NULL) {
             Log_Debug("ERROR: Cannot parse the string as JSON content.\n");
             goto cleanup;
         }
 
         JSON_Object* rootObject = json_value_get_object(root);
-        version = (uint32_t)json_object_get_number(rootObject, "Downloading");
-        // there is no key "Downloading"
-        if (version == 0) {
-            version = (uint32_t)json_object_get_number(rootObject, "Completed");
-            if (version == 0) {
-                Log_Debug("ERROR: Do not find either 'Downloading' or 'Completed' key.\n");
+        if (json_object_has_value_of_type(rootObject, "Downloading", JSONNumber) ||
+            json_object_has_value_of_type(rootObject, "Completed", JSONNumber)) {
+            __parse_record(rootObject, &pOtaContext->records[0]);
+        } else {
+            for (uint32_t mcu = 0; mcu < __mcu_count(); mcu++) {
+                JSON_Object* mcuObject = json_object_get_object(rootObject, ExtMCU_GetName(mcu));
+                if (mcuObject != NULL) {
+                    __parse_record(mcuObject, &pOtaContext->records[mcu]);
+                }
             }
         }
-        else {
-            *has_partial_image = true;
-        }
     }
 
 cleanup:
-    free(p_file_buffer);
-    return version;
+    json_arena_release(&arena);
 }
 
-static bool __image_verify(lfs_file_t *p_file, const char *p_target_sha256_str)
+static bool __image_verify(lfs_file_t *p_file, const sha256_digest *p_target_sha256)
 {
-    uint8_t hashValue[SHA256_BYTES];
-    sha256_context ctx;
-    char hashString[SHA256_BYTES * 2 + sizeof('\0')];
-    char buffer[512];
+    sha256_digest hashValue;
+    sha256_accel_context ctx;
+    char hashString[SHA256_ACCEL_BYTES * 2 + sizeof('\0')];
+    uint32_t chunk = OTA_VERIFY_CHUNK;
+    uint8_t *buffer;
     lfs_ssize_t nb;
+    uint32_t total = 0;
+    struct w25q128_read_stats_t stats_start, stats_end;
+    uint64_t start_ms;
+
+    // chunks are multiples of the littlefs cache, so every read after the first starts on a
+    // cache boundary and whole cache lines are consumed; the heap is shared with curl, settle
+    // for a smaller chunk rather than failing the verify
+    while ((buffer = malloc(chunk)) == NULL && chunk > OTA_VERIFY_CHUNK_MIN) {
+        chunk /= 2;
+    }
+    if (buffer == NULL) {
+        Log_Debug("ERROR: malloc fail\n");
+        return false;
+    }
 
-    // to make it be a string
-    hashString[SHA256_BYTES * 2] = '\0';
-
-    lfs_file_seek(&pOtaContext->lfs, p_file, 0, LFS_SEEK_SET);
-    sha256_init(&ctx);
+    w25q128_lfs_lock();
+    lfs_file_seek(&g_w25q128_lfs, p_file, 0, LFS_SEEK_SET);
+    w25q128_lfs_unlock();
+    sha256_accel_init(&ctx);
+    w25q128_get_read_stats(&stats_start);
+    start_ms = __now_ms();
 
     do {
-        nb = lfs_file_read(&pOtaContext->lfs, p_file, buffer, 512);
+        // the volume is shared with the telemetry spool and the apply worker, do not hold it
+        // across the whole image
+        nb = w25q128_stream_read(W25Q128_STREAM_DOWNLOAD, p_file, buffer, chunk);
+        TRACE(traceLfsRead, chunk, nb);
         if (nb > 0) {
-            sha256_hash(&ctx, &buffer[0], nb);
+            sha256_accel_update(&ctx, buffer, (size_t)nb);
+            total += (uint32_t)nb;
         } else if (nb == 0) {
             break;
         } else {
             Log_Debug("ERROR: IO Error during image verify\n");
+            free(buffer);
             return false;
         }
     } while (true);
 
-    sha256_done(&ctx, &hashValue[0]);
+    sha256_accel_final(&ctx, &hashValue);
+    free(buffer);
 
-    for (uint32_t i = 0; i < SHA256_BYTES; i++) {
-        sprintf(&hashString[i * 2], "%02X", hashValue[i]);
-    }
+    w25q128_get_read_stats(&stats_end);
+    uint32_t elapsed_ms = (uint32_t)(__now_ms() - start_ms);
+    Log_Debug("INFO: Verified %u bytes in %u ms (%u KB/s), %u byte chunks, %u flash reads of %u bytes\n",
+              total, elapsed_ms, elapsed_ms > 0 ? total / elapsed_ms : 0, chunk,
+              stats_end.reads - stats_start.reads, stats_end.bytes - stats_start.bytes);
 
-    if (strcmp(hashString, p_target_sha256_str) == 0) {
+    if (sha256_digest_equal(&hashValue, p_target_sha256)) {
         Log_Debug("INFO: Image verification pass!\n");
         return true;
     } else {
+        sha256_digest_to_hex(&hashValue, hashString);
         Log_Debug("WARNING: Image verification fail, calculated sha256 = %s\n", hashString);
         return false;
     }
 }
 
-static void LogCurlError(const char* message, int curlErrCode)
+static int __hex_to_bytes(const char* p_hex, uint8_t* p_bytes, size_t len)
 {
-    Log_Debug(message);
-    Log_Debug(" (curl err=%d, '%s')\n", curlErrCode, curl_easy_strerror(curlErrCode));
+    if (strlen(p_hex) != 2 * len) {
+        return -1;
+    }
+    for (size_t i = 0; i < 2 * len; i++) {
+        char c = p_hex[i];
+        int nibble;
+        if ((c >= '0') && (c <= '9')) {
+            nibble = c - '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+            nibble = c - 'a' + 10;
+        } else if ((c >= 'A') && (c <= 'F')) {
+            nibble = c - 'A' + 10;
+        } else {
+            return -1;
+        }
+        p_bytes[i / 2] = (uint8_t)((i & 1) ? (p_bytes[i / 2] | nibble) : (nibble << 4));
+    }
+    return 0;
 }
 
-static size_t write_callback(void* ptr, size_t size, size_t nmemb, void* userdata)
+static uint8_t* __put_be32(uint8_t* p, uint32_t value)
 {
-    lfs_file_t* p_file = userdata;
-
-    if (lfs_file_write(&pOtaContext->lfs, p_file, ptr, nmemb) != nmemb) {
-        Log_Debug("ERROR: less number of bytes write to file\n");
-        return 0;
-    } else {
-        return nmemb;
-    }
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+    return p + sizeof(uint32_t);
 }
 
-static int dl_progress(void* clientp, double dltotal, double dlnow, double ultotal, double ulnow)
+// the signature covers the image hash and the manifest root, so every chunk and the whole image
+// that pass their hash checks are covered by it as well. The target of a request with targets is
+// bound to its MCU, its image cannot be sent to another one. Returns the length of the statement.
+static size_t __target_statement(const struct ota_request_t* p_req, const struct ota_target_t* p_target, uint8_t* p_statement)
 {
-    Log_Debug("%d in %d bytes transfered\n", (int)dlnow, (int)dltotal);
-    return 0;
+    bool has_manifest = (p_target->p_manifest != NULL);
+    uint8_t* p = p_statement;
+
+    memcpy(p, p_req->has_targets ? OTA_STATEMENT_TARGET_MAGIC : OTA_STATEMENT_MAGIC, sizeof(OTA_STATEMENT_MAGIC));
+    p += sizeof(OTA_STATEMENT_MAGIC);
+    p = __put_be32(p, p_target->version);
+    p = __put_be32(p, p_target->size);
+    memcpy(p, p_target->sha256.bytes, SHA256_ACCEL_BYTES);
+    p += SHA256_ACCEL_BYTES;
+    p = __put_be32(p, has_manifest ? p_target->chunk_size : 0);
+    if (has_manifest) {
+        memcpy(p, p_target->root.bytes, SHA256_ACCEL_BYTES);
+    } else {
+        memset(p, 0, SHA256_ACCEL_BYTES);
+    }
+    p += SHA256_ACCEL_BYTES;
+    if (p_req->has_targets) {
+        memset(p, 0, OTA_STATEMENT_NAME_BYTES);
+        memcpy(p, ExtMCU_GetName(p_target->mcu), strlen(ExtMCU_GetName(p_target->mcu)));
+        p += OTA_STATEMENT_NAME_BYTES;
+    }
+    return (size_t)(p - p_statement);
 }
 
-static void* ota_thread(void* arg) 
+// checked before anything is downloaded, always passes when no signing key is built in
+static bool __target_verify(const struct ota_request_t* p_req, const struct ota_target_t* p_target)
 {
-    uint32_t local_version;
-    struct ota_request_t req;
-
-    uint32_t resume_offset;
-    bool need_download;
-    bool has_partial_image;
-    bool finish_download;
-    lfs_file_t ota_binary_file;
-
-    while (1) {
-
-        __OtaEventDequeue(&req);
-        Log_Debug("Checking OTA, server version is %d\n", req.version);
-        Log_Debug("URL = %s\n", req.p_url);
-        Log_Debug("SAS = %s\n", req.p_sas);
-        Log_Debug("SHA256 = %s\n", req.p_sha256);
-
-        if (lfs_file_open(&pOtaContext->lfs, &ota_binary_file, "ota.bin", LFS_O_RDWR | LFS_O_CREAT) != LFS_ERR_OK) {
-            Log_Debug("ERROR: Unable to open ota.bin file\n");
-            OtaSetState(otaError, otaErrIo);
-            free(req.p_url);
-            free(req.p_sas);
-            free(req.p_sha256);
-            continue;
-        }
-
-        resume_offset = 0;
-        need_download = true;
-        has_partial_image = false;
-        finish_download = false;
+#ifdef OTA_SIGNING_KEY
+    uint8_t key[ED25519_PUBLIC_KEY_BYTES];
+    uint8_t statement[OTA_STATEMENT_BYTES + OTA_STATEMENT_NAME_BYTES];
 
-        local_version = __get_local_record(&has_partial_image);
-        
-        // if the record file is {"Downloading":x}, it means there is a partial received image on file system
-        if (has_partial_image) {
+    if (!p_target->has_signature) {
+        Log_Debug("ERROR: OTA request is not signed\n");
+        return false;
+    }
+    if (__hex_to_bytes(OTA_SIGNING_KEY, key, sizeof(key)) != 0) {
+        Log_Debug("ERROR: Malformed OTA_SIGNING_KEY\n");
+        return false;
+    }
 
-            // when x is newer version than server push, we do not roll back. or we can accept roll back depends real policy.
-            if (local_version > req.version) {
-                need_download = false;
-            // when x is euqal to server version, we will try to resume from the last break point.
-            } else if (local_version == req.version) {
-                lfs_soff_t size = lfs_file_seek(&pOtaContext->lfs, &ota_binary_file, 0, LFS_SEEK_END);
-                if (size >= 0) {
-                    if (size < req.size) {
-                        resume_offset = size;
-                    } else if (size == req.size) {
-                        need_download = false;
-                        finish_download = true;
-                    } else {
-                        need_download = false;
-                        Log_Debug("ERROR: Incorrect file size\n");
-                    }
-                } else {
-                    resume_offset = 0;
-                }
-            }
-        } else {
-            // if the record file is {"Completed":x}, it means there is a previous completed image on file system
-            if (local_version >= req.version) {
-                // when x is a equal or newer version than on server, do not start. (also depends on roll back policy)
-                need_download = false;
-            }
-        }
+    size_t length = __target_statement(p_req, p_target, statement);
 
-        if (need_download) {
+    uint64_t start_ms = __now_ms();
+    int err = ed25519_verify(p_target->signature, statement, length, key);
+    Log_Debug("INFO: Signature check took %u ms\n", (uint32_t)(__now_ms() - start_ms));
 
-            Log_Debug("Starting download from offset %d...\n", resume_offset);
+    if (err != 0) {
+        Log_Debug("ERROR: OTA request signature does not match\n");
+        return false;
+    }
+    return true;
+#else
+    if (p_target->has_signature) {
+        Log_Debug("WARNING: No OTA_SIGNING_KEY built in, signature not checked\n");
+    }
+    return true;
+#endif
+}
 
-            // For a refresh download, clean ota.bin file and change local record to {"Downloading":y}
-            if (resume_offset == 0) {
-                lfs_file_truncate(&pOtaContext->lfs, &ota_binary_file, 0);
-                __update_local_record(req.version, false);
-            }
+static void LogCurlError(const char* message, int curlErrCode)
+{
+    Log_Debug(message);
+    Log_Debug(" (curl err=%d, '%s')\n", curlErrCode, curl_easy_strerror(curlErrCode));
+}
 
-            OtaSetState(otaDownloading, otaErrNone);
+// status line and Content-Range of each response, a redirect or 100 Continue starts over
+static size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+    struct ota_sink_t* p_sink = userdata;
+    char line[128];
+    size_t len = (nitems < sizeof(line) - 1) ? nitems : sizeof(line) - 1;
+    unsigned int start, end;
+
+    memcpy(line, buffer, len);
+    line[len] = '\0';
+
+    if (strncmp(line, "HTTP/", strlen("HTTP/")) == 0) {
+        const char* p_code = strchr(line, ' ');
+        p_sink->status = (p_code != NULL) ? strtol(p_code, NULL, 10) : 0;
+        p_sink->has_range = false;
+    } else if ((strncasecmp(line, "Content-Range:", strlen("Content-Range:")) == 0) &&
+               (sscanf(line + strlen("Content-Range:"), " bytes %u-%u/", &start, &end) == 2)) {
+        p_sink->has_range = true;
+        p_sink->range_start = start;
+        p_sink->range_end = end;
+    }
+    return nitems;
+}
 
-            sha256_context ctx;
-            CURL* curlHandle = NULL;
-            CURLcode res = CURLE_OK;
-            struct curl_slist* list = NULL;
-
-            (void)curl_global_init(CURL_GLOBAL_ALL);
-            curlHandle = curl_easy_init();
-
-            (void)curl_easy_setopt(curlHandle, CURLOPT_CAINFO, Storage_GetAbsolutePathInImagePackage("certs/root.pem"));
-            char* sasurl = calloc(strlen(req.p_url) + sizeof('?') + strlen(req.p_sas) + sizeof('\0'), sizeof(char));
-            (void)strcat(strcat(strcat(sasurl, req.p_url), "?"), req.p_sas);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_URL, sasurl);
-            // specify Azure Blob REST API version, for version order than 2011-08-18 do not accept 'Range: bytes=start-' header
-            list = curl_slist_append(list, "x-ms-version:2019-02-02");
-            (void)curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, list);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_HTTPGET, 1);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_RESUME_FROM, resume_offset);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, write_callback);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &ota_binary_file);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_FAILONERROR, 1);
-            // abort if speed is below 10bytes/seconds for 30 seconds
-            (void)curl_easy_setopt(curlHandle, CURLOPT_LOW_SPEED_TIME,  30);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_LOW_SPEED_LIMIT, 10);
-            // Debug Options
-            (void)curl_easy_setopt(curlHandle, CURLOPT_PROGRESSFUNCTION, dl_progress);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_NOPROGRESS, 0);
-            (void)curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, 1L);
-
-            res = curl_easy_perform(curlHandle);
-            if (res == CURLE_OK) {
-                finish_download = true;
-                Log_Debug("INFO: Download Finished, file size = %d\n", lfs_file_size(&pOtaContext->lfs, &ota_binary_file));
-            } else {
-                if (res == CURLE_OPERATION_TIMEDOUT) {
-                    OtaSetState(otaInterrupted, otaErrTimeout);
-                } else if (res == CURLE_HTTP_RETURNED_ERROR) {
-                    OtaSetState(otaInterrupted, otaErrHttp);
-                } else if (res == CURLE_WRITE_ERROR) {
-                    OtaSetState(otaError, otaErrIo);
-                }
+// resets the response state of the sink before a transfer from p_sink->offset
+static void __sink_begin(CURL* curlHandle, struct ota_sink_t* p_sink, bool ranged)
+{
+    p_sink->ranged = ranged;
+    p_sink->checked = false;
+    p_sink->source_bad = false;
+    p_sink->status = 0;
+    p_sink->has_range = false;
+    (void)curl_easy_setopt(curlHandle, CURLOPT_HEADERFUNCTION, header_callback);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_HEADERDATA, p_sink);
+}
 
-                Log_Debug("INFO: Download interrupted, ret code = %d\n", res);
-            }
+// A ranged request must be answered with 206 and exactly the range from p_sink->offset, anything
+// else would land at the wrong offset. A source doing that fails like one that is unreachable.
+static bool __sink_check_response(struct ota_sink_t* p_sink)
+{
+    if (p_sink->status == 206) {
+        return p_sink->has_range && (p_sink->range_start == p_sink->offset) && (p_sink->range_end < p_sink->limit);
+    }
+    return (p_sink->status == 200) && !p_sink->ranged;
+}
 
-            free(sasurl);
-            curl_easy_cleanup(curlHandle);
-            curl_global_cleanup();
-        } 
+// a transfer stopped by the sink is a failure of the source, unless it failed to write to flash
+static CURLcode __sink_result(const struct ota_sink_t* p_sink, CURLcode res)
+{
+    return ((res == CURLE_WRITE_ERROR) && p_sink->source_bad) ? CURLE_RANGE_ERROR : res;
+}
 
-        // A completed file is downloaded or has been download (if a powerfail happens after download and before verify pass)
-        if (finish_download) {
+static size_t write_callback(void* ptr, size_t size, size_t nmemb, void* userdata)
+{
+    struct ota_sink_t* p_sink = userdata;
+    lfs_ssize_t nb;
 
-            if (__image_verify(&ota_binary_file, req.p_sha256)) {
-                __update_local_record(req.version, true);
+    if (!p_sink->checked) {
+        p_sink->checked = true;
+        if (!__sink_check_response(p_sink)) {
+            if (p_sink->has_range) {
+                Log_Debug("ERROR: Source answered with HTTP %ld and bytes %u-%u for offset %u\n", p_sink->status,
+                          p_sink->range_start, p_sink->range_end, p_sink->offset);
             } else {
-                // empty the file to make sure retry from start 
-                (void)lfs_file_truncate(&pOtaContext->lfs, &ota_binary_file, 0);
-                OtaSetState(otaError, otaErrVerify);
+                Log_Debug("ERROR: Source answered with HTTP %ld and no range for offset %u\n", p_sink->status, p_sink->offset);
             }
+            p_sink->source_bad = true;
+            TRACE(traceCurlWrite, nmemb, 0);
+            return 0;
         }
-           
-        // read again since a good ota will update local record
-        local_version = __get_local_record(&has_partial_image);
-        if ((!has_partial_image) && (ExtMCU_GetVersion() < local_version)) {
+    }
 
-            OtaSetState(otaApplying, otaErrNone);
+    // a server ignoring the requested range must not write past it
+    if (nmemb > p_sink->limit - p_sink->offset) {
+        Log_Debug("ERROR: more bytes than requested\n");
+        p_sink->source_bad = true;
+        TRACE(traceCurlWrite, nmemb, 0);
+        return 0;
+    }
 
-            if (ExtMCU_Download()) {
-                OtaSetVersion(local_version);
-                OtaSetState(otaApplied, otaErrNone);
-            } else {
-                OtaSetState(otaError, otaErrMcuDownload);
-            }
-        }
+    nb = w25q128_stream_write(W25Q128_STREAM_DOWNLOAD, p_sink->p_file, ptr, nmemb);
+    TRACE(traceLfsWrite, nmemb, nb);
 
-        lfs_file_close(&pOtaContext->lfs, &ota_binary_file);
-        free(req.p_url);
-        free(req.p_sas);
-        free(req.p_sha256);
+    if (nb != nmemb) {
+        Log_Debug("ERROR: less number of bytes write to file\n");
+        TRACE(traceCurlWrite, nmemb, 0);
+        return 0;
+    } else {
+        if (p_sink->p_manifest != NULL) {
+            __manifest_hash(p_sink, ptr, nmemb);
+        }
+        p_sink->offset += (uint32_t)nmemb;
+        TRACE(traceCurlWrite, nmemb, nmemb);
+        return nmemb;
     }
 }
 
-void OtaHandler(const JSON_Object* extFwInfoProperties)
+static uint64_t __now_ms(void)
 {
-    struct ota_request_t req;
-
-    if (pOtaContext->is_inited) {
-
-        req.version = (uint32_t)json_object_get_number(extFwInfoProperties, "version");
-        req.size = (uint32_t)json_object_get_number(extFwInfoProperties, "size");
-        req.p_url = strdup(json_object_get_string(extFwInfoProperties, "url"));
-        req.p_sas = strdup(json_object_get_string(extFwInfoProperties, "sas"));
-        req.p_sha256 = strdup(json_object_get_string(extFwInfoProperties, "sha256"));
+    struct timespec ts;
 
-        if ((req.version > 0) && (req.size > 0) && (req.p_url != NULL) && (req.p_sas != NULL) && (req.p_sha256 != NULL)) {
-            __OtaEventEnqueue(&req);
-        } else {
-            // free a NULL has no side effect..
-            free(req.p_url);
-            free(req.p_sas);
-            free(req.p_sha256);
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
 }
 
-int OtaInit(void) 
+static void __update_progress(struct ota_transfer_t *p_xfer, uint32_t received, bool force)
 {
-    int rt = -1;
+    uint64_t now = __now_ms();
+    uint64_t elapsed;
+    struct ota_progress_t progress;
 
-    if (pOtaContext == NULL) {
-        pOtaContext = malloc(sizeof(struct ota_context_t));
-        if (pOtaContext == NULL) {
-            Log_Debug("ERROR: malloc fail\n");
-            goto errExitLabel_0;
-        }
+    if (!force && (now - p_xfer->sample_ms < PROGRESS_SAMPLE_MS)) {
+        return;
     }
 
-    memset(pOtaContext, 0, sizeof(struct ota_context_t));
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    progress = pOtaContext->ota_state.targets[p_xfer->target].progress;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
 
-    pOtaContext->local_record_fd = Storage_OpenMutableFile();
-    if (pOtaContext->local_record_fd < 0) {
-        Log_Debug("ERROR: Could not open mutable file: %s (%d)\n", strerror(errno), errno);
-        goto errExitLabel_1;
-    }
+    progress.downloaded = p_xfer->resume_offset + received;
+    progress.total = p_xfer->total;
 
-    rt = pthread_create(&pOtaContext->ota_thread, NULL, ota_thread, NULL);
-    if (rt != 0) {
-        Log_Debug("ERROR: Can not create a thread: %d\n", rt);
-        goto errExitLabel_2;
+    if (now > p_xfer->sample_ms) {
+        progress.rate_now = (uint32_t)((uint64_t)(received - p_xfer->sample_bytes) * 1000 / (now - p_xfer->sample_ms));
     }
 
-    rt = sem_init(&pOtaContext->ota_queue.semaphr, 0, 0);
-    if (rt < 0) {
-        Log_Debug("ERROR: Could not init semaphore: %s (%d)\n", strerror(errno), errno);
-        goto errExitLabel_3;
+    elapsed = now - p_xfer->start_ms;
+    if (elapsed > 0) {
+        progress.rate_avg = (uint32_t)((uint64_t)received * 1000 / elapsed);
     }
 
-    rt = pthread_mutex_init(&pOtaContext->ota_queue.lock, NULL);
-    if (rt < 0) {
-        Log_Debug("ERROR: Could not init ota_queue mutex: %s (%d)\n", strerror(errno), errno);
-        goto errExitLabel_4;
+    if ((progress.rate_avg > 0) && (progress.total > progress.downloaded)) {
+        progress.eta = (progress.total - progress.downloaded) / progress.rate_avg;
+    } else {
+        progress.eta = 0;
     }
 
-    rt = pthread_mutex_init(&pOtaContext->ota_state.lock, NULL);
-    if (rt < 0) {
-        Log_Debug("ERROR: Could not init ota_state mutex: %s (%d)\n", strerror(errno), errno);
-        goto errExitLabel_5;
-    }
+    p_xfer->sample_ms = now;
+    p_xfer->sample_bytes = received;
 
-    w25q128_init();
-    if (lfs_mount(&pOtaContext->lfs, &g_w25q128_littlefs_config) != LFS_ERR_OK) {
-        Log_Debug("INFO: LFS Mount fail, try to format and re-mount\n");
-        lfs_format(&pOtaContext->lfs, &g_w25q128_littlefs_config);
-        lfs_mount(&pOtaContext->lfs, &g_w25q128_littlefs_config);
-    }
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    pOtaContext->ota_state.targets[p_xfer->target].progress = progress;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
 
-    pOtaContext->ota_queue.wpos = 0;
-    pOtaContext->ota_queue.rpos = 0;
-    pOtaContext->ota_state.status = otaStatusInvalid;
-    pOtaContext->ota_state.error = otaErrNone;
-    pOtaContext->is_inited = true;
+static void __start_progress(struct ota_transfer_t *p_xfer, uint32_t resume_offset, uint32_t total)
+{
+    struct ota_progress_t progress = { resume_offset, total, 0, 0, 0, p_xfer->rate_cap, otaPauseNone };
 
-    return 0;
+    p_xfer->pause = otaPauseNone;
+    p_xfer->resume_offset = resume_offset;
+    p_xfer->total = total;
+    p_xfer->start_ms = __now_ms();
+    p_xfer->sample_ms = p_xfer->start_ms;
+    p_xfer->sample_bytes = 0;
 
-errExitLabel_5:
-    pthread_mutex_destroy(&pOtaContext->ota_queue.lock);
-errExitLabel_4:
-    sem_destroy(&pOtaContext->ota_queue.semaphr);
-errExitLabel_3:
-    // remove a thread;
-errExitLabel_2:
-    close(pOtaContext->local_record_fd);
-errExitLabel_1:
-    free(pOtaContext);
-    pOtaContext = NULL;
-errExitLabel_0:
-    return -1;
-}
- 
-void OtaDeinit() {
-    ;
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    pOtaContext->ota_state.targets[p_xfer->target].progress = progress;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
 }
 
-static void OtaSetState(enum ota_status_t status, enum ota_error_t error) 
+// why the download of a request cannot run right now, otaPauseNone if it can. A paused download
+// needs the backlog to drop further before it resumes, so it does not flap around the limit.
+static enum ota_pause_t __download_blocked(const struct ota_request_t* p_req, bool paused)
 {
-    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
-    pOtaContext->ota_state.status = status;
-    pOtaContext->ota_state.error = error;
-    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+    if (p_req->has_window) {
+        time_t now = time(NULL);
+        struct tm utc;
+
+        if ((gmtime_r(&now, &utc) == NULL) || (utc.tm_year + 1900 < OTA_CLOCK_VALID_YEAR)) {
+            return otaPauseWindow;
+        }
+
+        uint32_t minute = (uint32_t)(utc.tm_hour * 60 + utc.tm_min);
+        bool inside = (p_req->window_start < p_req->window_end) ?
+                      ((minute >= p_req->window_start) && (minute < p_req->window_end)) :
+                      ((minute >= p_req->window_start) || (minute < p_req->window_end));
+        if (!inside) {
+            return otaPauseWindow;
+        }
+    }
+
+    if (p_req->max_backlog > 0) {
+        uint32_t limit = paused ? (uint32_t)((uint64_t)p_req->max_backlog * OTA_BACKLOG_RESUME_PERCENT / 100) : p_req->max_backlog;
+
+        (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+        uint32_t backlog = pOtaContext->ota_state.telemetry_backlog;
+        (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+        if (backlog > limit) {
+            return otaPauseBacklog;
+        }
+    }
+
+    return otaPauseNone;
 }
 
-void OtaGetState(enum ota_status_t *p_status, enum ota_error_t *p_error)
+static void __set_paused(uint32_t target, enum ota_pause_t pause)
 {
     (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
-    *p_status = pOtaContext->ota_state.status;
-    *p_error = pOtaContext->ota_state.error;
+    pOtaContext->ota_state.targets[target].progress.paused = pause;
+    if (pause != otaPauseNone) {
+        pOtaContext->ota_state.targets[target].progress.rate_now = 0;
+    }
     (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
 }
 
-static void OtaSetVersion(uint32_t version)
+// blocks until the request may download again and adds the time waited to *p_waited_ms.
+// Returns false when a newer request was queued meanwhile, the twin delivered again is none.
+static bool __wait_for_schedule(const struct ota_job_t* p_job, enum ota_pause_t pause, uint32_t* p_waited_ms)
 {
-    pOtaContext->ota_version = version;
-}
+    const struct ota_request_t* p_req = &p_job->p_run->req;
+    uint64_t start_ms = __now_ms();
+    bool preempted = false;
 
-uint32_t OtaGetVersion(void)
-{
-    return pOtaContext->ota_version;
+    if (pause == otaPauseNone) {
+        return true;
+    }
+
+    Log_Debug("INFO: Download paused, %s\n", (pause == otaPauseWindow) ? "outside the download window" : "telemetry backlog");
+    __set_paused(p_job->p_target->mcu, pause);
+    while ((pause != otaPauseNone) && !preempted) {
+        preempted = __OtaEventWait(OTA_SCHEDULE_POLL_MS);
+        pause = __download_blocked(p_req, true);
+    }
+    __set_paused(p_job->p_target->mcu, otaPauseNone);
+
+    uint32_t waited_ms = (uint32_t)(__now_ms() - start_ms);
+    *p_waited_ms += waited_ms;
+    Log_Debug("INFO: Download %s after %u ms\n", preempted ? "superseded by a new request" : "resumed", waited_ms);
+    return !preempted;
+}
+
+static int xferinfo_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    struct ota_transfer_t* p_xfer = (struct ota_transfer_t*)clientp;
+    uint64_t sample_ms = p_xfer->sample_ms;
+
+    TRACE(traceCurlProgress, dlnow, dltotal);
+    __update_progress(p_xfer, (uint32_t)dlnow, false);
+
+    // the policy is checked as often as the rate is sampled, a blocked download is aborted here
+    // and resumed from the bytes on flash once it may run again
+    if (p_xfer->sample_ms != sample_ms) {
+        p_xfer->pause = __download_blocked(p_xfer->p_req, false);
+        if (p_xfer->pause != otaPauseNone) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// status of a transfer that failed with an HTTP error, 0 for any other result
+static long __http_status(CURL* curlHandle, CURLcode res)
+{
+    long http_code = 0;
+
+    if (res == CURLE_HTTP_RETURNED_ERROR) {
+        (void)curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &http_code);
+    }
+    return http_code;
+}
+
+// Reports why a transfer stopped. Returns true for transient failures, which are retried from
+// the bytes on flash after a backoff, anything else waits for the next twin update.
+static bool __set_interrupted(uint32_t target, CURL* curlHandle, CURLcode res)
+{
+    long http_code;
+
+    switch (res) {
+    // the last source answered a request with other bytes than asked for
+    case CURLE_RANGE_ERROR:
+        OtaSetState(target, otaError, otaErrHttp);
+        return false;
+    case CURLE_OPERATION_TIMEDOUT:
+        OtaSetState(target, otaInterrupted, otaErrTimeout);
+        return true;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_GOT_NOTHING:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        OtaSetState(target, otaInterrupted, otaErrHttp);
+        return true;
+    // the heap is shared with the application and the other downloads, it may be free again later
+    case CURLE_OUT_OF_MEMORY:
+        OtaSetState(target, otaInterrupted, otaErrIo);
+        return true;
+    // a url or certificate the request or the image package got wrong
+    case CURLE_UNSUPPORTED_PROTOCOL:
+    case CURLE_URL_MALFORMAT:
+    case CURLE_TOO_MANY_REDIRECTS:
+    case CURLE_PEER_FAILED_VERIFICATION:
+    case CURLE_SSL_CACERT_BADFILE:
+        OtaSetState(target, otaError, otaErrHttp);
+        return false;
+    // curl itself is unusable or was set up wrong
+    case CURLE_FAILED_INIT:
+    case CURLE_BAD_FUNCTION_ARGUMENT:
+        OtaSetState(target, otaError, otaErrIo);
+        return false;
+    case CURLE_HTTP_RETURNED_ERROR:
+        http_code = __http_status(curlHandle, res);
+        Log_Debug("INFO: HTTP status %ld\n", http_code);
+        // 403 is an expired or revoked sas and 404 a missing blob, retrying fixes neither
+        if ((http_code == 408) || (http_code == 429) || (http_code >= 500)) {
+            OtaSetState(target, otaInterrupted, otaErrHttp);
+            return true;
+        }
+        OtaSetState(target, otaError, otaErrHttp);
+        return false;
+    case CURLE_WRITE_ERROR:
+        OtaSetState(target, otaError, otaErrIo);
+        return false;
+    // not retried, so not reported as interrupted either
+    default:
+        OtaSetState(target, otaError, otaErrHttp);
+        return false;
+    }
+}
+
+// Swaps in a sas delivered through extFwSas for the version of the request, with the lock of the
+// run held. The request points into the twin buffer otherwise, the swapped in copy is owned by
+// the run and freed on the next swap.
+static bool __take_fresh_sas(struct ota_run_t* p_run)
+{
+    char* p_sas = NULL;
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    if ((pOtaContext->ota_state.p_sas != NULL) && (pOtaContext->ota_state.sas_version == p_run->req.version)) {
+        p_sas = pOtaContext->ota_state.p_sas;
+        pOtaContext->ota_state.p_sas = NULL;
+    }
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+    if (p_sas == NULL) {
+        return false;
+    }
+    free(p_run->p_sas_owned);
+    p_run->p_sas_owned = p_sas;
+    p_run->req.p_sas = p_sas;
+    p_run->sas_generation++;
+    return true;
+}
+
+// true once the sas of the run is newer than the one the last url of the job was built with
+static bool __job_has_fresh_sas(struct ota_job_t* p_job)
+{
+    struct ota_run_t* p_run = p_job->p_run;
+
+    (void)pthread_mutex_lock(&p_run->lock);
+    bool fresh = __take_fresh_sas(p_run) || (p_run->sas_generation != p_job->sas_generation);
+    (void)pthread_mutex_unlock(&p_run->lock);
+
+    return fresh;
+}
+
+// Asks the backend for a new sas through the reported SasRequest and waits for it in extFwSas,
+// the targets of a run rejected at the same time wait for the same one.
+// Returns false if none arrived in time or a newer request was queued, *p_preempted tells which.
+// Neither an extFwInfo nor an extFwSas the twin delivers again ends the wait.
+static bool __refresh_sas(struct ota_job_t* p_job, bool* p_preempted)
+{
+    uint64_t start_ms = __now_ms();
+    uint32_t target = p_job->p_target->mcu;
+    bool fresh = __job_has_fresh_sas(p_job);
+
+    if (!fresh) {
+        Log_Debug("INFO: SAS rejected, requesting a new one for version %u\n", p_job->p_run->req.version);
+        (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+        pOtaContext->ota_state.sas_request = p_job->p_run->req.version;
+        pOtaContext->ota_state.sas_waiters++;
+        (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+        OtaSetState(target, otaInterrupted, otaErrSas);
+
+        while (!fresh && !*p_preempted && (__now_ms() - start_ms < OTA_SAS_WAIT_MS)) {
+            *p_preempted = __OtaEventWait(OTA_SCHEDULE_POLL_MS);
+            fresh = __job_has_fresh_sas(p_job);
+        }
+
+        (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+        pOtaContext->ota_state.sas_waiters--;
+        (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+    }
+
+    if (fresh) {
+        Log_Debug("INFO: New SAS after %u ms\n", (uint32_t)(__now_ms() - start_ms));
+        OtaSetState(target, otaDownloading, otaErrNone);
+    }
+    return fresh;
+}
+
+// Asks for a new sas when blob storage rejected the one of the request, true once it arrived and the
+// transfer can be tried again. A mirror rejecting a request fails over to the next source instead.
+static bool __sas_retry(struct ota_job_t* p_job, CURL* curlHandle, uint32_t source, CURLcode res, bool* p_preempted)
+{
+    if ((source != p_job->p_run->req.mirror_count) || (__http_status(curlHandle, res) != 403) ||
+        (p_job->sas_refreshes >= OTA_SAS_REFRESH_MAX)) {
+        return false;
+    }
+    p_job->sas_refreshes++;
+    return __refresh_sas(p_job, p_preempted);
+}
+
+// estimated heap of a download: curl with its TLS session, the manifest and the verify buffer
+static uint32_t __download_memory(const struct ota_target_t* p_target)
+{
+    uint32_t memory = OTA_TRANSFER_MEMORY + OTA_VERIFY_CHUNK;
+
+    if (p_target->p_manifest != NULL) {
+        uint32_t count = (p_target->size + p_target->chunk_size - 1) / p_target->chunk_size;
+        memory += count * (uint32_t)sizeof(sha256_digest) + (count + 7) / 8;
+    }
+    return memory;
+}
+
+// Takes memory of the run from OTA_MEMORY_BUDGET, waits while the other downloads hold too much
+// of it. Returns false when a newer request was queued meanwhile.
+static bool __budget_acquire(struct ota_run_t* p_run, uint32_t memory)
+{
+    struct timespec deadline;
+    bool preempted = false;
+
+    (void)pthread_mutex_lock(&p_run->lock);
+    while ((p_run->downloads > 0) && (p_run->memory + memory > OTA_MEMORY_BUDGET) && !preempted) {
+        __deadline(&deadline, OTA_SCHEDULE_POLL_MS);
+        if (pthread_cond_timedwait(&p_run->released, &p_run->lock, &deadline) == ETIMEDOUT) {
+            preempted = __OtaEventWait(0);
+        }
+    }
+    if (!preempted) {
+        p_run->downloads++;
+        p_run->memory += memory;
+    }
+    (void)pthread_mutex_unlock(&p_run->lock);
+
+    return !preempted;
+}
+
+static void __budget_release(struct ota_run_t* p_run, uint32_t memory)
+{
+    (void)pthread_mutex_lock(&p_run->lock);
+    p_run->downloads--;
+    p_run->memory -= memory;
+    (void)pthread_cond_broadcast(&p_run->released);
+    (void)pthread_mutex_unlock(&p_run->lock);
+}
+
+// maxRate of the request is split evenly between its workers, curl cannot move the cap of a
+// running transfer, so a share is not handed on while another download is paused or done
+static uint32_t __rate_share(struct ota_run_t* p_run)
+{
+    // the count drops when fewer workers than planned could be created
+    (void)pthread_mutex_lock(&p_run->lock);
+    uint32_t share = p_run->req.max_rate / p_run->workers;
+    (void)pthread_mutex_unlock(&p_run->lock);
+
+    // a share rounded down to 0 would lift the cap
+    return ((p_run->req.max_rate > 0) && (share == 0)) ? 1 : share;
+}
+
+// backoff before automatic retry number attempt, uniformly jittered over its upper half
+static uint32_t __retry_delay_ms(uint32_t attempt, unsigned int* p_seed)
+{
+    uint32_t delay = OTA_RETRY_BASE_MS;
+
+    for (uint32_t i = 0; (i < attempt) && (delay < OTA_RETRY_CAP_MS); i++) {
+        delay *= 2;
+    }
+    if (delay > OTA_RETRY_CAP_MS) {
+        delay = OTA_RETRY_CAP_MS;
+    }
+    return delay / 2 + (uint32_t)rand_r(p_seed) % (delay / 2 + 1);
+}
+
+static char* __sas_url(const char* p_url, const char* p_sas)
+{
+    char* sasurl = calloc(strlen(p_url) + sizeof('?') + strlen(p_sas) + sizeof('\0'), sizeof(char));
+
+    if (sasurl != NULL) {
+        (void)strcat(strcat(strcat(sasurl, p_url), "?"), p_sas);
+    }
+    return sasurl;
+}
+
+// url of p_url on a source, sources below mirror_count are mirrors and mirror_count is blob storage.
+// A mirror gets the path of the blob and fetches it with its own credentials on a miss, the sas of
+// the request is appended only for a mirror that asked for it.
+static char* __source_url(const struct ota_request_t* p_req, uint32_t source, const char* p_url)
+{
+    if (source >= p_req->mirror_count) {
+        return __sas_url(p_url, p_req->p_sas);
+    }
+
+    const char* p_mirror = p_req->p_mirrors[source];
+    const char* p_path = strstr(p_url, "://");
+    size_t mirror_len = strlen(p_mirror);
+    char* url;
+    size_t len;
+
+    p_path = (p_path != NULL) ? strchr(p_path + strlen("://"), '/') : NULL;
+    if (p_path == NULL) {
+        p_path = "/";
+    }
+    if ((mirror_len > 0) && (p_mirror[mirror_len - 1] == '/')) {
+        mirror_len--;
+    }
+
+    bool with_sas = p_req->mirror_sas[source];
+    len = mirror_len + strlen(p_path) + (with_sas ? sizeof('?') + strlen(p_req->p_sas) : 0) + sizeof('\0');
+    url = malloc(len);
+    if (url != NULL) {
+        (void)snprintf(url, len, "%.*s%s%s%s", (int)mirror_len, p_mirror, p_path, with_sas ? "?" : "", with_sas ? p_req->p_sas : "");
+    }
+    return url;
+}
+
+// points the handle at p_url on a source, the url is copied by curl
+static bool __curl_set_source(CURL* curlHandle, struct ota_job_t* p_job, uint32_t source, const char* p_url)
+{
+    const struct ota_request_t* p_req = &p_job->p_run->req;
+
+    // the sas is replaced under the lock of the run
+    (void)pthread_mutex_lock(&p_job->p_run->lock);
+    char* url = __source_url(p_req, source, p_url);
+    p_job->sas_generation = p_job->p_run->sas_generation;
+    (void)pthread_mutex_unlock(&p_job->p_run->lock);
+
+    if (url == NULL) {
+        Log_Debug("ERROR: malloc fail\n");
+        return false;
+    }
+    (void)curl_easy_setopt(curlHandle, CURLOPT_URL, url);
+    // a mirror that is down must not hold up the fallback to blob storage, 0 is the curl default
+    (void)curl_easy_setopt(curlHandle, CURLOPT_CONNECTTIMEOUT, (source < p_req->mirror_count) ? OTA_MIRROR_CONNECT_TIMEOUT : 0L);
+    free(url);
+
+    Log_Debug("INFO: Fetching %s from %s\n", p_url, (source < p_req->mirror_count) ? p_req->p_mirrors[source] : "blob storage");
+    return true;
+}
+
+// options shared by every transfer of a request, the handle keeps its connection across them
+static CURL* __curl_open(struct curl_slist** p_headers, uint32_t max_rate)
+{
+    CURL* curlHandle;
+
+    curlHandle = curl_easy_init();
+    if (curlHandle == NULL) {
+        Log_Debug("ERROR: curl_easy_init fail\n");
+        return NULL;
+    }
+
+    (void)curl_easy_setopt(curlHandle, CURLOPT_CAINFO, Storage_GetAbsolutePathInImagePackage("certs/root.pem"));
+    // specify Azure Blob REST API version, for version order than 2011-08-18 do not accept 'Range: bytes=start-' header
+    *p_headers = curl_slist_append(*p_headers, "x-ms-version:2019-02-02");
+    (void)curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, *p_headers);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_HTTPGET, 1);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_FAILONERROR, 1);
+    // abort if speed is below 10bytes/seconds for 30 seconds
+    (void)curl_easy_setopt(curlHandle, CURLOPT_LOW_SPEED_TIME,  30);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_LOW_SPEED_LIMIT, 10);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_NOPROGRESS, 1);
+    // 0 leaves the receive rate unlimited
+    (void)curl_easy_setopt(curlHandle, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)max_rate);
+#if defined(OTA_CURL_VERBOSE)
+    // Debug Options
+    (void)curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, 1L);
+#endif
+
+    return curlHandle;
+}
+
+static size_t buffer_write_callback(void* ptr, size_t size, size_t nmemb, void* userdata)
+{
+    struct ota_buffer_t* p_buffer = userdata;
+
+    if (nmemb > p_buffer->capacity - p_buffer->length) {
+        Log_Debug("ERROR: Response larger than expected\n");
+        return 0;
+    }
+    memcpy(&p_buffer->p_data[p_buffer->length], ptr, nmemb);
+    p_buffer->length += nmemb;
+    return nmemb;
+}
+
+static uint32_t __chunk_length(const struct ota_manifest_t* p_manifest, uint32_t index)
+{
+    uint32_t left = p_manifest->image_size - index * p_manifest->chunk_size;
+
+    return (left < p_manifest->chunk_size) ? left : p_manifest->chunk_size;
+}
+
+static bool __chunk_is_bad(const struct ota_manifest_t* p_manifest, uint32_t index)
+{
+    return (p_manifest->p_bad[index >> 3] & (1u << (index & 7))) != 0;
+}
+
+static void __chunk_set_bad(struct ota_manifest_t* p_manifest, uint32_t index, bool bad)
+{
+    uint8_t bit = (uint8_t)(1u << (index & 7));
+
+    if (bad && !__chunk_is_bad(p_manifest, index)) {
+        p_manifest->p_bad[index >> 3] |= bit;
+        p_manifest->bad_count++;
+    } else if (!bad && __chunk_is_bad(p_manifest, index)) {
+        p_manifest->p_bad[index >> 3] &= (uint8_t)~bit;
+        p_manifest->bad_count--;
+    }
+}
+
+static void __manifest_free(struct ota_manifest_t* p_manifest)
+{
+    free(p_manifest->p_hashes);
+    free(p_manifest->p_bad);
+    memset(p_manifest, 0, sizeof(*p_manifest));
+}
+
+// pairs of nodes are hashed level by level, an odd node is carried up unchanged,
+// script/ota.py builds the same tree
+static bool __merkle_root(const sha256_digest* p_leaves, uint32_t count, sha256_digest* p_root)
+{
+    sha256_digest* p_level = malloc(count * sizeof(sha256_digest));
+
+    if (p_level == NULL) {
+        Log_Debug("ERROR: malloc fail\n");
+        return false;
+    }
+    memcpy(p_level, p_leaves, count * sizeof(sha256_digest));
+
+    while (count > 1) {
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < count; i += 2) {
+            if (i + 1 < count) {
+                sha256_accel_context ctx;
+                sha256_accel_init(&ctx);
+                sha256_accel_update(&ctx, &p_level[i], 2 * sizeof(sha256_digest));
+                sha256_accel_final(&ctx, &p_level[next]);
+            } else {
+                p_level[next] = p_level[i];
+            }
+            next++;
+        }
+        count = next;
+    }
+
+    *p_root = p_level[0];
+    free(p_level);
+    return true;
+}
+
+// downloads the chunk hashes from a source and checks them against the root from the twin
+// *p_res is the result of the transfer, CURLE_OK when something else failed
+static bool __manifest_fetch(CURL* curlHandle, struct ota_job_t* p_job, uint32_t source, struct ota_manifest_t* p_manifest,
+                             CURLcode* p_res)
+{
+    const struct ota_target_t* p_target = p_job->p_target;
+    struct ota_buffer_t buffer;
+    sha256_digest root;
+    CURLcode res;
+
+    p_manifest->chunk_size = p_target->chunk_size;
+    p_manifest->image_size = p_target->size;
+    p_manifest->count = (p_target->size + p_target->chunk_size - 1) / p_target->chunk_size;
+    p_manifest->bad_count = 0;
+    p_manifest->p_hashes = malloc(p_manifest->count * sizeof(sha256_digest));
+    p_manifest->p_bad = calloc((p_manifest->count + 7) / 8, 1);
+    if ((p_manifest->p_hashes == NULL) || (p_manifest->p_bad == NULL)) {
+        Log_Debug("ERROR: malloc fail\n");
+        goto error;
+    }
+    if (!__curl_set_source(curlHandle, p_job, source, p_target->p_manifest)) {
+        goto error;
+    }
+
+    buffer.p_data = (uint8_t*)p_manifest->p_hashes;
+    buffer.length = 0;
+    buffer.capacity = p_manifest->count * sizeof(sha256_digest);
+
+    (void)curl_easy_setopt(curlHandle, CURLOPT_RESUME_FROM, 0);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_HEADERFUNCTION, NULL);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, buffer_write_callback);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &buffer);
+    res = curl_easy_perform(curlHandle);
+    TRACE(traceCurlDone, res, 0);
+    *p_res = res;
+
+    if (res != CURLE_OK) {
+        LogCurlError("ERROR: Manifest download failed", res);
+        goto error;
+    }
+    if (buffer.length != buffer.capacity) {
+        Log_Debug("ERROR: Manifest has %u bytes, expected %u\n", (uint32_t)buffer.length, (uint32_t)buffer.capacity);
+        goto error;
+    }
+    if (!__merkle_root(p_manifest->p_hashes, p_manifest->count, &root)) {
+        goto error;
+    }
+    if (!sha256_digest_equal(&root, &p_target->root)) {
+        Log_Debug("ERROR: Manifest does not match its root\n");
+        goto error;
+    }
+
+    Log_Debug("INFO: Manifest of %u chunks of %u bytes\n", p_manifest->count, p_manifest->chunk_size);
+    return true;
+
+error:
+    __manifest_free(p_manifest);
+    return false;
+}
+
+// hashes bytes written at p_sink->offset, each chunk is checked as soon as its last byte lands
+static void __manifest_hash(struct ota_sink_t* p_sink, const uint8_t* p_data, size_t len)
+{
+    struct ota_manifest_t* p_manifest = p_sink->p_manifest;
+    uint32_t offset = p_sink->offset;
+
+    while (len > 0) {
+        uint32_t index = offset / p_manifest->chunk_size;
+        uint32_t pos = offset % p_manifest->chunk_size;
+        uint32_t length = __chunk_length(p_manifest, index);
+        uint32_t n = (len < length - pos) ? (uint32_t)len : length - pos;
+
+        if (pos == 0) {
+            sha256_accel_init(&p_sink->chunk_ctx);
+        }
+        sha256_accel_update(&p_sink->chunk_ctx, p_data, n);
+        p_data += n;
+        len -= n;
+        offset += n;
+
+        if (pos + n == length) {
+            sha256_digest digest;
+            sha256_accel_final(&p_sink->chunk_ctx, &digest);
+            bool bad = !sha256_digest_equal(&digest, &p_manifest->p_hashes[index]);
+            if (bad) {
+                Log_Debug("WARNING: Chunk %u failed its hash\n", index);
+            }
+            __chunk_set_bad(p_manifest, index, bad);
+        }
+    }
+}
+
+// hashes the chunks stored in [0, end) again, end is on a chunk boundary or the image size
+static void __manifest_check_flash(lfs_file_t* p_file, struct ota_manifest_t* p_manifest, uint32_t end)
+{
+    struct ota_sink_t sink;
+    uint8_t* buffer = malloc(OTA_VERIFY_CHUNK);
+    lfs_ssize_t nb;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.p_file = p_file;
+    sink.p_manifest = p_manifest;
+
+    if (buffer == NULL) {
+        // unchecked chunks count as good, the whole image sha256 still catches them
+        Log_Debug("ERROR: malloc fail\n");
+        return;
+    }
+
+    w25q128_lfs_lock();
+    (void)lfs_file_seek(&g_w25q128_lfs, p_file, 0, LFS_SEEK_SET);
+    w25q128_lfs_unlock();
+
+    while (sink.offset < end) {
+        uint32_t want = (end - sink.offset < OTA_VERIFY_CHUNK) ? end - sink.offset : OTA_VERIFY_CHUNK;
+        nb = w25q128_stream_read(W25Q128_STREAM_DOWNLOAD, p_file, buffer, want);
+        TRACE(traceLfsRead, want, nb);
+        if (nb <= 0) {
+            Log_Debug("ERROR: IO Error during chunk check\n");
+            for (uint32_t index = sink.offset / p_manifest->chunk_size; index * p_manifest->chunk_size < end; index++) {
+                __chunk_set_bad(p_manifest, index, true);
+            }
+            break;
+        }
+        __manifest_hash(&sink, buffer, (size_t)nb);
+        sink.offset += (uint32_t)nb;
+    }
+    free(buffer);
+
+    // leave the file position where a resumed download appends
+    w25q128_lfs_lock();
+    (void)lfs_file_seek(&g_w25q128_lfs, p_file, end, LFS_SEEK_SET);
+    w25q128_lfs_unlock();
+
+    Log_Debug("INFO: %u chunks on flash need to be fetched again\n", p_manifest->bad_count);
+}
+
+static CURLcode __fetch_chunk(CURL* curlHandle, struct ota_sink_t* p_sink, uint32_t index, struct ota_timing_t* p_timing)
+{
+    struct ota_manifest_t* p_manifest = p_sink->p_manifest;
+    uint32_t start = index * p_manifest->chunk_size;
+    uint32_t length = __chunk_length(p_manifest, index);
+    char range[24];
+    double size_dl = 0;
+    CURLcode res;
+
+    (void)snprintf(range, sizeof(range), "%u-%u", start, start + length - 1);
+
+    w25q128_lfs_lock();
+    (void)lfs_file_seek(&g_w25q128_lfs, p_sink->p_file, start, LFS_SEEK_SET);
+    w25q128_lfs_unlock();
+    p_sink->offset = start;
+    p_sink->limit = start + length;
+
+    (void)curl_easy_setopt(curlHandle, CURLOPT_RESUME_FROM, 0);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_RANGE, range);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, write_callback);
+    (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, p_sink);
+    __sink_begin(curlHandle, p_sink, true);
+    res = __sink_result(p_sink, curl_easy_perform(curlHandle));
+    (void)curl_easy_setopt(curlHandle, CURLOPT_RANGE, NULL);
+    TRACE(traceCurlDone, res, start);
+
+    (void)curl_easy_getinfo(curlHandle, CURLINFO_SIZE_DOWNLOAD, &size_dl);
+    p_timing->bytes += (uint32_t)size_dl;
+    return res;
+}
+
+// fetches the chunks marked bad with range requests, a chunk that arrives short stays bad.
+// Starts at *p_source and moves on to the next source while it fails or keeps serving bad chunks.
+static CURLcode __manifest_repair(CURL* curlHandle, struct ota_job_t* p_job, uint32_t* p_source,
+                                  struct ota_sink_t* p_sink, struct ota_timing_t* p_timing, bool* p_preempted)
+{
+    const struct ota_request_t* p_req = &p_job->p_run->req;
+    struct ota_manifest_t* p_manifest = p_sink->p_manifest;
+    CURLcode res = CURLE_OK;
+
+    (void)curl_easy_setopt(curlHandle, CURLOPT_NOPROGRESS, 1);
+
+    while (p_manifest->bad_count > 0) {
+        if (!__curl_set_source(curlHandle, p_job, *p_source, p_job->p_target->p_url)) {
+            return CURLE_OUT_OF_MEMORY;
+        }
+
+        res = CURLE_OK;
+        for (uint32_t round = 0; (round < OTA_CHUNK_REFETCH_ROUNDS) && (p_manifest->bad_count > 0) && (res == CURLE_OK); round++) {
+            Log_Debug("INFO: Fetching %u chunks again\n", p_manifest->bad_count);
+            for (uint32_t index = 0; (index < p_manifest->count) && (res == CURLE_OK); index++) {
+                if (__chunk_is_bad(p_manifest, index)) {
+                    res = __fetch_chunk(curlHandle, p_sink, index, p_timing);
+                }
+            }
+        }
+        if (res != CURLE_OK) {
+            LogCurlError("ERROR: Chunk download failed", res);
+        }
+        if (__sas_retry(p_job, curlHandle, *p_source, res, p_preempted)) {
+            continue;
+        }
+
+        if ((p_manifest->bad_count == 0) || (res == CURLE_WRITE_ERROR) || (*p_source >= p_req->mirror_count) || *p_preempted) {
+            break;
+        }
+        (*p_source)++;
+    }
+
+    if ((res == CURLE_OK) && (p_manifest->bad_count > 0)) {
+        Log_Debug("ERROR: %u chunks still fail their hash\n", p_manifest->bad_count);
+    }
+    return res;
+}
+
+// One attempt at the target of a job: download what is missing and verify it. p_job->apply is set
+// when the verified image is newer than the MCU, the apply worker flashes it then and reports the
+// timing of the attempt. Returns true for a transient failure, which is retried from the bytes on
+// flash after a backoff; *p_preempted tells that a newer request was queued meanwhile.
+static bool __target_attempt(struct ota_job_t* p_job, uint32_t attempt, bool* p_preempted)
+{
+    struct ota_run_t* p_run = p_job->p_run;
+    const struct ota_request_t* p_req = &p_run->req;
+    const struct ota_target_t* p_target = p_job->p_target;
+    uint32_t target = p_target->mcu;
+    uint32_t local_version;
+    uint32_t resume_offset;
+    bool need_download;
+    bool has_partial_image;
+    bool finish_download;
+    lfs_file_t ota_binary_file;
+    struct ota_timing_t *p_timing = &p_job->timing;
+    uint64_t phase_ms;
+    char sha256_string[SHA256_ACCEL_BYTES * 2 + sizeof('\0')];
+    CURL* curlHandle = NULL;
+    struct curl_slist* curlHeaders = NULL;
+    struct ota_manifest_t manifest;
+    struct ota_sink_t sink;
+    uint32_t source;
+    uint32_t memory = 0;
+    bool preempted = false;
+    bool transient = false;
+
+    p_job->sas_refreshes = 0;
+    p_job->apply = false;
+    (void)__job_has_fresh_sas(p_job);
+
+    memset(p_timing, 0, sizeof(*p_timing));
+    p_timing->version = p_target->version;
+    p_timing->retry = attempt;
+    p_timing->queue_ms = (uint32_t)(__now_ms() - p_req->enqueue_ms);
+    p_timing->target = target;
+
+    Log_Debug("Checking OTA of %s, server version is %d\n", ExtMCU_GetName(target), p_target->version);
+    Log_Debug("URL = %s\n", p_target->p_url);
+    Log_Debug("SAS = %s\n", p_req->p_sas);
+    sha256_digest_to_hex(&p_target->sha256, sha256_string);
+    Log_Debug("SHA256 = %s\n", sha256_string);
+
+    if (!__target_verify(p_req, p_target)) {
+        OtaSetState(target, otaError, otaErrVerify);
+        OtaSetTiming(p_timing);
+        return false;
+    }
+
+    w25q128_lfs_lock();
+    int open_err = lfs_file_open(&g_w25q128_lfs, &ota_binary_file, p_job->path, LFS_O_RDWR | LFS_O_CREAT);
+    w25q128_lfs_unlock();
+    if (open_err != LFS_ERR_OK) {
+        Log_Debug("ERROR: Unable to open %s file\n", p_job->path);
+        OtaSetState(target, otaError, otaErrIo);
+        OtaSetTiming(p_timing);
+        return false;
+    }
+
+    resume_offset = 0;
+    need_download = true;
+    has_partial_image = false;
+    finish_download = false;
+    memset(&manifest, 0, sizeof(manifest));
+    memset(&sink, 0, sizeof(sink));
+    sink.p_file = &ota_binary_file;
+    source = 0;
+
+    local_version = __get_local_record(target, &has_partial_image);
+
+    // if the record of the MCU is {"Downloading":x}, it means there is a partial received image on file system
+    if (has_partial_image) {
+
+        // when x is newer version than server push, we do not roll back. or we can accept roll back depends real policy.
+        if (local_version > p_target->version) {
+            need_download = false;
+        // when x is euqal to server version, we will try to resume from the last break point.
+        } else if (local_version == p_target->version) {
+            w25q128_lfs_lock();
+            lfs_soff_t size = lfs_file_seek(&g_w25q128_lfs, &ota_binary_file, 0, LFS_SEEK_END);
+            w25q128_lfs_unlock();
+            if (size >= 0) {
+                if (size < p_target->size) {
+                    resume_offset = size;
+                } else if (size == p_target->size) {
+                    need_download = false;
+                    finish_download = true;
+                } else {
+                    need_download = false;
+                    Log_Debug("ERROR: Incorrect file size\n");
+                }
+            } else {
+                resume_offset = 0;
+            }
+        }
+    } else {
+        // if the record of the MCU is {"Completed":x}, it means there is a previous completed image on file system
+        if (local_version >= p_target->version) {
+            // when x is a equal or newer version than on server, do not start. (also depends on roll back policy)
+            need_download = false;
+        }
+    }
+
+    // nothing is fetched outside the download window or while telemetry is backed up
+    if (need_download) {
+        OtaSetState(target, otaDownloading, otaErrNone);
+        if (!__wait_for_schedule(p_job, __download_blocked(p_req, false), &p_timing->paused_ms)) {
+            preempted = true;
+            need_download = false;
+        }
+    }
+
+    // the downloads of a run running at the same time must fit OTA_MEMORY_BUDGET together
+    if (need_download || (finish_download && (p_target->p_manifest != NULL))) {
+        memory = __download_memory(p_target);
+        if (!__budget_acquire(p_run, memory)) {
+            memory = 0;
+            preempted = true;
+            need_download = false;
+            finish_download = false;
+        }
+    }
+
+    if ((p_target->p_manifest != NULL) && (need_download || finish_download)) {
+        curlHandle = __curl_open(&curlHeaders, __rate_share(p_run));
+        // the image is still checked against sha256 without a manifest, chunks just cannot be repaired.
+        // The source that serves a manifest matching the root is used for the image as well.
+        while ((curlHandle != NULL) && (source <= p_req->mirror_count)) {
+            CURLcode res = CURLE_OK;
+            if (__manifest_fetch(curlHandle, p_job, source, &manifest, &res)) {
+                sink.p_manifest = &manifest;
+                break;
+            }
+            if (__sas_retry(p_job, curlHandle, source, res, &preempted)) {
+                continue;
+            }
+            if (preempted) {
+                need_download = false;
+                finish_download = false;
+                break;
+            }
+            source++;
+        }
+        if (sink.p_manifest == NULL) {
+            source = 0;
+            if (!preempted) {
+                Log_Debug("WARNING: Manifest unavailable, verifying the whole image only\n");
+            }
+        }
+    }
+
+    // chunks below the break point landed in an earlier attempt, resume on a chunk boundary
+    // and check those on flash once
+    if (need_download && (sink.p_manifest != NULL) && (resume_offset > 0)) {
+        resume_offset -= resume_offset % manifest.chunk_size;
+        w25q128_lfs_lock();
+        (void)lfs_file_truncate(&g_w25q128_lfs, &ota_binary_file, resume_offset);
+        w25q128_lfs_unlock();
+        __manifest_check_flash(&ota_binary_file, &manifest, resume_offset);
+    }
+
+    if (need_download && (curlHandle == NULL)) {
+        curlHandle = __curl_open(&curlHeaders, __rate_share(p_run));
+        if (curlHandle == NULL) {
+            transient = !preempted && __set_interrupted(target, NULL, CURLE_OUT_OF_MEMORY);
+            need_download = false;
+        }
+    }
+
+    if (need_download) {
+
+        Log_Debug("Starting download from offset %d...\n", resume_offset);
+
+        // For a refresh download, clean the file and change the record of the MCU to {"Downloading":y}
+        if (resume_offset == 0) {
+            w25q128_lfs_lock();
+            lfs_file_truncate(&g_w25q128_lfs, &ota_binary_file, 0);
+            w25q128_lfs_unlock();
+            __update_local_record(target, p_target->version, false);
+        }
+
+        OtaSetState(target, otaDownloading, otaErrNone);
+
+        struct ota_transfer_t xfer;
+        CURLcode res = CURLE_OUT_OF_MEMORY;
+
+        sink.offset = resume_offset;
+        sink.limit = p_target->size;
+        (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, write_callback);
+        (void)curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &sink);
+        (void)curl_easy_setopt(curlHandle, CURLOPT_XFERINFOFUNCTION, xferinfo_callback);
+        (void)curl_easy_setopt(curlHandle, CURLOPT_XFERINFODATA, &xfer);
+        (void)curl_easy_setopt(curlHandle, CURLOPT_NOPROGRESS, 0);
+        xfer.p_req = p_req;
+        xfer.target = target;
+
+        // a source that fails, or answers with other bytes than requested, hands over to the next
+        // one at the offset reached, everything it wrote is still checked against the manifest and sha256
+        while (__curl_set_source(curlHandle, p_job, source, p_target->p_url)) {
+            uint32_t start_offset = sink.offset;
+
+            xfer.rate_cap = __rate_share(p_run);
+            p_timing->rate_cap = xfer.rate_cap;
+            (void)curl_easy_setopt(curlHandle, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)xfer.rate_cap);
+            (void)curl_easy_setopt(curlHandle, CURLOPT_RESUME_FROM, start_offset);
+            // progress feeds the reported download rate and ETA
+            __start_progress(&xfer, start_offset, p_target->size);
+
+            __sink_begin(curlHandle, &sink, start_offset > 0);
+            res = __sink_result(&sink, curl_easy_perform(curlHandle));
+            TRACE(traceCurlDone, res, start_offset);
+
+            double connect_s = 0, appconnect_s = 0, total_s = 0, size_dl = 0;
+            (void)curl_easy_getinfo(curlHandle, CURLINFO_CONNECT_TIME, &connect_s);
+            (void)curl_easy_getinfo(curlHandle, CURLINFO_APPCONNECT_TIME, &appconnect_s);
+            (void)curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &total_s);
+            (void)curl_easy_getinfo(curlHandle, CURLINFO_SIZE_DOWNLOAD, &size_dl);
+            // APPCONNECT is 0 for plain http, connect time is the end of the handshake then
+            if (appconnect_s < connect_s) {
+                appconnect_s = connect_s;
+            }
+            p_timing->connect_ms += (uint32_t)(appconnect_s * 1000);
+            p_timing->transfer_ms += (total_s > appconnect_s) ? (uint32_t)((total_s - appconnect_s) * 1000) : 0;
+            p_timing->bytes += (uint32_t)size_dl;
+
+            // stopped by the policy, continue on the same source once it allows
+            if ((res == CURLE_ABORTED_BY_CALLBACK) && (xfer.pause != otaPauseNone)) {
+                if (__wait_for_schedule(p_job, xfer.pause, &p_timing->paused_ms)) {
+                    continue;
+                }
+                preempted = true;
+                break;
+            }
+
+            // an expired sas is replaced through the twin, the transfer continues where it stopped
+            if (__sas_retry(p_job, curlHandle, source, res, &preempted)) {
+                continue;
+            }
+            if (preempted) {
+                break;
+            }
+
+            // a failed flash write fails on any source
+            if ((res == CURLE_OK) || (res == CURLE_WRITE_ERROR) || (source >= p_req->mirror_count)) {
+                break;
+            }
+            LogCurlError("WARNING: Mirror failed, trying the next source", res);
+            source++;
+        }
+
+        w25q128_lfs_lock();
+        lfs_soff_t size = lfs_file_size(&g_w25q128_lfs, &ota_binary_file);
+        w25q128_lfs_unlock();
+        if (size >= (lfs_soff_t)xfer.resume_offset) {
+            __update_progress(&xfer, (uint32_t)size - xfer.resume_offset, true);
+        }
+        (void)curl_easy_setopt(curlHandle, CURLOPT_NOPROGRESS, 1);
+
+        // only the chunks that failed their hash on the way in are fetched again
+        if ((res == CURLE_OK) && (sink.p_manifest != NULL)) {
+            res = __manifest_repair(curlHandle, p_job, &source, &sink, p_timing, &preempted);
+        }
+
+        if (res == CURLE_OK) {
+            phase_ms = __now_ms();
+            w25q128_lfs_lock();
+            (void)lfs_file_sync(&g_w25q128_lfs, &ota_binary_file);
+            size = lfs_file_size(&g_w25q128_lfs, &ota_binary_file);
+            w25q128_lfs_unlock();
+            p_timing->sync_ms = (uint32_t)(__now_ms() - phase_ms);
+
+            finish_download = true;
+            Log_Debug("INFO: Download Finished, file size = %d\n", size);
+        } else {
+            Log_Debug("INFO: Download interrupted, ret code = %d\n", res);
+            transient = !preempted && __set_interrupted(target, curlHandle, res);
+        }
+    }
+
+    // A completed file is downloaded or has been download (if a powerfail happens after download and before verify pass)
+    if (finish_download) {
+
+        phase_ms = __now_ms();
+        bool verified = __image_verify(&ota_binary_file, &p_target->sha256);
+
+        // chunks hashed fine on arrival can still read back wrong, find and fetch them again
+        if (!verified && (sink.p_manifest != NULL)) {
+            __manifest_check_flash(&ota_binary_file, &manifest, p_target->size);
+            CURLcode res = __manifest_repair(curlHandle, p_job, &source, &sink, p_timing, &preempted);
+            if (res == CURLE_OK) {
+                w25q128_lfs_lock();
+                (void)lfs_file_sync(&g_w25q128_lfs, &ota_binary_file);
+                w25q128_lfs_unlock();
+                verified = __image_verify(&ota_binary_file, &p_target->sha256);
+            }
+        }
+        p_timing->verify_ms = (uint32_t)(__now_ms() - phase_ms);
+        p_timing->image_size = p_target->size;
+
+        if (verified) {
+            __update_local_record(target, p_target->version, true);
+        } else {
+            // empty the file to make sure retry from start
+            w25q128_lfs_lock();
+            (void)lfs_file_truncate(&g_w25q128_lfs, &ota_binary_file, 0);
+            w25q128_lfs_unlock();
+            OtaSetState(target, otaError, otaErrVerify);
+        }
+    }
+
+    __manifest_free(&manifest);
+    if (curlHandle != NULL) {
+        curl_easy_cleanup(curlHandle);
+        curl_slist_free_all(curlHeaders);
+    }
+    if (memory > 0) {
+        __budget_release(p_run, memory);
+    }
+
+    w25q128_lfs_lock();
+    lfs_file_close(&g_w25q128_lfs, &ota_binary_file);
+    w25q128_lfs_unlock();
+
+    // read again since a good ota will update local record
+    local_version = __get_local_record(target, &has_partial_image);
+    if ((!has_partial_image) && (ExtMCU_GetVersion(target) < local_version)) {
+        p_job->apply = true;
+        p_job->apply_version = local_version;
+        p_job->verified_ms = __now_ms();
+        OtaSetState(target, otaApplying, otaErrNone);
+    } else {
+        OtaSetTiming(p_timing);
+    }
+
+    *p_preempted = preempted;
+    return transient;
+}
+
+// takes the next target of the run, false once there is none or a newer request was queued
+static bool __run_next_job(struct ota_run_t* p_run, struct ota_job_t* p_job)
+{
+    bool found = false;
+
+    (void)pthread_mutex_lock(&p_run->lock);
+    if ((p_run->next_target < p_run->req.target_count) && !__OtaEventWait(0)) {
+        memset(p_job, 0, sizeof(*p_job));
+        p_job->p_run = p_run;
+        p_job->p_target = &p_run->req.targets[p_run->next_target++];
+        // the first MCU keeps the file of the time before targets, a partial image on it resumes
+        if (p_job->p_target->mcu == 0) {
+            (void)snprintf(p_job->path, sizeof(p_job->path), "%s", OTA_DEFAULT_FILE);
+        } else {
+            (void)snprintf(p_job->path, sizeof(p_job->path), OTA_TARGET_FILE_FORMAT, ExtMCU_GetName(p_job->p_target->mcu));
+        }
+        found = true;
+    }
+    (void)pthread_mutex_unlock(&p_run->lock);
+
+    if (found) {
+        (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+        pOtaContext->ota_state.pending_targets &= ~(1u << p_job->p_target->mcu);
+        (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+    }
+    return found;
+}
+
+// hands a verified image to the apply worker, the network worker moves on to the next target
+static void __apply_enqueue(struct ota_run_t* p_run, const struct ota_job_t* p_job)
+{
+    (void)pthread_mutex_lock(&p_run->lock);
+    // every target is queued once at most, the queue cannot overflow
+    p_run->apply_jobs[(p_run->apply_rpos + p_run->apply_count++) % OTA_MAX_TARGETS] = *p_job;
+    (void)pthread_cond_broadcast(&p_run->applicable);
+    (void)pthread_mutex_unlock(&p_run->lock);
+}
+
+// takes the next image to apply, in the order they were verified. Waits while network workers
+// are running, false once they all ended and nothing is left.
+static bool __apply_dequeue(struct ota_run_t* p_run, struct ota_job_t* p_job)
+{
+    bool found = false;
+
+    (void)pthread_mutex_lock(&p_run->lock);
+    while ((p_run->apply_count == 0) && (p_run->workers_running > 0)) {
+        (void)pthread_cond_wait(&p_run->applicable, &p_run->lock);
+    }
+    if (p_run->apply_count > 0) {
+        *p_job = p_run->apply_jobs[p_run->apply_rpos];
+        p_run->apply_rpos = (p_run->apply_rpos + 1) % OTA_MAX_TARGETS;
+        p_run->apply_count--;
+        found = true;
+    }
+    (void)pthread_mutex_unlock(&p_run->lock);
+
+    return found;
+}
+
+// Flashes a verified image into its MCU. The flashing of an MCU cannot be interrupted, but an
+// image still queued when a newer request arrives is left on flash, its record is complete and
+// the next request applies it unless it brings a newer one.
+static void __target_apply(struct ota_job_t* p_job)
+{
+    uint32_t target = p_job->p_target->mcu;
+    struct ota_timing_t* p_timing = &p_job->timing;
+    uint64_t phase_ms = __now_ms();
+
+    p_timing->wait_ms = (uint32_t)(phase_ms - p_job->verified_ms);
+    if (__OtaEventWait(0)) {
+        Log_Debug("INFO: Apply of %s superseded by a new request\n", ExtMCU_GetName(target));
+        OtaSetState(target, otaInterrupted, otaErrNone);
+        OtaSetTiming(p_timing);
+        return;
+    }
+
+    Log_Debug("INFO: Applying version %u to %s, verified %u ms ago\n", p_job->apply_version, ExtMCU_GetName(target), p_timing->wait_ms);
+    if (ExtMCU_Download(target, p_job->path)) {
+        OtaSetVersion(target, p_job->apply_version);
+        OtaSetState(target, otaApplied, otaErrNone);
+    } else {
+        OtaSetState(target, otaError, otaErrMcuDownload);
+    }
+    p_timing->apply_ms = (uint32_t)(__now_ms() - phase_ms);
+    OtaSetTiming(p_timing);
+}
+
+// Network worker, downloads and verifies the targets of a run until none is left, several of these
+// run at the same time for a request with concurrency above 1. A target that failed for a
+// transient reason is retried after a backoff, in place, a newer request ends the wait.
+static void* ota_worker(void* arg)
+{
+    struct ota_run_t* p_run = arg;
+    struct ota_job_t job;
+    // the stack address tells the workers of a run apart
+    unsigned int seed = (unsigned int)__now_ms() ^ (unsigned int)(uintptr_t)&job;
+
+    while (__run_next_job(p_run, &job)) {
+        uint32_t attempt = 0;
+        bool preempted = false;
+
+        while (__target_attempt(&job, attempt, &preempted) && !preempted && (attempt < OTA_RETRY_MAX)) {
+            uint32_t delay_ms = __retry_delay_ms(attempt, &seed);
+            attempt++;
+            Log_Debug("INFO: Retry %u of %u for %s in %u ms\n", attempt, OTA_RETRY_MAX, ExtMCU_GetName(job.p_target->mcu), delay_ms);
+            if (__OtaEventWait(delay_ms)) {
+                break;
+            }
+        }
+        if (job.apply) {
+            __apply_enqueue(p_run, &job);
+        }
+    }
+
+    (void)pthread_mutex_lock(&p_run->lock);
+    p_run->workers_running--;
+    (void)pthread_cond_broadcast(&p_run->applicable);
+    (void)pthread_mutex_unlock(&p_run->lock);
+    return NULL;
+}
+
+// Runs the requests one after another. The network workers of a request are threads of their
+// own, this thread is its apply worker.
+static void* ota_thread(void* arg) 
+{
+    struct ota_run_t run;
+    pthread_t workers[OTA_MAX_TARGETS];
+    uint32_t worker_count;
+    struct ota_job_t job;
+    struct w25q128_bus_stats_t bus_start, bus_end;
+
+#ifdef SHA256_BENCHMARK
+    // before the first request, the benchmark would otherwise stall a download
+    sha256_accel_benchmark();
+#else
+    sha256_accel_selected();
+#endif
+
+    __load_local_records();
+    (void)pthread_mutex_init(&run.lock, NULL);
+    (void)pthread_cond_init(&run.released, NULL);
+    (void)pthread_cond_init(&run.applicable, NULL);
+
+    while (1) {
+
+        __OtaEventDequeue(&run.req);
+        run.next_target = 0;
+        run.apply_count = 0;
+        run.apply_rpos = 0;
+        run.downloads = 0;
+        run.memory = 0;
+        run.p_sas_owned = NULL;
+        run.sas_generation = 0;
+
+        // the status of the request covers its targets from now on, those not started yet count as downloading
+        uint32_t targets = 0;
+        for (uint32_t i = 0; i < run.req.target_count; i++) {
+            targets |= 1u << run.req.targets[i].mcu;
+        }
+        (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+        pOtaContext->ota_state.run_targets = targets;
+        pOtaContext->ota_state.pending_targets = targets;
+        pOtaContext->ota_state.run_version = run.req.has_targets ? run.req.version : 0;
+        (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+        // set before the first worker starts, so a worker that ends at once does not look like the
+        // last one to the apply worker, and no transfer takes more than its share of max_rate
+        run.workers = (run.req.concurrency < run.req.target_count) ? run.req.concurrency : run.req.target_count;
+        run.workers_running = run.workers;
+        w25q128_get_bus_stats(&bus_start);
+        worker_count = 0;
+        while ((worker_count < run.workers) && (pthread_create(&workers[worker_count], NULL, ota_worker, &run) == 0)) {
+            worker_count++;
+        }
+        if (worker_count < run.workers) {
+            Log_Debug("WARNING: Can not create an OTA worker, %u targets run at the same time\n", worker_count);
+            (void)pthread_mutex_lock(&run.lock);
+            run.workers_running -= run.workers - worker_count;
+            // max_rate is shared by the workers that exist, this thread downloads alone without any
+            run.workers = (worker_count > 0) ? worker_count : 1;
+            (void)pthread_mutex_unlock(&run.lock);
+        }
+
+        // without a network worker of its own the targets are downloaded here first, and applied after all
+        if (worker_count == 0) {
+            run.workers_running = 1;
+            (void)ota_worker(&run);
+        }
+        while (__apply_dequeue(&run, &job)) {
+            __target_apply(&job);
+        }
+        for (uint32_t i = 0; i < worker_count; i++) {
+            (void)pthread_join(workers[i], NULL);
+        }
+        w25q128_get_bus_stats(&bus_end);
+        Log_Debug("INFO: Flash bus handed over %u times, downloads waited %u ms, applies %u ms\n",
+                  bus_end.turns - bus_start.turns,
+                  bus_end.wait_ms[W25Q128_STREAM_DOWNLOAD] - bus_start.wait_ms[W25Q128_STREAM_DOWNLOAD],
+                  bus_end.wait_ms[W25Q128_STREAM_APPLY] - bus_start.wait_ms[W25Q128_STREAM_APPLY]);
+
+        // targets skipped for a newer request keep their last status
+        (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+        pOtaContext->ota_state.run_targets &= ~pOtaContext->ota_state.pending_targets;
+        pOtaContext->ota_state.pending_targets = 0;
+        (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+        __OtaEventDone();
+        free(run.req.p_storage);
+        free(run.p_sas_owned);
+    }
+}
+
+// image fields of extFwInfo or of one of its targets, false if one is missing or malformed
+static bool __parse_target(const JSON_Object* p_object, struct ota_target_t* p_target)
+{
+    p_target->version = (uint32_t)json_object_get_number(p_object, "version");
+    p_target->size = (uint32_t)json_object_get_number(p_object, "size");
+    p_target->p_url = json_object_get_string(p_object, "url");
+    const char *p_sha256 = json_object_get_string(p_object, "sha256");
+    p_target->p_manifest = json_object_get_string(p_object, "manifest");
+    p_target->chunk_size = (uint32_t)json_object_get_number(p_object, "chunkSize");
+    const char *p_root = json_object_get_string(p_object, "root");
+    const char *p_signature = json_object_get_string(p_object, "signature");
+    p_target->has_signature = (p_signature != NULL);
+
+    if ((p_target->version == 0) || (p_target->size == 0) || (p_target->p_url == NULL) || (p_sha256 == NULL)) {
+        Log_Debug("ERROR: Incomplete image in extFwInfo\n");
+        return false;
+    }
+    // decoded once here, a malformed hash is rejected before anything is downloaded
+    if (sha256_digest_from_hex(p_sha256, &p_target->sha256) != 0) {
+        Log_Debug("ERROR: Malformed sha256 '%s' in extFwInfo\n", p_sha256);
+        return false;
+    }
+    if ((p_target->p_manifest != NULL) &&
+        ((p_root == NULL) || (sha256_digest_from_hex(p_root, &p_target->root) != 0) ||
+         (p_target->chunk_size < OTA_CHUNK_MIN) || (p_target->chunk_size > OTA_CHUNK_MAX) ||
+         ((p_target->size + p_target->chunk_size - 1) / p_target->chunk_size > OTA_MANIFEST_MAX_CHUNKS))) {
+        Log_Debug("ERROR: Malformed manifest, chunkSize or root in extFwInfo\n");
+        return false;
+    }
+    if (p_target->has_signature && (__hex_to_bytes(p_signature, p_target->signature, sizeof(p_target->signature)) != 0)) {
+        Log_Debug("ERROR: Malformed signature in extFwInfo\n");
+        return false;
+    }
+    return true;
+}
+
+// targets name their MCU in "mcu", each MCU is updated by one target at most
+static bool __parse_targets(const JSON_Array* p_targets, struct ota_request_t* p_req)
+{
+    uint32_t mcus = 0;
+
+    p_req->target_count = 0;
+    for (size_t i = 0; i < json_array_get_count(p_targets); i++) {
+        const JSON_Object *p_object = json_array_get_object(p_targets, i);
+        const char *p_mcu = (p_object != NULL) ? json_object_get_string(p_object, "mcu") : NULL;
+        int mcu = (p_mcu != NULL) ? ExtMCU_Find(p_mcu) : -1;
+
+        if ((mcu < 0) || ((uint32_t)mcu >= __mcu_count()) || ((mcus & (1u << mcu)) != 0)) {
+            Log_Debug("ERROR: Target %u in extFwInfo has no MCU of its own on this board\n", (uint32_t)i);
+            return false;
+        }
+        if (!__parse_target(p_object, &p_req->targets[p_req->target_count])) {
+            return false;
+        }
+        p_req->targets[p_req->target_count++].mcu = (uint32_t)mcu;
+        mcus |= 1u << mcu;
+    }
+    return (p_req->target_count > 0);
+}
+
+void OtaHandler(const JSON_Object* extFwInfoProperties, char* p_storage)
+{
+    struct ota_request_t req;
+
+    if ((pOtaContext != NULL) && pOtaContext->is_inited) {
+
+        req.enqueue_ms = __now_ms();
+        req.version = (uint32_t)json_object_get_number(extFwInfoProperties, "version");
+        req.p_storage = p_storage;
+        req.p_sas = json_object_get_string(extFwInfoProperties, "sas");
+        JSON_Array *p_targets = json_object_get_array(extFwInfoProperties, "targets");
+        req.has_targets = (p_targets != NULL);
+        req.concurrency = (uint32_t)json_object_get_number(extFwInfoProperties, "concurrency");
+        if (req.concurrency == 0) {
+            req.concurrency = 1;
+        } else if (req.concurrency > OTA_MAX_TARGETS) {
+            req.concurrency = OTA_MAX_TARGETS;
+        }
+        req.max_rate = (uint32_t)json_object_get_number(extFwInfoProperties, "maxRate");
+        req.max_backlog = (uint32_t)json_object_get_number(extFwInfoProperties, "maxBacklog");
+        const char *p_window = json_object_get_string(extFwInfoProperties, "window");
+        unsigned int start_h, start_m, end_h, end_m;
+        char end_of_window;
+        req.has_window = (p_window != NULL);
+        if (req.has_window) {
+            bool valid = (sscanf(p_window, "%u:%u-%u:%u%c", &start_h, &start_m, &end_h, &end_m, &end_of_window) == 4) &&
+                         (start_h < 24) && (start_m < 60) && (end_h < 24) && (end_m < 60);
+            req.window_start = valid ? start_h * 60 + start_m : 0;
+            req.window_end = valid ? end_h * 60 + end_m : 0;
+        }
+        JSON_Array *p_mirrors = json_object_get_array(extFwInfoProperties, "mirrors");
+        req.mirror_count = 0;
+        for (size_t i = 0; (p_mirrors != NULL) && (i < json_array_get_count(p_mirrors)) && (req.mirror_count < OTA_MAX_MIRRORS); i++) {
+            // a mirror is its base url, or {"url":..., "sas":true} for one that takes the sas
+            JSON_Value *p_entry = json_array_get_value(p_mirrors, i);
+            JSON_Object *p_entry_object = json_value_get_object(p_entry);
+            const char *p_mirror = (p_entry_object != NULL) ? json_object_get_string(p_entry_object, "url") : json_value_get_string(p_entry);
+            bool forward_sas = (p_entry_object != NULL) && (json_object_get_boolean(p_entry_object, "sas") == 1);
+            if (p_mirror == NULL) {
+                continue;
+            }
+            if (forward_sas && (strncasecmp(p_mirror, "https://", strlen("https://")) != 0)) {
+                Log_Debug("ERROR: Mirror %s takes the SAS but is not https, skipped\n", p_mirror);
+                continue;
+            }
+            req.p_mirrors[req.mirror_count] = p_mirror;
+            req.mirror_sas[req.mirror_count] = forward_sas;
+            req.mirror_count++;
+        }
+
+        if ((req.version > 0) && (req.p_sas != NULL)) {
+            if (req.has_targets && (json_array_get_count(p_targets) > OTA_MAX_TARGETS)) {
+                Log_Debug("ERROR: More than %u targets in extFwInfo\n", OTA_MAX_TARGETS);
+            } else if (req.has_targets && !__parse_targets(p_targets, &req)) {
+                Log_Debug("ERROR: Malformed targets in extFwInfo\n");
+            } else if (!req.has_targets && !__parse_target(extFwInfoProperties, &req.targets[0])) {
+                Log_Debug("ERROR: Malformed image in extFwInfo\n");
+            } else if (req.has_window && (req.window_start == req.window_end)) {
+                Log_Debug("ERROR: Malformed window '%s' in extFwInfo, expected HH:MM-HH:MM\n", p_window);
+            } else {
+                if (!req.has_targets) {
+                    req.targets[0].mcu = 0;
+                    req.target_count = 1;
+                }
+                __OtaEventEnqueue(&req);
+                return;
+            }
+        }
+    }
+
+    free(p_storage);
+}
+
+int OtaInit(void) 
+{
+    int rt = -1;
+
+    if (pOtaContext == NULL) {
+        pOtaContext = malloc(sizeof(struct ota_context_t));
+        if (pOtaContext == NULL) {
+            Log_Debug("ERROR: malloc fail\n");
+            goto errExitLabel_0;
+        }
+    }
+
+    memset(pOtaContext, 0, sizeof(struct ota_context_t));
+
+    pOtaContext->local_record_fd = Storage_OpenMutableFile();
+    if (pOtaContext->local_record_fd < 0) {
+        Log_Debug("ERROR: Could not open mutable file: %s (%d)\n", strerror(errno), errno);
+        goto errExitLabel_1;
+    }
+
+    rt = pthread_cond_init(&pOtaContext->ota_queue.queued, NULL);
+    if (rt != 0) {
+        Log_Debug("ERROR: Could not init ota_queue condition: %d\n", rt);
+        goto errExitLabel_2;
+    }
+
+    rt = pthread_mutex_init(&pOtaContext->ota_queue.lock, NULL);
+    if (rt < 0) {
+        Log_Debug("ERROR: Could not init ota_queue mutex: %s (%d)\n", strerror(errno), errno);
+        goto errExitLabel_3;
+    }
+
+    rt = pthread_mutex_init(&pOtaContext->ota_state.lock, NULL);
+    if (rt < 0) {
+        Log_Debug("ERROR: Could not init ota_state mutex: %s (%d)\n", strerror(errno), errno);
+        goto errExitLabel_4;
+    }
+
+    rt = pthread_mutex_init(&pOtaContext->record_lock, NULL);
+    if (rt != 0) {
+        Log_Debug("ERROR: Could not init record mutex: %d\n", rt);
+        goto errExitLabel_5;
+    }
+
+    // not thread safe, done once before the thread and its workers create their handles
+    CURLcode res = curl_global_init(CURL_GLOBAL_ALL);
+    if (res != CURLE_OK) {
+        LogCurlError("ERROR: curl_global_init fail", res);
+        goto errExitLabel_6;
+    }
+
+    // no-op when the volume was already mounted for the telemetry spool
+    (void)w25q128_mount();
+
+    pOtaContext->ota_queue.count = 0;
+    pOtaContext->ota_queue.wpos = 0;
+    pOtaContext->ota_queue.rpos = 0;
+    for (uint32_t target = 0; target < OTA_MAX_TARGETS; target++) {
+        pOtaContext->ota_state.targets[target].status = otaStatusInvalid;
+        pOtaContext->ota_state.targets[target].error = otaErrNone;
+    }
+    pOtaContext->ota_state.run_targets = 0;
+    pOtaContext->ota_state.pending_targets = 0;
+    pOtaContext->ota_state.timing_count = 0;
+    pOtaContext->ota_state.telemetry_backlog = 0;
+    pOtaContext->ota_state.sas_request = 0;
+    pOtaContext->ota_state.sas_waiters = 0;
+    pOtaContext->ota_state.sas_version = 0;
+    pOtaContext->ota_state.p_sas = NULL;
+    pOtaContext->ota_state.p_sas_seen = NULL;
+
+    // started last, the thread and the network workers it creates use everything set up above
+    rt = pthread_create(&pOtaContext->ota_thread, NULL, ota_thread, NULL);
+    if (rt != 0) {
+        Log_Debug("ERROR: Can not create a thread: %d\n", rt);
+        goto errExitLabel_7;
+    }
+    pOtaContext->is_inited = true;
+
+    return 0;
+
+errExitLabel_7:
+    curl_global_cleanup();
+errExitLabel_6:
+    pthread_mutex_destroy(&pOtaContext->record_lock);
+errExitLabel_5:
+    pthread_mutex_destroy(&pOtaContext->ota_state.lock);
+errExitLabel_4:
+    pthread_mutex_destroy(&pOtaContext->ota_queue.lock);
+errExitLabel_3:
+    pthread_cond_destroy(&pOtaContext->ota_queue.queued);
+errExitLabel_2:
+    close(pOtaContext->local_record_fd);
+errExitLabel_1:
+    free(pOtaContext);
+    pOtaContext = NULL;
+errExitLabel_0:
+    return -1;
+}
+ 
+void OtaDeinit() {
+    ;
+}
+
+static void OtaSetState(uint32_t target, enum ota_status_t status, enum ota_error_t error) 
+{
+    TRACE(traceOtaState, status, error);
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    pOtaContext->ota_state.targets[target].status = status;
+    pOtaContext->ota_state.targets[target].error = error;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
+
+// A target still at work outranks one that finished and an error outranks success, so a request
+// reads applied only once all its targets are. Indexed by enum ota_status_t.
+static const uint32_t cStatusRank[] = {
+    4,  // otaDownloading
+    3,  // otaInterrupted
+    5,  // otaApplying
+    1,  // otaApplied
+    2,  // otaError
+    0,  // otaStatusInvalid
+};
+
+void OtaGetState(enum ota_status_t *p_status, enum ota_error_t *p_error)
+{
+    *p_status = otaStatusInvalid;
+    *p_error = otaErrNone;
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    for (uint32_t target = 0; target < OTA_MAX_TARGETS; target++) {
+        const struct ota_target_state_t* p_state = &pOtaContext->ota_state.targets[target];
+        // a target no worker has started on yet is about to download
+        bool pending = (pOtaContext->ota_state.pending_targets & (1u << target)) != 0;
+        enum ota_status_t status = pending ? otaDownloading : p_state->status;
+
+        if (((pOtaContext->ota_state.run_targets & (1u << target)) != 0) && (cStatusRank[status] > cStatusRank[*p_status])) {
+            *p_status = status;
+            *p_error = pending ? otaErrNone : p_state->error;
+        }
+    }
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
+
+void OtaGetTargetState(uint32_t target, enum ota_status_t *p_status, enum ota_error_t *p_error)
+{
+    *p_status = otaStatusInvalid;
+    *p_error = otaErrNone;
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    *p_status = pOtaContext->ota_state.targets[target].status;
+    *p_error = pOtaContext->ota_state.targets[target].error;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
+
+static void OtaSetVersion(uint32_t target, uint32_t version)
+{
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    pOtaContext->ota_state.targets[target].version = version;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
+
+// the version of the deployment for a request with targets, the one of its image otherwise
+uint32_t OtaGetVersion(void)
+{
+    uint32_t version;
+
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return 0;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    version = pOtaContext->ota_state.run_version;
+    if (version == 0) {
+        version = pOtaContext->ota_state.targets[0].version;
+    }
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+    return version;
+}
+
+uint32_t OtaGetTargetVersion(uint32_t target)
+{
+    uint32_t version;
+
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return 0;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    version = pOtaContext->ota_state.targets[target].version;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+    return version;
+}
+
+uint32_t OtaGetTargetCount(void)
+{
+    return __mcu_count();
+}
+
+const char* OtaGetTargetName(uint32_t target)
+{
+    return ExtMCU_GetName(target);
+}
+
+static void OtaSetTiming(const struct ota_timing_t* p_timing)
+{
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    // the oldest attempt is dropped when telemetry has not taken them for a while
+    if (pOtaContext->ota_state.timing_count == OTA_MAX_TARGETS) {
+        memmove(&pOtaContext->ota_state.timings[0], &pOtaContext->ota_state.timings[1],
+                (OTA_MAX_TARGETS - 1) * sizeof(struct ota_timing_t));
+        pOtaContext->ota_state.timing_count--;
+    }
+    struct ota_timing_t* p_slot = &pOtaContext->ota_state.timings[pOtaContext->ota_state.timing_count++];
+    *p_slot = *p_timing;
+    p_slot->status = pOtaContext->ota_state.targets[p_timing->target].status;
+    p_slot->error = pOtaContext->ota_state.targets[p_timing->target].error;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
+
+/// returns true only once for each finished OTA attempt
+bool OtaGetTiming(struct ota_timing_t* p_timing)
+{
+    bool pending;
+
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return false;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    pending = (pOtaContext->ota_state.timing_count > 0);
+    if (pending) {
+        *p_timing = pOtaContext->ota_state.timings[0];
+        pOtaContext->ota_state.timing_count--;
+        memmove(&pOtaContext->ota_state.timings[0], &pOtaContext->ota_state.timings[1],
+                pOtaContext->ota_state.timing_count * sizeof(struct ota_timing_t));
+    }
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+    return pending;
+}
+
+void OtaSasHandler(const JSON_Object* extFwSasProperties)
+{
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return;
+    }
+
+    uint32_t version = (uint32_t)json_object_get_number(extFwSasProperties, "version");
+    const char *p_sas = json_object_get_string(extFwSasProperties, "sas");
+    if ((version == 0) || (p_sas == NULL)) {
+        Log_Debug("ERROR: Malformed extFwSas\n");
+        return;
+    }
+
+    // the full twin after a reconnect repeats extFwSas, the run may have taken that sas already
+    // and a repeat must not end a wait for a new one. Only this thread writes p_sas_seen.
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    bool seen = (pOtaContext->ota_state.sas_version == version) && (pOtaContext->ota_state.p_sas_seen != NULL) &&
+                (strcmp(pOtaContext->ota_state.p_sas_seen, p_sas) == 0);
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+    if (seen) {
+        return;
+    }
+
+    char *p_copy = strdup(p_sas);
+    char *p_seen = strdup(p_sas);
+    if ((p_copy == NULL) || (p_seen == NULL)) {
+        Log_Debug("ERROR: malloc fail\n");
+        free(p_copy);
+        free(p_seen);
+        return;
+    }
+
+    // taken by the run of the request of this version
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    free(pOtaContext->ota_state.p_sas);
+    free(pOtaContext->ota_state.p_sas_seen);
+    pOtaContext->ota_state.p_sas = p_copy;
+    pOtaContext->ota_state.p_sas_seen = p_seen;
+    pOtaContext->ota_state.sas_version = version;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
+
+uint32_t OtaGetSasRequest(void)
+{
+    uint32_t version;
+
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return 0;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    version = (pOtaContext->ota_state.sas_waiters > 0) ? pOtaContext->ota_state.sas_request : 0;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+    return version;
+}
+
+void OtaSetTelemetryBacklog(uint32_t bytes)
+{
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    pOtaContext->ota_state.telemetry_backlog = bytes;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+}
+
+// sums over the targets of the current request, the request waits only while none transfers
+void OtaGetProgress(struct ota_progress_t* p_progress)
+{
+    bool transferring = false;
+
+    memset(p_progress, 0, sizeof(*p_progress));
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        return;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    for (uint32_t target = 0; target < OTA_MAX_TARGETS; target++) {
+        const struct ota_target_state_t* p_state = &pOtaContext->ota_state.targets[target];
+        if ((pOtaContext->ota_state.run_targets & (1u << target)) == 0) {
+            continue;
+        }
+        p_progress->downloaded += p_state->progress.downloaded;
+        p_progress->total += p_state->progress.total;
+        p_progress->rate_now += p_state->progress.rate_now;
+        p_progress->rate_avg += p_state->progress.rate_avg;
+        p_progress->rate_cap += p_state->progress.rate_cap;
+        if (p_state->progress.eta > p_progress->eta) {
+            p_progress->eta = p_state->progress.eta;
+        }
+        if (p_state->status == otaDownloading) {
+            if (p_state->progress.paused == otaPauseNone) {
+                transferring = true;
+            } else {
+                p_progress->paused = p_state->progress.paused;
+            }
+        }
+    }
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
+
+    if (transferring) {
+        p_progress->paused = otaPauseNone;
+    }
+}
+
+void OtaGetTargetProgress(uint32_t target, struct ota_progress_t* p_progress)
+{
+    if ((pOtaContext == NULL) || !pOtaContext->is_inited) {
+        memset(p_progress, 0, sizeof(*p_progress));
+        return;
+    }
+
+    (void)pthread_mutex_lock(&pOtaContext->ota_state.lock);
+    *p_progress = pOtaContext->ota_state.targets[target].progress;
+    (void)pthread_mutex_unlock(&pOtaContext->ota_state.lock);
 }
\ No newline at end of file
@@ -1,8 +1,13 @@
 ﻿#ifndef OTA_H
 #define OTA_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "../parson.h"
 
+// external MCUs one request can update, each is a target with its own image, record and status
+#define OTA_MAX_TARGETS 4
+
 enum ota_status_t
 {
 	otaDownloading = 0,
@@ -20,12 +25,74 @@ enum ota_error_t
 	otaErrTimeout,
 	otaErrMcuDownload,
 	otaErrIo,
+	otaErrSas,
 	otaErrNone
 };
 
+// why a download is waiting instead of transferring
+enum ota_pause_t
+{
+	otaPauseNone = 0,
+	otaPauseWindow,       // outside the download window of the request
+	otaPauseBacklog,      // telemetry backlog above the limit of the request
+};
+
+struct ota_progress_t
+{
+	uint32_t downloaded;  // bytes in ota.bin, including a resumed part
+	uint32_t total;       // image size from the request
+	uint32_t rate_now;    // bytes/s over the last sample window
+	uint32_t rate_avg;    // bytes/s since current transfer started
+	uint32_t eta;         // seconds to completion, 0 if unknown
+	uint32_t rate_cap;    // bytes/s cap from the request, 0 if none
+	uint32_t paused;      // enum ota_pause_t
+};
+
+// per-phase breakdown of one OTA attempt, durations are in milliseconds
+struct ota_timing_t
+{
+	uint32_t version;     // version requested
+	uint32_t status;      // enum ota_status_t at the end of the attempt
+	uint32_t error;       // enum ota_error_t at the end of the attempt
+	uint32_t queue_ms;    // request queued until picked up by ota thread
+	uint32_t paused_ms;   // waiting for the download window or the telemetry backlog
+	uint32_t connect_ms;  // DNS, TCP and TLS handshake
+	uint32_t transfer_ms; // HTTP transfer after connection is established
+	uint32_t sync_ms;     // flush of ota.bin to flash
+	uint32_t verify_ms;   // SHA256 over the stored image
+	uint32_t wait_ms;     // verified image waiting for the apply worker
+	uint32_t apply_ms;    // download into external MCU
+	uint32_t bytes;       // bytes received from network in this attempt
+	uint32_t image_size;  // bytes hashed during verify
+	uint32_t rate_cap;    // bytes/s cap from the request, 0 if none
+	uint32_t retry;       // automatic retries of the request before this attempt
+	uint32_t target;      // external MCU the attempt was for
+};
+
 int OtaInit(void);
-void OtaHandler(const JSON_Object* extFwInfoProperties);
+// p_storage is the buffer extFwInfoProperties was parsed from in situ, the request takes it over
+// so its strings are never copied, it is freed whether or not the request is accepted.
+// extFwInfo describes one image for the first external MCU, or lists one per MCU in "targets"
+void OtaHandler(const JSON_Object* extFwInfoProperties, char* p_storage);
+// extFwSas carries a new sas for the request of its version, e.g. after a 403 was reported
+// through OtaGetSasRequest, a download waiting for it continues from its current offset
+void OtaSasHandler(const JSON_Object* extFwSasProperties);
+// version of the request waiting for a new sas, 0 if none
+uint32_t OtaGetSasRequest(void);
+// state, progress and version of the current request over all its targets, it is only applied
+// once every target is
 void OtaGetState(enum ota_status_t* p_status, enum ota_error_t* p_error);
 uint32_t OtaGetVersion(void);
+void OtaGetProgress(struct ota_progress_t* p_progress);
+// the same for one external MCU, target is below OtaGetTargetCount()
+uint32_t OtaGetTargetCount(void);
+const char* OtaGetTargetName(uint32_t target);
+void OtaGetTargetState(uint32_t target, enum ota_status_t* p_status, enum ota_error_t* p_error);
+uint32_t OtaGetTargetVersion(uint32_t target);
+void OtaGetTargetProgress(uint32_t target, struct ota_progress_t* p_progress);
+// one finished attempt per call, targets downloaded at the same time can finish between two calls
+bool OtaGetTiming(struct ota_timing_t* p_timing);
+// bytes of telemetry waiting to be delivered, a request with maxBacklog pauses its download above it
+void OtaSetTelemetryBacklog(uint32_t bytes);
 
 #endif
\ No newline at end of file
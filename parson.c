@@ -41,12 +41,25 @@
 #include <ctype.h>
 #include <math.h>
 #include <errno.h>
+#include <stdint.h>
+
+/* Vectorized scanning of whitespace and string terminators, define PARSON_NO_SIMD to build the
+   scalar code only */
+#if !defined(PARSON_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define PARSON_SIMD_SSE2
+#elif !defined(PARSON_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define PARSON_SIMD_NEON
+#endif
 
 /* Apparently sscanf is not implemented in some "standard" libraries, so don't use it, if you
  * don't have to. */
 #define sscanf THINK_TWICE_ABOUT_USING_SSCANF
 
 #define STARTING_CAPACITY 16
+/* objects with at least this many keys get a hashed key index on first lookup */
+#define INDEX_THRESHOLD 16
 #define MAX_NESTING 2048
 
 #define FLOAT_FORMAT "%1.17g" /* do not increase precision without incresing NUM_BUF_SIZE */
@@ -55,20 +68,28 @@
 
 #define SIZEOF_TOKEN(a) (sizeof(a) - 1)
 #define SKIP_CHAR(str) ((*str)++)
-#define SKIP_WHITESPACES(str)                 \
-    while (isspace((unsigned char)(**str))) { \
-        SKIP_CHAR(str);                       \
-    }
+#define SKIP_WHITESPACES(str) (*(str) = skip_whitespaces(*(str)))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #undef malloc
 #undef free
 
-static JSON_Malloc_Function parson_malloc = malloc;
-static JSON_Free_Function parson_free = free;
+static JSON_Malloc_Function parson_malloc_fun = malloc;
+static JSON_Free_Function parson_free_fun = free;
+
+/* arena serving the parse in progress on this thread, NULL for regular allocations */
+static __thread JSON_Arena *parson_arena = NULL;
+/* strings of the parse in progress on this thread are unescaped in place, see json_parse_string_in_situ */
+static __thread int parson_in_situ = 0;
+
+#define ARENA_ALIGNMENT sizeof(double)
 
 #define IS_CONT(b) (((unsigned char)(b)&0xC0) == 0x80) /* is utf-8 continuation byte */
 
+static void *parson_malloc(size_t size);
+static void parson_free(void *ptr);
+static void parson_free_parsed_string(char *string);
+
 /* Type definitions */
 typedef union json_value_value {
     char *string;
@@ -82,6 +103,7 @@ typedef union json_value_value {
 struct json_value_t {
     JSON_Value *parent;
     JSON_Value_Type type;
+    int is_view; /* string points into the buffer of an in situ parse and is not freed */
     JSON_Value_Value value;
 };
 
@@ -91,6 +113,9 @@ struct json_object_t {
     JSON_Value **values;
     size_t count;
     size_t capacity;
+    size_t *index;         /* open addressing table of positions + 1 in names, 0 is empty */
+    size_t index_capacity; /* power of two, at least twice count */
+    int in_arena;          /* index may only be built while parsing into the arena */
 };
 
 struct json_array_t {
@@ -124,6 +149,10 @@ static JSON_Status json_object_remove_internal(JSON_Object *object, const char *
 static JSON_Status json_object_dotremove_internal(JSON_Object *object, const char *name,
                                                   int free_value);
 static void json_object_free(JSON_Object *object);
+static size_t json_object_hash(const char *name, size_t name_len);
+static void json_object_index_insert(JSON_Object *object, size_t position);
+static JSON_Status json_object_index_build(JSON_Object *object);
+static void json_object_index_drop(JSON_Object *object);
 
 /* JSON Array */
 static JSON_Array *json_array_init(JSON_Value *wrapping_value);
@@ -135,6 +164,9 @@ static void json_array_free(JSON_Array *array);
 static JSON_Value *json_value_init_string_no_copy(char *string);
 
 /* Parser */
+static const char *skip_whitespaces(const char *string);
+static const char *find_string_special(const char *string);
+static const char *find_string_escape(const char *string);
 static JSON_Status skip_quotes(const char **string);
 static int parse_utf16(const char **unprocessed, char **processed);
 static char *process_string(const char *input, size_t len);
@@ -151,6 +183,9 @@ static JSON_Value *parse_value(const char **string, size_t nesting);
 static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, int is_pretty,
                                       char *num_buf);
 static int json_serialize_string(const char *string, char *buf);
+static char *json_buffer_reserve(JSON_Buffer *buffer, size_t size);
+static JSON_Status json_buffer_append(JSON_Buffer *buffer, const char *string, size_t len);
+static JSON_Status json_serialize_to_json_buffer_r(const JSON_Value *value, JSON_Buffer *buffer);
 static int append_indent(char *buf, int level);
 static int append_string(char *buf, const char *string);
 
@@ -334,6 +369,9 @@ static JSON_Object *json_object_init(JSON_Value *wrapping_value)
     new_obj->values = (JSON_Value **)NULL;
     new_obj->capacity = 0;
     new_obj->count = 0;
+    new_obj->index = NULL;
+    new_obj->index_capacity = 0;
+    new_obj->in_arena = parson_arena != NULL;
     return new_obj;
 }
 
@@ -369,6 +407,13 @@ static JSON_Status json_object_addn(JSON_Object *object, const char *name, size_
     value->parent = json_object_get_wrapping_value(object);
     object->values[index] = value;
     object->count++;
+    if (object->index != NULL) {
+        if (object->count * 2 > object->index_capacity) {
+            json_object_index_drop(object); /* rebuilt larger on next lookup */
+        } else {
+            json_object_index_insert(object, index);
+        }
+    }
     return JSONSuccess;
 }
 
@@ -402,10 +447,74 @@ static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity)
     return JSONSuccess;
 }
 
+static size_t json_object_hash(const char *name, size_t name_len)
+{
+    /* FNV-1a */
+    size_t hash = (size_t)2166136261u;
+    while (name_len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= (size_t)16777619u;
+    }
+    return hash;
+}
+
+static void json_object_index_insert(JSON_Object *object, size_t position)
+{
+    const char *name = object->names[position];
+    size_t mask = object->index_capacity - 1;
+    size_t slot = json_object_hash(name, strlen(name)) & mask;
+    while (object->index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    object->index[slot] = position + 1;
+}
+
+static JSON_Status json_object_index_build(JSON_Object *object)
+{
+    size_t i, index_capacity = STARTING_CAPACITY;
+    /* index of an arena object has to live in the arena, it is never freed otherwise */
+    if (object->in_arena && parson_arena == NULL) {
+        return JSONFailure;
+    }
+    while (index_capacity < object->count * 4) {
+        index_capacity *= 2;
+    }
+    object->index = (size_t *)parson_malloc(index_capacity * sizeof(size_t));
+    if (object->index == NULL) {
+        return JSONFailure;
+    }
+    memset(object->index, 0, index_capacity * sizeof(size_t));
+    object->index_capacity = index_capacity;
+    for (i = 0; i < object->count; i++) {
+        json_object_index_insert(object, i);
+    }
+    return JSONSuccess;
+}
+
+static void json_object_index_drop(JSON_Object *object)
+{
+    parson_free(object->index);
+    object->index = NULL;
+    object->index_capacity = 0;
+}
+
 static JSON_Value *json_object_getn_value(const JSON_Object *object, const char *name,
                                           size_t name_len)
 {
     size_t i, name_length;
+    if (object != NULL && object->count >= INDEX_THRESHOLD &&
+        (object->index != NULL || json_object_index_build((JSON_Object *)object) == JSONSuccess)) {
+        size_t mask = object->index_capacity - 1;
+        size_t slot = json_object_hash(name, name_len) & mask;
+        while (object->index[slot] != 0) {
+            i = object->index[slot] - 1;
+            if (strncmp(object->names[i], name, name_len) == 0 && object->names[i][name_len] == '\0') {
+                return object->values[i];
+            }
+            slot = (slot + 1) & mask;
+        }
+        return NULL;
+    }
     for (i = 0; i < json_object_get_count(object); i++) {
         name_length = strlen(object->names[i]);
         if (name_length != name_len) {
@@ -437,6 +546,7 @@ static JSON_Status json_object_remove_internal(JSON_Object *object, const char *
                 object->values[i] = object->values[last_item_index];
             }
             object->count -= 1;
+            json_object_index_drop(object); /* positions changed, rebuilt on next lookup */
             return JSONSuccess;
         }
     }
@@ -467,6 +577,7 @@ static void json_object_free(JSON_Object *object)
         parson_free(object->names[i]);
         json_value_free(object->values[i]);
     }
+    json_object_index_drop(object);
     parson_free(object->names);
     parson_free(object->values);
     parson_free(object);
@@ -538,10 +649,162 @@ static JSON_Value *json_value_init_string_no_copy(char *string)
     }
     new_value->parent = NULL;
     new_value->type = JSONString;
+    new_value->is_view = 0;
     new_value->value.string = string;
     return new_value;
 }
 
+/* Scanning */
+#if defined(PARSON_SIMD_SSE2) || defined(PARSON_SIMD_NEON)
+/* Blocks are loaded from 16 byte aligned addresses only. An aligned load never crosses a page
+   boundary, so the bytes it reads before the start or past the terminator of the string are
+   always mapped; they are masked out or stop the scan. They may still lie outside the allocation
+   of the string, so the loaders are not instrumented by AddressSanitizer. */
+#define SIMD_BLOCK 16
+
+#if defined(__has_attribute)
+#if __has_attribute(no_sanitize_address)
+#define SIMD_LOADER __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef SIMD_LOADER
+#define SIMD_LOADER
+#endif
+
+#if defined(PARSON_SIMD_SSE2)
+/* bit i set when byte i of the block is not whitespace (' ', '\t', '\n', '\v', '\f', '\r') */
+SIMD_LOADER static unsigned int block_non_whitespace_mask(const char *block)
+{
+    __m128i bytes = _mm_load_si128((const __m128i *)block);
+    __m128i space = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+    /* '\t'..'\r' are 9..13: subtracting 9 wraps smaller bytes, saturated minus 4 is 0 for 0..4 */
+    __m128i control = _mm_cmpeq_epi8(
+        _mm_subs_epu8(_mm_sub_epi8(bytes, _mm_set1_epi8(9)), _mm_set1_epi8(4)), _mm_setzero_si128());
+    return ~(unsigned int)_mm_movemask_epi8(_mm_or_si128(space, control)) & 0xFFFFu;
+}
+
+/* bit i set when byte i of the block is '"', '\\' or the terminator */
+SIMD_LOADER static unsigned int block_string_special_mask(const char *block)
+{
+    __m128i bytes = _mm_load_si128((const __m128i *)block);
+    __m128i special = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\"')),
+                                   _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+    return (unsigned int)_mm_movemask_epi8(special);
+}
+
+/* bit i set when byte i of the block is '"', '\\' or a control character, the terminator included */
+SIMD_LOADER static unsigned int block_string_escape_mask(const char *block)
+{
+    __m128i bytes = _mm_load_si128((const __m128i *)block);
+    __m128i escape = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\"')),
+                                  _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+    __m128i control = _mm_cmpeq_epi8(_mm_subs_epu8(bytes, _mm_set1_epi8(0x1F)), _mm_setzero_si128());
+    return (unsigned int)_mm_movemask_epi8(_mm_or_si128(escape, control));
+}
+#else
+/* NEON has no movemask, lanes are weighted by their bit and summed pairwise into 16 bits */
+static unsigned int neon_movemask(uint8x16_t lanes)
+{
+    static const uint8_t weights[SIMD_BLOCK] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                                1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bits = vandq_u8(lanes, vld1q_u8(weights));
+    uint8x8_t sums = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+    sums = vpadd_u8(sums, sums);
+    sums = vpadd_u8(sums, sums);
+    return vget_lane_u16(vreinterpret_u16_u8(sums), 0);
+}
+
+SIMD_LOADER static unsigned int block_non_whitespace_mask(const char *block)
+{
+    uint8x16_t bytes = vld1q_u8((const uint8_t *)__builtin_assume_aligned(block, SIMD_BLOCK));
+    uint8x16_t space = vceqq_u8(bytes, vdupq_n_u8(' '));
+    uint8x16_t control = vcleq_u8(vsubq_u8(bytes, vdupq_n_u8(9)), vdupq_n_u8(4));
+    return neon_movemask(vmvnq_u8(vorrq_u8(space, control)));
+}
+
+SIMD_LOADER static unsigned int block_string_special_mask(const char *block)
+{
+    uint8x16_t bytes = vld1q_u8((const uint8_t *)__builtin_assume_aligned(block, SIMD_BLOCK));
+    uint8x16_t special = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('\"')), vceqq_u8(bytes, vdupq_n_u8('\\')));
+    special = vorrq_u8(special, vceqq_u8(bytes, vdupq_n_u8(0)));
+    return neon_movemask(special);
+}
+
+SIMD_LOADER static unsigned int block_string_escape_mask(const char *block)
+{
+    uint8x16_t bytes = vld1q_u8((const uint8_t *)__builtin_assume_aligned(block, SIMD_BLOCK));
+    uint8x16_t escape = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('\"')), vceqq_u8(bytes, vdupq_n_u8('\\')));
+    return neon_movemask(vorrq_u8(escape, vcltq_u8(bytes, vdupq_n_u8(0x20))));
+}
+#endif
+
+/* first byte at or after string whose bit is set in the block masks */
+static const char *simd_find(const char *string, unsigned int (*block_mask)(const char *))
+{
+    uintptr_t offset = (uintptr_t)string & (SIMD_BLOCK - 1);
+    const char *block = string - offset;
+    unsigned int mask = block_mask(block) >> offset;
+    if (mask != 0) {
+        return string + __builtin_ctz(mask);
+    }
+    for (;;) {
+        block += SIMD_BLOCK;
+        mask = block_mask(block);
+        if (mask != 0) {
+            return block + __builtin_ctz(mask);
+        }
+    }
+}
+#endif
+
+static const char *skip_whitespaces(const char *string)
+{
+    /* compact documents have no or single whitespaces, those never reach the vector code */
+    if (!isspace((unsigned char)string[0])) {
+        return string;
+    }
+    if (!isspace((unsigned char)string[1])) {
+        return string + 1;
+    }
+#if defined(PARSON_SIMD_SSE2) || defined(PARSON_SIMD_NEON)
+    return simd_find(string + 2, block_non_whitespace_mask);
+#else
+    string += 2;
+    while (isspace((unsigned char)*string)) {
+        string++;
+    }
+    return string;
+#endif
+}
+
+/* first '"', '\\' or terminator at or after string */
+static const char *find_string_special(const char *string)
+{
+#if defined(PARSON_SIMD_SSE2) || defined(PARSON_SIMD_NEON)
+    return simd_find(string, block_string_special_mask);
+#else
+    while (*string != '\"' && *string != '\\' && *string != '\0') {
+        string++;
+    }
+    return string;
+#endif
+}
+
+/* first '"', '\\' or control character, the terminator included, at or after string;
+   the closing quote bounds the scan of a string's contents */
+static const char *find_string_escape(const char *string)
+{
+#if defined(PARSON_SIMD_SSE2) || defined(PARSON_SIMD_NEON)
+    return simd_find(string, block_string_escape_mask);
+#else
+    while (*string != '\"' && *string != '\\' && (unsigned char)*string >= 0x20) {
+        string++;
+    }
+    return string;
+#endif
+}
+
 /* Parser */
 static JSON_Status skip_quotes(const char **string)
 {
@@ -549,14 +812,17 @@ static JSON_Status skip_quotes(const char **string)
         return JSONFailure;
     }
     SKIP_CHAR(string);
-    while (**string != '\"') {
+    for (;;) {
+        *string = find_string_special(*string);
+        if (**string == '\"') {
+            break;
+        } else if (**string == '\0') {
+            return JSONFailure;
+        }
+        /* escape sequence, the escaped character cannot end the string */
+        SKIP_CHAR(string);
         if (**string == '\0') {
             return JSONFailure;
-        } else if (**string == '\\') {
-            SKIP_CHAR(string);
-            if (**string == '\0') {
-                return JSONFailure;
-            }
         }
         SKIP_CHAR(string);
     }
@@ -621,12 +887,31 @@ static char *process_string(const char *input, size_t len)
     size_t initial_size = (len + 1) * sizeof(char);
     size_t final_size = 0;
     char *output = NULL, *output_ptr = NULL, *resized_output = NULL;
+    if (parson_in_situ) {
+        /* unescaped text is never longer than its source, the terminator replaces the closing quote */
+        output = (char *)input;
+        output_ptr = output;
+        goto process;
+    }
     output = (char *)parson_malloc(initial_size);
     if (output == NULL) {
         goto error;
     }
     output_ptr = output;
+process:
     while ((*input_ptr != '\0') && (size_t)(input_ptr - input) < len) {
+        /* copy a run of plain characters at once */
+        size_t run = (size_t)(find_string_escape(input_ptr) - input_ptr);
+        if (run > 0) {
+            size_t left = len - (size_t)(input_ptr - input);
+            run = run < left ? run : left;
+            if (output_ptr != input_ptr) {
+                memmove(output_ptr, input_ptr, run);
+            }
+            output_ptr += run;
+            input_ptr += run;
+            continue;
+        }
         if (*input_ptr == '\\') {
             input_ptr++;
             switch (*input_ptr) {
@@ -672,6 +957,9 @@ static char *process_string(const char *input, size_t len)
         input_ptr++;
     }
     *output_ptr = '\0';
+    if (parson_in_situ) {
+        return output;
+    }
     /* resize to new length */
     final_size = (size_t)(output_ptr - output) + 1;
     /* todo: don't resize if final_size == initial_size */
@@ -683,7 +971,7 @@ static char *process_string(const char *input, size_t len)
     parson_free(output);
     return resized_output;
 error:
-    parson_free(output);
+    parson_free_parsed_string(output);
     return NULL;
 }
 
@@ -764,24 +1052,24 @@ static JSON_Value *parse_object_value(const char **string, size_t nesting)
         }
         SKIP_WHITESPACES(string);
         if (**string != ':') {
-            parson_free(new_key);
+            parson_free_parsed_string(new_key);
             json_value_free(output_value);
             return NULL;
         }
         SKIP_CHAR(string);
         new_value = parse_value(string, nesting);
         if (new_value == NULL) {
-            parson_free(new_key);
+            parson_free_parsed_string(new_key);
             json_value_free(output_value);
             return NULL;
         }
         if (json_object_add(output_object, new_key, new_value) == JSONFailure) {
-            parson_free(new_key);
+            parson_free_parsed_string(new_key);
             json_value_free(new_value);
             json_value_free(output_value);
             return NULL;
         }
-        parson_free(new_key);
+        parson_free_parsed_string(new_key);
         SKIP_WHITESPACES(string);
         if (**string != ',') {
             break;
@@ -855,9 +1143,10 @@ static JSON_Value *parse_string_value(const char **string)
     }
     value = json_value_init_string_no_copy(new_string);
     if (value == NULL) {
-        parson_free(new_string);
+        parson_free_parsed_string(new_string);
         return NULL;
     }
+    value->is_view = parson_in_situ;
     return value;
 }
 
@@ -1225,6 +1514,63 @@ JSON_Value *json_parse_string(const char *string)
     return parse_value((const char **)&string, 0);
 }
 
+void json_arena_init(JSON_Arena *arena, void *block, size_t size)
+{
+    arena->block = (char *)block;
+    arena->size = size;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->exhausted = 0;
+}
+
+void *json_arena_alloc(JSON_Arena *arena, size_t size)
+{
+    size_t offset = (arena->used + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (offset > arena->size || size > arena->size - offset) {
+        arena->exhausted = 1;
+        return NULL;
+    }
+    arena->used = offset + size;
+    arena->peak = MAX(arena->peak, arena->used);
+    return arena->block + offset;
+}
+
+JSON_Value *json_parse_string_with_arena(const char *string, JSON_Arena *arena)
+{
+    JSON_Value *result = NULL;
+    JSON_Arena *previous_arena = parson_arena;
+    parson_arena = arena;
+    result = json_parse_string(string);
+    parson_arena = previous_arena;
+    return result;
+}
+
+JSON_Value *json_parse_string_in_situ(char *string)
+{
+    JSON_Value *result = NULL;
+    int previous_in_situ = parson_in_situ;
+    parson_in_situ = 1;
+    result = json_parse_string(string);
+    parson_in_situ = previous_in_situ;
+    return result;
+}
+
+JSON_Value *json_parse_string_in_situ_with_arena(char *string, JSON_Arena *arena)
+{
+    JSON_Value *result = NULL;
+    JSON_Arena *previous_arena = parson_arena;
+    parson_arena = arena;
+    result = json_parse_string_in_situ(string);
+    parson_arena = previous_arena;
+    return result;
+}
+
+void json_arena_release(JSON_Arena *arena)
+{
+    arena->used = 0;
+    arena->exhausted = 0;
+}
+
 JSON_Value *json_parse_string_with_comments(const char *string)
 {
     JSON_Value *result = NULL;
@@ -1448,7 +1794,9 @@ void json_value_free(JSON_Value *value)
         json_object_free(value->value.object);
         break;
     case JSONString:
-        parson_free(value->value.string);
+        if (!value->is_view) {
+            parson_free(value->value.string);
+        }
         break;
     case JSONArray:
         json_array_free(value->value.array);
@@ -1467,6 +1815,7 @@ JSON_Value *json_value_init_object(void)
     }
     new_value->parent = NULL;
     new_value->type = JSONObject;
+    new_value->is_view = 0;
     new_value->value.object = json_object_init(new_value);
     if (!new_value->value.object) {
         parson_free(new_value);
@@ -1483,6 +1832,7 @@ JSON_Value *json_value_init_array(void)
     }
     new_value->parent = NULL;
     new_value->type = JSONArray;
+    new_value->is_view = 0;
     new_value->value.array = json_array_init(new_value);
     if (!new_value->value.array) {
         parson_free(new_value);
@@ -1526,6 +1876,7 @@ JSON_Value *json_value_init_number(double number)
     }
     new_value->parent = NULL;
     new_value->type = JSONNumber;
+    new_value->is_view = 0;
     new_value->value.number = number;
     return new_value;
 }
@@ -1538,6 +1889,7 @@ JSON_Value *json_value_init_boolean(int boolean)
     }
     new_value->parent = NULL;
     new_value->type = JSONBoolean;
+    new_value->is_view = 0;
     new_value->value.boolean = boolean ? 1 : 0;
     return new_value;
 }
@@ -1550,6 +1902,7 @@ JSON_Value *json_value_init_null(void)
     }
     new_value->parent = NULL;
     new_value->type = JSONNull;
+    new_value->is_view = 0;
     return new_value;
 }
 
@@ -1675,6 +2028,158 @@ char *json_serialize_to_string(const JSON_Value *value)
     return buf;
 }
 
+void json_buffer_init(JSON_Buffer *buffer)
+{
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+void json_buffer_free(JSON_Buffer *buffer)
+{
+    parson_free(buffer->data);
+    json_buffer_init(buffer);
+}
+
+/* returns room for size more bytes and a terminator at the end of the buffer */
+static char *json_buffer_reserve(JSON_Buffer *buffer, size_t size)
+{
+    size_t new_capacity = MAX(buffer->capacity, 64);
+    char *new_data = NULL;
+    if (buffer->length + size + 1 <= buffer->capacity) {
+        return buffer->data + buffer->length;
+    }
+    while (new_capacity < buffer->length + size + 1) {
+        new_capacity *= 2;
+    }
+    new_data = (char *)parson_malloc(new_capacity);
+    if (new_data == NULL) {
+        return NULL;
+    }
+    if (buffer->data != NULL) {
+        memcpy(new_data, buffer->data, buffer->length);
+    }
+    parson_free(buffer->data);
+    buffer->data = new_data;
+    buffer->capacity = new_capacity;
+    return buffer->data + buffer->length;
+}
+
+static JSON_Status json_buffer_append(JSON_Buffer *buffer, const char *string, size_t len)
+{
+    char *dst = json_buffer_reserve(buffer, len);
+    if (dst == NULL) {
+        return JSONFailure;
+    }
+    memcpy(dst, string, len);
+    buffer->length += len;
+    return JSONSuccess;
+}
+
+#define BUFFER_APPEND(buffer, str)                                         \
+    do {                                                                   \
+        if (json_buffer_append(buffer, str, SIZEOF_TOKEN(str)) == JSONFailure) { \
+            return JSONFailure;                                            \
+        }                                                                  \
+    } while (0)
+
+static JSON_Status json_serialize_to_json_buffer_r(const JSON_Value *value, JSON_Buffer *buffer)
+{
+    const JSON_Array *array = NULL;
+    const JSON_Object *object = NULL;
+    const char *string = NULL;
+    char *dst = NULL;
+    size_t i = 0;
+    int written = -1;
+
+    switch (json_value_get_type(value)) {
+    case JSONArray:
+        array = json_value_get_array(value);
+        BUFFER_APPEND(buffer, "[");
+        for (i = 0; i < array->count; i++) {
+            if (i > 0) {
+                BUFFER_APPEND(buffer, ",");
+            }
+            if (json_serialize_to_json_buffer_r(array->items[i], buffer) == JSONFailure) {
+                return JSONFailure;
+            }
+        }
+        BUFFER_APPEND(buffer, "]");
+        return JSONSuccess;
+    case JSONObject:
+        object = json_value_get_object(value);
+        BUFFER_APPEND(buffer, "{");
+        for (i = 0; i < object->count; i++) {
+            if (i > 0) {
+                BUFFER_APPEND(buffer, ",");
+            }
+            /* escaping expands a character to 6 at most */
+            dst = json_buffer_reserve(buffer, strlen(object->names[i]) * 6 + 3);
+            if (dst == NULL) {
+                return JSONFailure;
+            }
+            buffer->length += (size_t)json_serialize_string(object->names[i], dst);
+            BUFFER_APPEND(buffer, ":");
+            /* values in position, no lookup by name */
+            if (json_serialize_to_json_buffer_r(object->values[i], buffer) == JSONFailure) {
+                return JSONFailure;
+            }
+        }
+        BUFFER_APPEND(buffer, "}");
+        return JSONSuccess;
+    case JSONString:
+        string = json_value_get_string(value);
+        if (string == NULL) {
+            return JSONFailure;
+        }
+        dst = json_buffer_reserve(buffer, strlen(string) * 6 + 3);
+        if (dst == NULL) {
+            return JSONFailure;
+        }
+        buffer->length += (size_t)json_serialize_string(string, dst);
+        return JSONSuccess;
+    case JSONBoolean:
+        if (json_value_get_boolean(value)) {
+            BUFFER_APPEND(buffer, "true");
+        } else {
+            BUFFER_APPEND(buffer, "false");
+        }
+        return JSONSuccess;
+    case JSONNumber:
+        dst = json_buffer_reserve(buffer, NUM_BUF_SIZE);
+        if (dst == NULL) {
+            return JSONFailure;
+        }
+        written = sprintf(dst, FLOAT_FORMAT, json_value_get_number(value));
+        if (written < 0) {
+            return JSONFailure;
+        }
+        buffer->length += (size_t)written;
+        return JSONSuccess;
+    case JSONNull:
+        BUFFER_APPEND(buffer, "null");
+        return JSONSuccess;
+    default:
+        return JSONFailure;
+    }
+}
+
+#undef BUFFER_APPEND
+
+JSON_Status json_serialize_to_json_buffer(const JSON_Value *value, JSON_Buffer *buffer)
+{
+    if (value == NULL || buffer == NULL) {
+        return JSONFailure;
+    }
+    buffer->length = 0;
+    if (json_serialize_to_json_buffer_r(value, buffer) == JSONFailure ||
+        json_buffer_reserve(buffer, 0) == NULL) {
+        return JSONFailure;
+    }
+    buffer->data[buffer->length] = '\0';
+    return JSONSuccess;
+}
+
 size_t json_serialization_size_pretty(const JSON_Value *value)
 {
     char num_buf[NUM_BUF_SIZE]; /* recursively allocating buffer on stack is a bad idea, so let's do
@@ -2032,6 +2537,7 @@ JSON_Status json_object_clear(JSON_Object *object)
         json_value_free(object->values[i]);
     }
     object->count = 0;
+    json_object_index_drop(object);
     return JSONSuccess;
 }
 
@@ -2197,6 +2703,31 @@ int json_boolean(const JSON_Value *value)
 
 void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Function free_fun)
 {
-    parson_malloc = malloc_fun;
-    parson_free = free_fun;
+    parson_malloc_fun = malloc_fun;
+    parson_free_fun = free_fun;
+}
+
+static void *parson_malloc(size_t size)
+{
+    if (parson_arena != NULL) {
+        return json_arena_alloc(parson_arena, size);
+    }
+    return parson_malloc_fun(size);
+}
+
+static void parson_free_parsed_string(char *string)
+{
+    /* in situ strings belong to the source buffer */
+    if (!parson_in_situ) {
+        parson_free(string);
+    }
+}
+
+static void parson_free(void *ptr)
+{
+    /* memory of an arena is only released with the whole arena */
+    if (parson_arena != NULL) {
+        return;
+    }
+    parson_free_fun(ptr);
 }
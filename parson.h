@@ -70,11 +70,56 @@ JSON_Value *json_parse_string(const char *string);
     returns NULL in case of error */
 JSON_Value *json_parse_string_with_comments(const char *string);
 
+/* Arena mode: a parse is served from one caller provided block instead of individual
+   allocations, and everything it allocated is released at once. */
+typedef struct json_arena_t {
+    char *block;
+    size_t size;
+    size_t used;
+    size_t peak; /* high water mark since json_arena_init */
+    int exhausted; /* an allocation did not fit since json_arena_init or json_arena_release, tells
+                      a parse that ran out of space from malformed text */
+} JSON_Arena;
+
+void json_arena_init(JSON_Arena *arena, void *block, size_t size);
+
+/* Allocates from the arena, e.g. a null terminated copy of the text to parse, returns NULL
+   when the block is exhausted */
+void *json_arena_alloc(JSON_Arena *arena, size_t size);
+
+/* Parses like json_parse_string, returns NULL in case of error or when the block is exhausted.
+   The value is read only: it must not be modified nor passed to json_value_free, it is valid
+   until json_arena_release. */
+JSON_Value *json_parse_string_with_arena(const char *string, JSON_Arena *arena);
+
+/* Releases everything allocated from the arena in O(1) */
+void json_arena_release(JSON_Arena *arena);
+
+/* In situ mode: strings are unescaped in place inside the given buffer and values point into
+   it instead of owning a copy. The buffer is modified, it must outlive the value and whoever
+   owns the buffer owns the strings, e.g. it can be handed over as a whole once parsed. */
+JSON_Value *json_parse_string_in_situ(char *string);
+
+/* In situ parse with nodes served from the arena, as json_parse_string_with_arena */
+JSON_Value *json_parse_string_in_situ_with_arena(char *string, JSON_Arena *arena);
+
 /* Serialization */
 size_t json_serialization_size(const JSON_Value *value); /* returns 0 on fail */
 JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes);
 char *json_serialize_to_string(const JSON_Value *value);
 
+/* Serialization into a caller owned buffer which grows as needed and is meant to be reused
+   across calls, the value is walked once. A zero initialized JSON_Buffer is empty. */
+typedef struct json_buffer_t {
+    char *data; /* null terminated after a successful serialization */
+    size_t length;
+    size_t capacity;
+} JSON_Buffer;
+
+void json_buffer_init(JSON_Buffer *buffer);
+JSON_Status json_serialize_to_json_buffer(const JSON_Value *value, JSON_Buffer *buffer); /* replaces contents */
+void json_buffer_free(JSON_Buffer *buffer);
+
 /* Pretty serialization */
 size_t json_serialization_size_pretty(const JSON_Value *value); /* returns 0 on fail */
 JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf,
@@ -4,6 +4,7 @@ import re
 import argparse
 import json
 import hashlib
+import struct
 from datetime import datetime, timedelta
 from azure.iot.hub import IoTHubRegistryManager
 from azure.iot.hub import IoTHubConfigurationManager
@@ -23,11 +24,53 @@ def upload_file(file, container):
     with open(file, "rb") as data:
         blob_client.upload_blob(data, overwrite=True)
 
-def deploy(file, version, product, group, container, days):
+def chunk_hashes(file, chunk_size):
 
-    file_size = os.stat(file).st_size
-    file_url  = f"https://{stroage_account_name}.blob.core.windows.net/{container}/{os.path.basename(file)}"
-    file_sas  = generate_container_sas(
+    hashes = []
+    with open(file, "rb") as f:
+        while True:
+            data = f.read(chunk_size)
+            if not data:
+                break
+            hashes.append(hashlib.sha256(data).digest())
+    return hashes
+
+def merkle_root(hashes):
+
+    # pairs of nodes are hashed level by level, an odd node is carried up unchanged, same tree as ota.c
+    level = list(hashes)
+    while len(level) > 1:
+        level = [hashlib.sha256(level[i] + level[i + 1]).digest() if i + 1 < len(level) else level[i]
+                 for i in range(0, len(level), 2)]
+    return level[0]
+
+def write_manifest(file, chunk_size):
+
+    # the manifest is the raw 32 byte sha256 of every chunk in order, the twin only carries its root
+    hashes = chunk_hashes(file, chunk_size)
+    manifest = file + ".manifest"
+    with open(manifest, "wb") as f:
+        f.write(b"".join(hashes))
+    return manifest, merkle_root(hashes).hex().upper()
+
+def sign_request(image, key_file, mcu=None):
+
+    # same layout as __target_statement in ota.c, chunk size and root are 0 without a manifest,
+    # an image of a targets request also signs the name of its MCU
+    from cryptography.hazmat.primitives.serialization import load_pem_private_key
+
+    with open(key_file, "rb") as f:
+        key = load_pem_private_key(f.read(), password=None)
+    statement = struct.pack(">16sII32sI32s", b"AZSPHERE-OTA-V1" if mcu is None else b"AZSPHERE-OTA-V2",
+                            image["version"], image["size"], bytes.fromhex(image["sha256"]),
+                            image.get("chunkSize", 0), bytes.fromhex(image.get("root", "00" * 32)))
+    if mcu is not None:
+        statement += struct.pack("16s", mcu.encode())
+    return key.sign(statement).hex().upper()
+
+def container_sas(container, days):
+
+    return generate_container_sas(
         account_name=stroage_account_name,
         container_name=container,
         account_key=account_access_key,
@@ -35,9 +78,60 @@ def deploy(file, version, product, group, container, days):
         expiry=datetime.utcnow() + timedelta(days=days)
     )
 
+def image_info(file, version, container, chunk_size):
+
     with open(file, "rb") as f:
         file_sha256 = hashlib.sha256(f.read()).hexdigest().upper()
 
+    image = {
+        "version" : version,
+        "size" : os.stat(file).st_size,
+        "url" : f"https://{stroage_account_name}.blob.core.windows.net/{container}/{os.path.basename(file)}",
+        "sha256" : file_sha256
+    }
+
+    # lets a device check every chunk as it lands and fetch only the bad ones again
+    if chunk_size > 0:
+        manifest, root = write_manifest(file, chunk_size)
+        upload_file(manifest, container)
+        image["manifest"] = f"https://{stroage_account_name}.blob.core.windows.net/{container}/{os.path.basename(manifest)}"
+        image["chunkSize"] = chunk_size
+        image["root"] = root
+    return image
+
+def deploy(targets, version, product, group, container, days, chunk_size, key_file, mirrors, rate, window, backlog, concurrency):
+
+    # a single image for the default MCU keeps the flat form older devices understand
+    if len(targets) == 1 and targets[0][0] == "mcu":
+        ext_fw_info = image_info(targets[0][1], version, container, chunk_size)
+        if key_file:
+            ext_fw_info["signature"] = sign_request(ext_fw_info, key_file)
+    else:
+        ext_fw_info = {"version" : version, "targets" : []}
+        for mcu, file, target_version in targets:
+            image = image_info(file, target_version, container, chunk_size)
+            image["mcu"] = mcu
+            if key_file:
+                image["signature"] = sign_request(image, key_file, mcu)
+            ext_fw_info["targets"].append(image)
+        if concurrency > 1:
+            ext_fw_info["concurrency"] = concurrency
+
+    ext_fw_info["sas"] = container_sas(container, days)
+
+    # caching servers on the device LAN tried before blob storage, what they serve is checked against the hashes above.
+    # Only those given with -M are sent the sas, the others fetch blobs with their own
+    if mirrors:
+        ext_fw_info["mirrors"] = mirrors
+
+    # download policy, keeps the update from starving application traffic on metered links
+    if rate > 0:
+        ext_fw_info["maxRate"] = rate
+    if window:
+        ext_fw_info["window"] = window
+    if backlog > 0:
+        ext_fw_info["maxBacklog"] = backlog
+
     iothub_conn_str = os.environ["AZURE_IOTHUB_CONNECTIONSTRING"]
     iothub_configuration = IoTHubConfigurationManager(iothub_conn_str)
 
@@ -45,13 +139,7 @@ def deploy(file, version, product, group, container, days):
 
     config.id = "ota_v" + str(version)
     config.content = models.ConfigurationContent(device_content={
-        "properties.desired.extFwInfo":{
-            "version" : version,
-            "size" : file_size,
-            "url" : file_url,
-            "sas" : file_sas,
-            "sha256" : file_sha256
-        }
+        "properties.desired.extFwInfo": ext_fw_info
     })
 
     config.metrics = models.ConfigurationMetrics(queries={
@@ -78,15 +166,49 @@ if __name__ == "__main__":
     parser.add_argument("GROUP", type=str, help="Target group under a product")
     parser.add_argument("-c", "--container", type=str, default="ota", help="specify the container of blob")
     parser.add_argument("-d", "--days", type=int, default=365, help="sas expire duration")
+    parser.add_argument("-k", "--chunk", type=int, default=65536, help="chunk size of the hash manifest, 4096 to 1048576, 0 for none")
+    parser.add_argument("-s", "--sign", type=str, help="ed25519 private key in PEM format to sign the request with")
+    parser.add_argument("-m", "--mirror", type=str, action="append", help="base url of an ota_cache.py mirror tried before blob storage, up to 4")
+    parser.add_argument("-M", "--sas-mirror", type=lambda url: {"url": url, "sas": True}, action="append", dest="mirror", help="like -m for an https mirror that is sent the SAS of the request")
+    parser.add_argument("-r", "--rate", type=int, default=0, help="download rate cap in bytes/s, 0 for none")
+    parser.add_argument("-w", "--window", type=str, help="daily download window in UTC as HH:MM-HH:MM, may wrap midnight")
+    parser.add_argument("-b", "--backlog", type=int, default=0, help="pause downloads while more bytes of telemetry wait to be sent, 0 for no limit")
+    parser.add_argument("-u", "--mcu", type=str, default="mcu", help="external MCU the FILE is for")
+    parser.add_argument("-t", "--target", type=str, nargs=3, action="append", metavar=("MCU", "FILE", "VERSION"), help="image of another external MCU in the same request")
+    parser.add_argument("-n", "--concurrency", type=int, default=1, help="targets downloaded at the same time, 1 to 4")
     args = parser.parse_args()
 
-    if args.VERSION <= 0:
-        raise ValueError("version should > 0")
+    # the first target is the positional FILE, the request carries the VERSION of the deployment
+    targets = [(args.mcu, args.FILE, args.VERSION)] + [(mcu, file, int(version)) for mcu, file, version in (args.target or [])]
 
-    # Step1: upload the file to azure blob
-    upload_file(args.FILE, args.container)
+    if any(version <= 0 for _, _, version in targets):
+        raise ValueError("version should > 0")
+    if len(targets) > 4:
+        raise ValueError("at most 4 targets")
+    if len(set(mcu for mcu, _, _ in targets)) != len(targets):
+        raise ValueError("each MCU can only be targeted once")
+    if any(not mcu or len(mcu) > 15 for mcu, _, _ in targets):
+        raise ValueError("MCU names should have 1 to 15 characters")
+    if not 1 <= args.concurrency <= 4:
+        raise ValueError("concurrency should be between 1 and 4")
+    if args.chunk != 0 and not 4096 <= args.chunk <= 1048576:
+        raise ValueError("chunk should be 0 or between 4096 and 1048576")
+    if args.window and not re.fullmatch(r"([01]\d|2[0-3]):[0-5]\d-([01]\d|2[0-3]):[0-5]\d", args.window):
+        raise ValueError("window should be HH:MM-HH:MM")
+    if args.window and args.window[:5] == args.window[6:]:
+        raise ValueError("window should not be empty")
+    if args.mirror and len(args.mirror) > 4:
+        raise ValueError("at most 4 mirrors")
+    if any(isinstance(mirror, dict) and not mirror["url"].lower().startswith("https://") for mirror in (args.mirror or [])):
+        raise ValueError("a mirror sent the SAS must use https")
+    if args.chunk != 0 and any(-(-os.stat(file).st_size // args.chunk) > 1024 for _, file, _ in targets):
+        raise ValueError("chunk too small, a manifest holds at most 1024 chunks")
+
+    # Step1: upload the files to azure blob
+    for _, file, _ in targets:
+        upload_file(file, args.container)
     # Step2: create a IoT device configuration
-    deploy(args.FILE, args.VERSION, args.PRODUCT, args.GROUP, args.container, args.days)
+    deploy(targets, args.VERSION, args.PRODUCT, args.GROUP, args.container, args.days, args.chunk, args.sign, args.mirror, args.rate, args.window, args.backlog, args.concurrency)
 
 
 
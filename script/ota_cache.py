@@ -0,0 +1,136 @@
+import os
+import re
+import time
+import shutil
+import hashlib
+import argparse
+import threading
+import urllib.request
+import urllib.error
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+# bytes copied per read from blob storage and per write to a device
+BLOCK_SIZE = 64 * 1024
+
+class BlobCache:
+
+    def __init__(self, upstream, directory, ttl, sas):
+
+        self.upstream = upstream if "://" in upstream else "https://" + upstream
+        self.directory = directory
+        self.ttl = ttl
+        # credentials of the mirror itself, used for devices that do not send their sas
+        self.sas = sas
+        self.lock = threading.Lock()
+        # per blob lock, so that one fetch fills the cache while the other devices wait for it
+        self.blob_locks = {}
+        # path -> (file, etag, {sas: time blob storage last accepted it for the path})
+        self.entries = {}
+        os.makedirs(directory, exist_ok=True)
+
+    def __blob_lock(self, path):
+
+        with self.lock:
+            return self.blob_locks.setdefault(path, threading.Lock())
+
+    def get(self, path, sas, headers):
+
+        # A cached blob is only served for a sas blob storage accepted for its path within the ttl,
+        # any other sas is checked with a conditional request first. The sas is only passed on to
+        # blob storage.
+        url = f"{self.upstream}{path}?{sas}"
+        with self.__blob_lock(path):
+            entry = self.entries.get(path)
+            cached = entry and os.path.exists(entry[0])
+            if cached and time.monotonic() - entry[2].get(sas, -self.ttl) < self.ttl:
+                return entry[0]
+
+            request = urllib.request.Request(url, headers=headers)
+            if cached:
+                # an image uploaded again under the same name replaces the cached copy
+                request.add_header("If-None-Match", entry[1])
+            try:
+                with urllib.request.urlopen(request) as response:
+                    file = os.path.join(self.directory, hashlib.sha256(path.encode()).hexdigest())
+                    with open(file + ".part", "wb") as f:
+                        shutil.copyfileobj(response, f, BLOCK_SIZE)
+                    os.replace(file + ".part", file)
+                    accepted = entry[2] if entry else {}
+                    accepted[sas] = time.monotonic()
+                    self.entries[path] = (file, response.headers.get("ETag", ""), accepted)
+                    print(f"fetched {path}, {os.path.getsize(file)} bytes")
+            except urllib.error.HTTPError as e:
+                if e.code != 304 or not cached:
+                    raise
+                entry[2][sas] = time.monotonic()
+            return self.entries[path][0]
+
+class CacheHandler(BaseHTTPRequestHandler):
+
+    cache = None
+
+    def do_GET(self):
+
+        path, _, query = self.path.partition("?")
+        # devices only send their sas to a mirror they are told to, the others get the one of the mirror
+        sas = query or self.cache.sas
+        if not sas:
+            self.send_error(403, "no SAS, start the mirror with -s or have the devices send theirs")
+            return
+        # only the version header is passed on, blob storage needs it for range support
+        headers = {k: v for k, v in self.headers.items() if k.lower() == "x-ms-version"}
+        try:
+            file = self.cache.get(path, sas, headers)
+        except urllib.error.HTTPError as e:
+            self.send_error(e.code)
+            return
+        except (urllib.error.URLError, OSError) as e:
+            self.send_error(502, str(e))
+            return
+
+        size = os.path.getsize(file)
+        start, end = 0, size - 1
+        match = re.fullmatch(r"bytes=(\d*)-(\d*)", self.headers.get("Range", ""))
+        if match and (match.group(1) or match.group(2)):
+            if match.group(1):
+                start = int(match.group(1))
+                end = min(int(match.group(2)), size - 1) if match.group(2) else size - 1
+            else:
+                start = max(size - int(match.group(2)), 0)
+            if start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", f"bytes */{size}")
+                self.end_headers()
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", f"bytes {start}-{end}/{size}")
+        else:
+            self.send_response(200)
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "bytes")
+        self.end_headers()
+
+        with open(file, "rb") as f:
+            f.seek(start)
+            left = end - start + 1
+            while left > 0:
+                data = f.read(min(left, BLOCK_SIZE))
+                if not data:
+                    break
+                self.wfile.write(data)
+                left -= len(data)
+
+if __name__ == "__main__":
+
+    parser = argparse.ArgumentParser(description="Caching mirror for OTA images, fetches every blob once and serves range requests from disk")
+    parser.add_argument("UPSTREAM", type=str, help="blob storage host, e.g. yourstroageaccount.blob.core.windows.net, https unless a scheme is given")
+    parser.add_argument("-p", "--port", type=int, default=8080, help="port to listen on")
+    parser.add_argument("-d", "--dir", type=str, default="ota_cache", help="directory of the cached images")
+    parser.add_argument("-t", "--ttl", type=int, default=60, help="seconds before a cached blob is checked against blob storage again")
+    parser.add_argument("-s", "--sas", type=str, help="read only SAS of the container to fetch blobs with for devices that do not send theirs")
+    args = parser.parse_args()
+
+    CacheHandler.cache = BlobCache(args.UPSTREAM, args.dir, args.ttl, args.sas)
+    server = ThreadingHTTPServer(("", args.port), CacheHandler)
+    print(f"serving {args.UPSTREAM} on port {args.port}")
+    server.serve_forever()
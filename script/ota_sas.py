@@ -0,0 +1,55 @@
+import os
+import time
+import argparse
+from azure.iot.hub import IoTHubRegistryManager
+from azure.iot.hub import models
+from ota import container_sas
+
+def pending_requests(registry_manager, version):
+
+    # devices report the version of the download that got a 403 and wait for extFwSas
+    query = "SELECT * FROM devices WHERE properties.reported.extFwInfo.SasRequest > 0"
+    if version:
+        query = f"SELECT * FROM devices WHERE properties.reported.extFwInfo.SasRequest = {version}"
+
+    requests = []
+    token = None
+    while True:
+        result = registry_manager.query_iot_hub(models.QuerySpecification(query=query), token, 100)
+        for twin in result.items:
+            requests.append((twin.device_id, twin.properties.reported["extFwInfo"]["SasRequest"]))
+        token = result.continuation_token
+        if not token:
+            return requests
+
+def refresh(registry_manager, container, days, version):
+
+    # one sas per container is enough, every device gets the same one
+    file_sas = None
+    for device_id, sas_version in pending_requests(registry_manager, version):
+        if file_sas is None:
+            file_sas = container_sas(container, days)
+        twin = models.Twin(properties=models.TwinProperties(desired={
+            "extFwSas": {
+                "version" : sas_version,
+                "sas" : file_sas
+            }
+        }))
+        registry_manager.update_twin(device_id, twin, "*")
+        print(f"{device_id}: new sas for version {sas_version}")
+
+if __name__ == "__main__":
+
+    parser = argparse.ArgumentParser(description="Send a new sas to devices whose OTA download was rejected with 403, the download continues where it stopped")
+    parser.add_argument("-c", "--container", type=str, default="ota", help="specify the container of blob")
+    parser.add_argument("-d", "--days", type=int, default=365, help="sas expire duration")
+    parser.add_argument("-v", "--version", type=int, help="only answer devices downloading this version")
+    parser.add_argument("-i", "--interval", type=int, default=0, help="seconds between checks, 0 to check once")
+    args = parser.parse_args()
+
+    registry_manager = IoTHubRegistryManager(os.environ["AZURE_IOTHUB_CONNECTIONSTRING"])
+    while True:
+        refresh(registry_manager, args.container, args.days, args.version)
+        if args.interval <= 0:
+            break
+        time.sleep(args.interval)
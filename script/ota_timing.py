@@ -0,0 +1,125 @@
+import sys
+import json
+import argparse
+
+# order and names of the phases in an otaTiming telemetry message
+PHASES = ["queue", "paused", "connect", "transfer", "sync", "verify", "wait", "apply"]
+
+STATUS = ["downloading", "interrupted", "applying", "applied", "error", "invalid"]
+
+def find_timings(node):
+
+    if isinstance(node, dict):
+        if "otaTiming" in node and isinstance(node["otaTiming"], dict):
+            yield node["otaTiming"]
+        else:
+            for value in node.values():
+                yield from find_timings(value)
+    elif isinstance(node, list):
+        for value in node:
+            yield from find_timings(value)
+    elif isinstance(node, str) and "otaTiming" in node:
+        # payload forwarded as an undecoded string
+        try:
+            yield from find_timings(json.loads(node))
+        except ValueError:
+            pass
+
+def load(files):
+
+    timings = []
+    for file in files:
+        with (sys.stdin if file == "-" else open(file, "r")) as f:
+            text = f.read()
+        try:
+            # a single JSON document, e.g. an exported array of events
+            timings.extend(find_timings(json.loads(text)))
+        except ValueError:
+            # otherwise one JSON document per line
+            for line in text.splitlines():
+                line = line.strip()
+                if line:
+                    try:
+                        timings.extend(find_timings(json.loads(line)))
+                    except ValueError:
+                        continue
+    return timings
+
+def percentile(values, p):
+
+    if not values:
+        return 0
+    values = sorted(values)
+    k = (len(values) - 1) * p / 100.0
+    lo = int(k)
+    hi = min(lo + 1, len(values) - 1)
+    return values[lo] + (values[hi] - values[lo]) * (k - lo)
+
+def report(timings, percentiles):
+
+    header = f"{'phase':<10}{'count':>7}" + "".join(f"{'p' + format(p, 'g'):>10}" for p in percentiles) + f"{'max':>10}{'share':>8}"
+    print(header)
+    print("-" * len(header))
+
+    totals = {phase: sum(t.get(phase, 0) for t in timings) for phase in PHASES}
+    grand_total = sum(totals.values()) or 1
+
+    for phase in PHASES:
+        # a phase that was skipped in an attempt is reported as 0 and does not count
+        values = [t[phase] for t in timings if t.get(phase, 0) > 0]
+        row = f"{phase:<10}{len(values):>7}"
+        row += "".join(f"{percentile(values, p):>10.0f}" for p in percentiles)
+        row += f"{max(values) if values else 0:>10}{100.0 * totals[phase] / grand_total:>7.1f}%"
+        print(row)
+
+    rates = [t["bytes"] * 1000.0 / t["transfer"] for t in timings if t.get("transfer", 0) > 0 and t.get("bytes", 0) > 0]
+    # achieved download rate as a share of the cap of capped attempts
+    cap_shares = [100.0 * t["bytes"] * 1000.0 / t["transfer"] / t["cap"] for t in timings
+                  if t.get("cap", 0) > 0 and t.get("transfer", 0) > 0 and t.get("bytes", 0) > 0]
+    verify_rates = [t["size"] * 1000.0 / t["verify"] for t in timings if t.get("verify", 0) > 0 and t.get("size", 0) > 0]
+
+    print()
+    if rates:
+        print("download rate (B/s)   " + "  ".join(f"p{p:g}={percentile(rates, p):.0f}" for p in percentiles))
+    if cap_shares:
+        print("rate vs cap (%)       " + "  ".join(f"p{p:g}={percentile(cap_shares, p):.0f}" for p in percentiles))
+    if verify_rates:
+        print("verify rate (B/s)     " + "  ".join(f"p{p:g}={percentile(verify_rates, p):.0f}" for p in percentiles))
+
+    results = {}
+    for t in timings:
+        st = t.get("st", len(STATUS) - 1)
+        name = STATUS[st] if 0 <= st < len(STATUS) else str(st)
+        results[name] = results.get(name, 0) + 1
+    print("attempts by result    " + "  ".join(f"{k}={v}" for k, v in sorted(results.items())))
+
+    # attempts started by the device itself after a transient failure
+    retries = {}
+    for t in timings:
+        if t.get("retry", 0) > 0:
+            retries[t["retry"]] = retries.get(t["retry"], 0) + 1
+    if retries:
+        print("automatic retries     " + "  ".join(f"#{k}={v}" for k, v in sorted(retries.items())))
+
+if __name__ == "__main__":
+
+    parser = argparse.ArgumentParser(description="Aggregate otaTiming telemetry into percentile reports (all durations in ms)")
+    parser.add_argument("FILE", type=str, nargs="*", default=["-"], help="telemetry dump, e.g. output of 'az iot hub monitor-events', default stdin")
+    parser.add_argument("-v", "--version", type=int, help="only include attempts for this version")
+    parser.add_argument("-t", "--target", type=str, help="only include attempts for this external MCU")
+    parser.add_argument("-p", "--percentiles", type=str, default="50,90,99", help="comma separated list of percentiles")
+    args = parser.parse_args()
+
+    timings = load(args.FILE)
+    if args.version is not None:
+        timings = [t for t in timings if t.get("ver") == args.version]
+    if args.target is not None:
+        # attempts from before multi-target requests carry no target and were for the default MCU
+        timings = [t for t in timings if t.get("tgt", "mcu") == args.target]
+
+    if not timings:
+        print("no otaTiming messages found")
+        sys.exit(1)
+
+    print(f"{len(timings)} OTA attempts")
+    report(timings, [float(p) for p in args.percentiles.split(",")])
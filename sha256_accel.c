@@ -0,0 +1,540 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <applibs/log.h>
+
+#include "sha256/mark2/sha256.h"
+#include "sha256_accel.h"
+
+/* ARMv8 SHA2 instructions are only usable when the compiler targets them (e.g. -march=armv8-a+crypto),
+   NEON on ARMv7 when built with -mfpu=neon. Both are fixed at build time, SHA-NI is probed with cpuid. */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SHA256_HAVE_NEON
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#define SHA256_HAVE_ARMV8
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_HAVE_SHANI
+#endif
+
+#define BENCHMARK_CHUNK 4096
+#define BENCHMARK_TOTAL (1024 * 1024)
+
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                               0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x) (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define EP1(x) (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define SIG0(x) (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define SIG1(x) (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// the 64 rounds on a message schedule with the round constants already added
+static void sha256_rounds(uint32_t state[8], const uint32_t wk[64])
+{
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int t = 0; t < 64; t++) {
+        uint32_t t1 = h + EP1(e) + CH(e, f, g) + wk[t];
+        uint32_t t2 = EP0(a) + MAJ(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha256_blocks_scalar(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    uint32_t w[64];
+
+    while (blocks--) {
+        for (int t = 0; t < 16; t++) {
+            w[t] = load_be32(data + 4 * t);
+        }
+        for (int t = 16; t < 64; t++) {
+            w[t] = SIG1(w[t - 2]) + w[t - 7] + SIG0(w[t - 15]) + w[t - 16];
+        }
+        for (int t = 0; t < 64; t++) {
+            w[t] += K[t];
+        }
+        sha256_rounds(state, w);
+        data += SHA256_ACCEL_BLOCK;
+    }
+}
+
+#if defined(SHA256_HAVE_NEON)
+#define NEON_ROR(x, n) vsriq_n_u32(vshlq_n_u32((x), 32 - (n)), (x), (n))
+#define NEON_ROR2(x, n) vsri_n_u32(vshl_n_u32((x), 32 - (n)), (x), (n))
+
+// The rounds are a serial chain and stay scalar, the message schedule is computed four words
+// at a time. W[t+2] and W[t+3] depend on W[t] and W[t+1], so sigma1 is applied in two halves.
+static void sha256_blocks_neon(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    uint32_t wk[64];
+
+    while (blocks--) {
+        uint32x4_t x[4];
+
+        for (int i = 0; i < 4; i++) {
+            x[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+            vst1q_u32(&wk[4 * i], vaddq_u32(x[i], vld1q_u32(&K[4 * i])));
+        }
+        for (int t = 16; t < 64; t += 4) {
+            // x holds W[t-16..t-1]
+            uint32x4_t w15 = vextq_u32(x[0], x[1], 1);
+            uint32x4_t w7 = vextq_u32(x[2], x[3], 1);
+            uint32x4_t s0 = veorq_u32(veorq_u32(NEON_ROR(w15, 7), NEON_ROR(w15, 18)), vshrq_n_u32(w15, 3));
+            uint32x4_t sum = vaddq_u32(vaddq_u32(x[0], s0), w7);
+            uint32x2_t w2 = vget_high_u32(x[3]);
+            uint32x2_t lo = vadd_u32(vget_low_u32(sum),
+                                     veor_u32(veor_u32(NEON_ROR2(w2, 17), NEON_ROR2(w2, 19)), vshr_n_u32(w2, 10)));
+            uint32x2_t hi = vadd_u32(vget_high_u32(sum),
+                                     veor_u32(veor_u32(NEON_ROR2(lo, 17), NEON_ROR2(lo, 19)), vshr_n_u32(lo, 10)));
+
+            x[0] = x[1];
+            x[1] = x[2];
+            x[2] = x[3];
+            x[3] = vcombine_u32(lo, hi);
+            vst1q_u32(&wk[t], vaddq_u32(x[3], vld1q_u32(&K[t])));
+        }
+        sha256_rounds(state, wk);
+        data += SHA256_ACCEL_BLOCK;
+    }
+}
+#endif
+
+#if defined(SHA256_HAVE_ARMV8)
+static void sha256_blocks_armv8(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    uint32x4_t abcd = vld1q_u32(&state[0]);
+    uint32x4_t efgh = vld1q_u32(&state[4]);
+
+    while (blocks--) {
+        uint32x4_t abcd_save = abcd;
+        uint32x4_t efgh_save = efgh;
+        uint32x4_t msg[4];
+
+        for (int i = 0; i < 4; i++) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+        // 16 groups of four rounds, msg[i & 3] is rewritten with the next four schedule words
+        for (int i = 0; i < 16; i++) {
+            uint32x4_t wk, abcd_prev;
+            if (i >= 4) {
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+                                             msg[(i + 2) & 3], msg[(i + 3) & 3]);
+            }
+            wk = vaddq_u32(msg[i & 3], vld1q_u32(&K[4 * i]));
+            abcd_prev = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+        }
+        abcd = vaddq_u32(abcd, abcd_save);
+        efgh = vaddq_u32(efgh, efgh_save);
+        data += SHA256_ACCEL_BLOCK;
+    }
+
+    vst1q_u32(&state[0], abcd);
+    vst1q_u32(&state[4], efgh);
+}
+#endif
+
+#if defined(SHA256_HAVE_SHANI)
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    __m128i state0;
+
+    // the round instructions take the state as ABEF and CDGH
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), byteswap);
+        }
+        for (int i = 0; i < 16; i++) {
+            __m128i wk;
+            if (i >= 4) {
+                __m128i w = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+                msg[i & 3] = _mm_sha256msg2_epu32(w, msg[(i + 3) & 3]);
+            }
+            wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += SHA256_ACCEL_BLOCK;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static int __shani_supported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ebx & bit_SHA) != 0;
+}
+#endif
+
+static const sha256_blocks_fn kernels[SHA256_KERNEL_COUNT] = {
+    [SHA256_KERNEL_SCALAR] = sha256_blocks_scalar,
+#if defined(SHA256_HAVE_NEON)
+    [SHA256_KERNEL_NEON] = sha256_blocks_neon,
+#endif
+#if defined(SHA256_HAVE_ARMV8)
+    [SHA256_KERNEL_ARMV8] = sha256_blocks_armv8,
+#endif
+#if defined(SHA256_HAVE_SHANI)
+    [SHA256_KERNEL_SHANI] = sha256_blocks_shani,
+#endif
+};
+
+static const char *const kernel_names[SHA256_KERNEL_COUNT] = {
+    [SHA256_KERNEL_SCALAR] = "scalar",
+    [SHA256_KERNEL_NEON] = "neon",
+    [SHA256_KERNEL_ARMV8] = "armv8",
+    [SHA256_KERNEL_SHANI] = "sha-ni",
+};
+
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+static sha256_accel_kernel selected = SHA256_KERNEL_SCALAR;
+static sha256_blocks_fn sha256_blocks = sha256_blocks_scalar;
+
+// digest of "abc", every kernel is checked against it before it is used
+static const uint8_t abc_digest[SHA256_ACCEL_BYTES] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+
+static int __kernel_self_test(sha256_blocks_fn fn)
+{
+    uint8_t block[SHA256_ACCEL_BLOCK] = {'a', 'b', 'c', 0x80};
+    sha256_digest digest;
+    uint32_t state[8];
+
+    block[SHA256_ACCEL_BLOCK - 1] = 3 * 8;
+    memcpy(state, H0, sizeof(state));
+    fn(state, block, 1);
+    for (int i = 0; i < 8; i++) {
+        store_be32(&digest.bytes[4 * i], state[i]);
+    }
+    return memcmp(digest.bytes, abc_digest, sizeof(digest.bytes)) == 0;
+}
+
+int sha256_accel_supported(sha256_accel_kernel kernel)
+{
+    if ((int)kernel < 0 || kernel >= SHA256_KERNEL_COUNT || kernels[kernel] == NULL) {
+        return 0;
+    }
+#if defined(SHA256_HAVE_SHANI)
+    if (kernel == SHA256_KERNEL_SHANI && !__shani_supported()) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static void __select_kernel(void)
+{
+    static const sha256_accel_kernel preference[] = {SHA256_KERNEL_ARMV8, SHA256_KERNEL_SHANI, SHA256_KERNEL_NEON};
+
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+        if (!sha256_accel_supported(preference[i])) {
+            continue;
+        }
+        if (!__kernel_self_test(kernels[preference[i]])) {
+            Log_Debug("ERROR: sha256 %s kernel failed its self test\n", kernel_names[preference[i]]);
+            continue;
+        }
+        selected = preference[i];
+        sha256_blocks = kernels[selected];
+        break;
+    }
+    Log_Debug("INFO: sha256 uses the %s kernel\n", kernel_names[selected]);
+}
+
+sha256_accel_kernel sha256_accel_selected(void)
+{
+    pthread_once(&select_once, __select_kernel);
+    return selected;
+}
+
+int sha256_accel_select(sha256_accel_kernel kernel)
+{
+    pthread_once(&select_once, __select_kernel);
+    if (!sha256_accel_supported(kernel)) {
+        return -1;
+    }
+    selected = kernel;
+    sha256_blocks = kernels[kernel];
+    return 0;
+}
+
+const char *sha256_accel_kernel_name(sha256_accel_kernel kernel)
+{
+    if ((int)kernel < 0 || kernel >= SHA256_KERNEL_COUNT) {
+        return "unknown";
+    }
+    return kernel_names[kernel];
+}
+
+void sha256_accel_init(sha256_accel_context *ctx)
+{
+    pthread_once(&select_once, __select_kernel);
+    memcpy(ctx->state, H0, sizeof(ctx->state));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_accel_update(sha256_accel_context *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t blocks;
+
+    ctx->length += len;
+
+    if (ctx->used > 0) {
+        size_t n = SHA256_ACCEL_BLOCK - ctx->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(&ctx->block[ctx->used], p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used < SHA256_ACCEL_BLOCK) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+
+    // whole blocks are hashed straight from the caller's buffer
+    blocks = len / SHA256_ACCEL_BLOCK;
+    if (blocks > 0) {
+        sha256_blocks(ctx->state, p, blocks);
+        p += blocks * SHA256_ACCEL_BLOCK;
+        len -= blocks * SHA256_ACCEL_BLOCK;
+    }
+
+    if (len > 0) {
+        memcpy(ctx->block, p, len);
+        ctx->used = len;
+    }
+}
+
+void sha256_accel_final(sha256_accel_context *ctx, sha256_digest *digest)
+{
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > SHA256_ACCEL_BLOCK - 8) {
+        memset(&ctx->block[ctx->used], 0, SHA256_ACCEL_BLOCK - ctx->used);
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+    memset(&ctx->block[ctx->used], 0, SHA256_ACCEL_BLOCK - 8 - ctx->used);
+    store_be32(&ctx->block[SHA256_ACCEL_BLOCK - 8], (uint32_t)(bits >> 32));
+    store_be32(&ctx->block[SHA256_ACCEL_BLOCK - 4], (uint32_t)bits);
+    sha256_blocks(ctx->state, ctx->block, 1);
+
+    for (int i = 0; i < 8; i++) {
+        store_be32(&digest->bytes[4 * i], ctx->state[i]);
+    }
+}
+
+static int __hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int sha256_digest_from_hex(const char *hex, sha256_digest *digest)
+{
+    for (int i = 0; i < SHA256_ACCEL_BYTES; i++) {
+        // a terminator within the digits fails here before anything past it is read
+        int hi = __hex_value(hex[2 * i]);
+        int lo = hi < 0 ? -1 : __hex_value(hex[2 * i + 1]);
+        if (lo < 0) {
+            return -1;
+        }
+        digest->bytes[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return hex[SHA256_ACCEL_BYTES * 2] == '\0' ? 0 : -1;
+}
+
+void sha256_digest_to_hex(const sha256_digest *digest, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 0; i < SHA256_ACCEL_BYTES; i++) {
+        hex[2 * i] = digits[digest->bytes[i] >> 4];
+        hex[2 * i + 1] = digits[digest->bytes[i] & 0x0F];
+    }
+    hex[SHA256_ACCEL_BYTES * 2] = '\0';
+}
+
+int sha256_digest_equal(const sha256_digest *a, const sha256_digest *b)
+{
+    volatile uint8_t diff = 0;
+
+    for (int i = 0; i < SHA256_ACCEL_BYTES; i++) {
+        diff |= a->bytes[i] ^ b->bytes[i];
+    }
+    return diff == 0;
+}
+
+static double __now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// hashes BENCHMARK_TOTAL bytes as messages of msg_size bytes, kernel < 0 runs sha256/mark2
+static double __benchmark_run(int kernel, const uint8_t *buffer, size_t msg_size)
+{
+    sha256_digest digest;
+    size_t messages = BENCHMARK_TOTAL / msg_size;
+    double start;
+
+    if (messages == 0) {
+        messages = 1;
+    }
+
+    start = __now_s();
+    for (size_t m = 0; m < messages; m++) {
+        if (kernel < 0) {
+            sha256_context ctx;
+            sha256_init(&ctx);
+            for (size_t done = 0; done < msg_size; done += BENCHMARK_CHUNK) {
+                size_t n = msg_size - done < BENCHMARK_CHUNK ? msg_size - done : BENCHMARK_CHUNK;
+                sha256_hash(&ctx, buffer, n);
+            }
+            sha256_done(&ctx, digest.bytes);
+        } else {
+            sha256_accel_context ctx;
+            sha256_accel_init(&ctx);
+            for (size_t done = 0; done < msg_size; done += BENCHMARK_CHUNK) {
+                size_t n = msg_size - done < BENCHMARK_CHUNK ? msg_size - done : BENCHMARK_CHUNK;
+                sha256_accel_update(&ctx, buffer, n);
+            }
+            sha256_accel_final(&ctx, &digest);
+        }
+    }
+    return (double)(messages * msg_size) / (__now_s() - start) / 1e6;
+}
+
+void sha256_accel_benchmark(void)
+{
+    static const size_t sizes[] = {512, 4096, 65536, BENCHMARK_TOTAL};
+    sha256_accel_kernel previous = sha256_accel_selected();
+    uint8_t *buffer = malloc(BENCHMARK_CHUNK);
+
+    if (buffer == NULL) {
+        Log_Debug("ERROR: malloc fail\n");
+        return;
+    }
+    for (size_t i = 0; i < BENCHMARK_CHUNK; i++) {
+        buffer[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    // mark2 is the portable implementation the kernels replace
+    for (int kernel = -1; kernel < SHA256_KERNEL_COUNT; kernel++) {
+        if (kernel >= 0 && sha256_accel_select((sha256_accel_kernel)kernel) != 0) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            Log_Debug("INFO: sha256 %-6s %7u B messages: %7.1f MB/s\n",
+                      kernel < 0 ? "mark2" : kernel_names[kernel], (unsigned int)sizes[i],
+                      __benchmark_run(kernel, buffer, sizes[i]));
+        }
+    }
+
+    sha256_accel_select(previous);
+    free(buffer);
+}
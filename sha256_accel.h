@@ -0,0 +1,66 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#ifndef sha256_accel_h
+#define sha256_accel_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ SHA-256 with the block function picked at runtime from the kernels the binary was built with:
+ ARMv8 SHA2 instructions, x86 SHA-NI, a NEON message schedule for ARMv7 cores without crypto
+ extensions such as the Cortex-A7, and portable C as the fallback.
+*/
+
+#define SHA256_ACCEL_BYTES 32
+#define SHA256_ACCEL_BLOCK 64
+
+typedef enum sha256_accel_kernel_t {
+    SHA256_KERNEL_SCALAR = 0,
+    SHA256_KERNEL_NEON,
+    SHA256_KERNEL_ARMV8,
+    SHA256_KERNEL_SHANI,
+    SHA256_KERNEL_COUNT
+} sha256_accel_kernel;
+
+typedef struct sha256_digest_t {
+    uint8_t bytes[SHA256_ACCEL_BYTES];
+} sha256_digest;
+
+typedef struct sha256_accel_context_t {
+    uint32_t state[8];
+    uint64_t length;                  /* bytes hashed so far */
+    uint8_t block[SHA256_ACCEL_BLOCK]; /* pending partial block */
+    size_t used;
+} sha256_accel_context;
+
+void sha256_accel_init(sha256_accel_context *ctx);
+void sha256_accel_update(sha256_accel_context *ctx, const void *data, size_t len);
+void sha256_accel_final(sha256_accel_context *ctx, sha256_digest *digest);
+
+/* Decodes exactly 64 hex digits of either case. Returns -1 on anything else, digest is undefined then. */
+int sha256_digest_from_hex(const char *hex, sha256_digest *digest);
+
+/* hex receives SHA256_ACCEL_BYTES * 2 lowercase digits and the terminator */
+void sha256_digest_to_hex(const sha256_digest *digest, char *hex);
+
+/* 1 if both digests are equal, the time taken does not depend on where they differ */
+int sha256_digest_equal(const sha256_digest *a, const sha256_digest *b);
+
+/* kernel used by sha256_accel_update, the fastest one supported by this cpu */
+sha256_accel_kernel sha256_accel_selected(void);
+
+/* 1 if the kernel was built in and is supported by this cpu */
+int sha256_accel_supported(sha256_accel_kernel kernel);
+
+/* Forces a kernel, e.g. for comparisons. Returns -1 if it is not supported, the selection is
+   left unchanged then. Not meant to be called while another thread is hashing. */
+int sha256_accel_select(sha256_accel_kernel kernel);
+
+const char *sha256_accel_kernel_name(sha256_accel_kernel kernel);
+
+/* Logs the throughput in MB/s of every supported kernel for messages of 512 B up to 1 MB */
+void sha256_accel_benchmark(void);
+
+#endif
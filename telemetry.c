@@ -0,0 +1,452 @@
+﻿/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <applibs/log.h>
+
+#include "epoll_timerfd_utilities.h"
+#include "littlefs_w25q128.h"
+#include "telemetry.h"
+
+// Each batch is a JSON array of {"<key>":"<value>","ts":<epoch seconds>} readings. Batch
+// buffers come from a fixed pool: one is filled while sealed ones wait for the sink, so
+// readings survive a short disconnection without any allocation.
+#define TELEMETRY_POOL_SIZE 4
+#define TELEMETRY_BATCH_BYTES 2048
+
+// a batch is flushed at the latest this long after its first reading
+static const struct timespec TelemetryMaxAge = {60, 0};
+
+// Batches the sink refuses are appended, one per line, to the newer of two spool files. When it
+// reaches half of the bound it replaces the older one, so the spool never needs more than the
+// bound and losing data drops the oldest half at once instead of rewriting files. The drain reads
+// the older file from a RAM offset, after a reboot it restarts from the beginning of that file.
+#define SPOOL_NEW_FILE "telemetry.0"
+#define SPOOL_OLD_FILE "telemetry.1"
+
+typedef struct {
+    char data[TELEMETRY_BATCH_BYTES];
+    size_t length;
+    uint32_t count;
+} TelemetryBatch;
+
+static TelemetryBatch pool[TELEMETRY_POOL_SIZE];
+// free buffers are a stack, sealed buffers a FIFO, both hold indexes into pool
+static uint8_t freeList[TELEMETRY_POOL_SIZE];
+static uint32_t freeCount = 0;
+static uint8_t sealedQueue[TELEMETRY_POOL_SIZE];
+static uint32_t sealedHead = 0;
+static uint32_t sealedCount = 0;
+static TelemetryBatch *openBatch = NULL;
+static TelemetrySink telemetrySink = NULL;
+static TelemetryStats stats;
+
+static const TelemetrySpoolConfig *spoolConfig = NULL;
+static uint32_t spoolNewBytes = 0;
+static uint32_t spoolOldBytes = 0;
+static uint32_t spoolDrainOffset = 0;
+static bool spoolDraining = false;
+static char drainBuffer[TELEMETRY_BATCH_BYTES];
+
+static void TelemetryTimerEventHandler(WheelTimer *timer);
+static WheelTimer telemetryTimer = {.handler = &TelemetryTimerEventHandler};
+static void SpoolDrainEventHandler(WheelTimer *timer);
+static WheelTimer spoolDrainTimer = {.handler = &SpoolDrainEventHandler};
+
+static void ReleaseBatch(TelemetryBatch *batch)
+{
+    batch->length = 0;
+    batch->count = 0;
+    freeList[freeCount++] = (uint8_t)(batch - pool);
+}
+
+static void SealOpenBatch(void)
+{
+    if ((openBatch == NULL) || (openBatch->count == 0)) {
+        return;
+    }
+
+    // the ']' always fits, AppendReading keeps a byte for it
+    openBatch->data[openBatch->length++] = ']';
+    openBatch->data[openBatch->length] = '\0';
+
+    sealedQueue[(sealedHead + sealedCount) % TELEMETRY_POOL_SIZE] = (uint8_t)(openBatch - pool);
+    sealedCount++;
+    openBatch = NULL;
+
+    CancelWheelTimer(&telemetryTimer);
+}
+
+static bool OpenBatch(void)
+{
+    if (freeCount == 0) {
+        if (sealedCount == 0) {
+            return false;
+        }
+        // the oldest sealed batch makes room, its readings are lost
+        TelemetryBatch *oldest = &pool[sealedQueue[sealedHead]];
+        sealedHead = (sealedHead + 1) % TELEMETRY_POOL_SIZE;
+        sealedCount--;
+        stats.dropped += oldest->count;
+        Log_Debug("WARNING: Telemetry pool exhausted, dropped %u readings\n", oldest->count);
+        ReleaseBatch(oldest);
+    }
+
+    openBatch = &pool[freeList[--freeCount]];
+    openBatch->length = 0;
+    openBatch->count = 0;
+    return true;
+}
+
+/// <summary>
+///     Appends a string as the contents of a JSON string: quotes and backslashes are escaped,
+///     control characters written as \u00XX.
+/// </summary>
+/// <returns>false if it does not fit in room bytes</returns>
+static bool AppendEscaped(char *out, size_t room, size_t *length, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        char escaped[7];
+        size_t n = 1;
+
+        if ((c == '"') || (c == '\\')) {
+            escaped[0] = '\\';
+            escaped[1] = (char)c;
+            n = 2;
+        } else if (c < 0x20) {
+            n = (size_t)snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        } else {
+            escaped[0] = (char)c;
+        }
+
+        if (n >= room - *length) {
+            return false;
+        }
+        memcpy(&out[*length], escaped, n);
+        *length += n;
+    }
+    return true;
+}
+
+static bool AppendReading(const char *key, const char *value)
+{
+    char *out = &openBatch->data[openBatch->length];
+    size_t room = TELEMETRY_BATCH_BYTES - openBatch->length - 1; // keep space for ']'
+    size_t length = 0;
+    int len;
+
+    // key and value are escaped in place, the fixed parts around them are checked as they go
+    if (room < 3) {
+        return false;
+    }
+    out[length++] = (openBatch->count == 0) ? '[' : ',';
+    out[length++] = '{';
+    out[length++] = '"';
+    if (!AppendEscaped(out, room, &length, key) || (room - length < 4)) {
+        return false;
+    }
+    memcpy(&out[length], "\":\"", 3);
+    length += 3;
+    if (!AppendEscaped(out, room, &length, value)) {
+        return false;
+    }
+
+    len = snprintf(&out[length], room - length, "\",\"ts\":%lld}", (long long)time(NULL));
+    if ((len < 0) || ((size_t)len >= room - length)) {
+        return false;
+    }
+
+    openBatch->length += length + (size_t)len;
+    openBatch->count++;
+    return true;
+}
+
+static uint32_t SpoolFileSize(const char *path)
+{
+    struct lfs_info info;
+
+    if (lfs_stat(&g_w25q128_lfs, path, &info) < 0) {
+        return 0;
+    }
+    return info.size;
+}
+
+static void UpdateSpoolBytes(void)
+{
+    stats.spoolBytes = spoolNewBytes + spoolOldBytes - spoolDrainOffset;
+}
+
+/// <summary>
+///     Makes the newer spool file the older one, the previous older file is dropped.
+///     The volume lock must be held.
+/// </summary>
+/// <returns>true if the files were rotated, false if both are left as they were</returns>
+static bool RotateSpool(void)
+{
+    // rename replaces the older file
+    int result = lfs_rename(&g_w25q128_lfs, SPOOL_NEW_FILE, SPOOL_OLD_FILE);
+    if (result < 0) {
+        Log_Debug("ERROR: Unable to rotate the telemetry spool: %d\n", result);
+        stats.spoolErrors++;
+        return false;
+    }
+
+    if (spoolOldBytes > spoolDrainOffset) {
+        stats.spoolDroppedBytes += spoolOldBytes - spoolDrainOffset;
+        Log_Debug("WARNING: Telemetry spool full, dropped %u bytes\n", spoolOldBytes - spoolDrainOffset);
+    }
+    spoolOldBytes = spoolNewBytes;
+    spoolNewBytes = 0;
+    spoolDrainOffset = 0;
+    return true;
+}
+
+/// <summary>
+///     Appends a sealed batch as one line to the spool.
+/// </summary>
+/// <returns>true if the batch is on flash</returns>
+static bool SpoolAppend(TelemetryBatch *batch)
+{
+    lfs_file_t file;
+    bool written = false;
+
+    if (spoolConfig == NULL) {
+        return false;
+    }
+
+    // do not stall the main loop behind an OTA flash write, the batch stays in RAM meanwhile
+    if (!w25q128_lfs_trylock()) {
+        return false;
+    }
+
+    // a rotation that failed before is retried first, the newer file must not outgrow its half
+    if ((spoolNewBytes >= spoolConfig->maxBytes / 2) && !RotateSpool()) {
+        w25q128_lfs_unlock();
+        return false;
+    }
+
+    if (lfs_file_open(&g_w25q128_lfs, &file, SPOOL_NEW_FILE, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND) ==
+        LFS_ERR_OK) {
+        batch->data[batch->length] = '\n';
+        written = lfs_file_write(&g_w25q128_lfs, &file, batch->data, batch->length + 1) ==
+                  (lfs_ssize_t)(batch->length + 1);
+        batch->data[batch->length] = '\0';
+        // close commits the append atomically, a power loss never leaves a partial line
+        written = (lfs_file_close(&g_w25q128_lfs, &file) == LFS_ERR_OK) && written;
+    }
+
+    if (written) {
+        stats.spooled++;
+        spoolNewBytes += (uint32_t)batch->length + 1;
+        if (spoolNewBytes >= spoolConfig->maxBytes / 2) {
+            (void)RotateSpool();
+        }
+        UpdateSpoolBytes();
+    } else {
+        Log_Debug("ERROR: Unable to append to the telemetry spool\n");
+    }
+
+    w25q128_lfs_unlock();
+    return written;
+}
+
+static void StartSpoolDrain(void)
+{
+    if ((spoolConfig == NULL) || spoolDraining || (stats.spoolBytes == 0)) {
+        return;
+    }
+
+    struct timespec period = {spoolConfig->drainPeriodMs / 1000,
+                              (spoolConfig->drainPeriodMs % 1000) * 1000000};
+    if (StartWheelTimer(&spoolDrainTimer, &period) == 0) {
+        Log_Debug("INFO: Draining %u bytes of spooled telemetry\n", stats.spoolBytes);
+        spoolDraining = true;
+    }
+}
+
+static void StopSpoolDrain(void)
+{
+    CancelWheelTimer(&spoolDrainTimer);
+    spoolDraining = false;
+}
+
+/// <summary>
+///     Hands spooled batches to the sink, at most drainBytesPerPeriod per run.
+/// </summary>
+static void SpoolDrainEventHandler(WheelTimer *timer)
+{
+    lfs_file_t file;
+    uint32_t budget = spoolConfig->drainBytesPerPeriod;
+
+    if (!w25q128_lfs_trylock()) {
+        return;
+    }
+
+    while (budget > 0) {
+        if (spoolDrainOffset >= spoolOldBytes) {
+            // older file is done, continue with what was spooled meanwhile
+            (void)lfs_remove(&g_w25q128_lfs, SPOOL_OLD_FILE);
+            spoolOldBytes = 0;
+            spoolDrainOffset = 0;
+            if (spoolNewBytes == 0) {
+                StopSpoolDrain();
+                break;
+            }
+            if (!RotateSpool()) {
+                // the newer file stays where the next append or drain retries the rotation
+                StopSpoolDrain();
+                break;
+            }
+        }
+
+        if (lfs_file_open(&g_w25q128_lfs, &file, SPOOL_OLD_FILE, LFS_O_RDONLY) != LFS_ERR_OK) {
+            spoolOldBytes = 0;
+            continue;
+        }
+
+        lfs_ssize_t nb = -1;
+        if (lfs_file_seek(&g_w25q128_lfs, &file, (lfs_soff_t)spoolDrainOffset, LFS_SEEK_SET) >= 0) {
+            nb = lfs_file_read(&g_w25q128_lfs, &file, drainBuffer, sizeof(drainBuffer));
+        }
+        (void)lfs_file_close(&g_w25q128_lfs, &file);
+
+        char *end = (nb > 0) ? memchr(drainBuffer, '\n', (size_t)nb) : NULL;
+        if (end == NULL) {
+            // unreadable or not a batch line, skip the rest of the file
+            Log_Debug("ERROR: Telemetry spool corrupted at %u\n", spoolDrainOffset);
+            stats.spoolDroppedBytes += spoolOldBytes - spoolDrainOffset;
+            spoolDrainOffset = spoolOldBytes;
+            continue;
+        }
+
+        *end = '\0';
+        size_t length = (size_t)(end - drainBuffer);
+        if (!telemetrySink(drainBuffer, length)) {
+            // try again once the sink accepts live batches
+            StopSpoolDrain();
+            break;
+        }
+
+        stats.drained++;
+        spoolDrainOffset += (uint32_t)length + 1;
+        budget = (budget > length + 1) ? budget - (uint32_t)length - 1 : 0;
+    }
+
+    UpdateSpoolBytes();
+    w25q128_lfs_unlock();
+}
+
+int EnableTelemetrySpool(const TelemetrySpoolConfig *config)
+{
+    w25q128_lfs_lock();
+    // whatever a previous run left behind is drained after the next reconnect
+    spoolNewBytes = SpoolFileSize(SPOOL_NEW_FILE);
+    spoolOldBytes = SpoolFileSize(SPOOL_OLD_FILE);
+    spoolDrainOffset = 0;
+    w25q128_lfs_unlock();
+
+    spoolConfig = config;
+    UpdateSpoolBytes();
+    Log_Debug("INFO: Telemetry spool holds %u bytes\n", stats.spoolBytes);
+
+    return 0;
+}
+
+int InitTelemetry(TelemetrySink sink)
+{
+    telemetrySink = sink;
+    openBatch = NULL;
+    sealedHead = 0;
+    sealedCount = 0;
+    freeCount = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    for (uint32_t i = 0; i < TELEMETRY_POOL_SIZE; i++) {
+        ReleaseBatch(&pool[TELEMETRY_POOL_SIZE - 1 - i]);
+    }
+
+    return 0;
+}
+
+bool AddTelemetry(const char *key, const char *value, bool urgent)
+{
+    if ((openBatch == NULL) && !OpenBatch()) {
+        stats.dropped++;
+        return false;
+    }
+
+    if (!AppendReading(key, value)) {
+        // a reading that does not fit an empty batch never will, the batch stays open for the next
+        if (openBatch->count == 0) {
+            Log_Debug("WARNING: Telemetry reading '%s' does not fit in a batch\n", key);
+            stats.dropped++;
+            return false;
+        }
+        // batch is full, seal it and retry in a fresh one
+        SealOpenBatch();
+        if (!OpenBatch() || !AppendReading(key, value)) {
+            Log_Debug("WARNING: Telemetry reading '%s' does not fit in a batch\n", key);
+            stats.dropped++;
+            return false;
+        }
+    }
+
+    stats.readings++;
+
+    if (openBatch->count == 1) {
+        StartWheelTimerOnce(&telemetryTimer, &TelemetryMaxAge);
+    }
+
+    if (urgent || (openBatch->length > TELEMETRY_BATCH_BYTES * 3 / 4)) {
+        SealOpenBatch();
+        SendPendingTelemetry();
+    }
+
+    return true;
+}
+
+void SendPendingTelemetry(void)
+{
+    bool refused = false;
+
+    while (sealedCount > 0) {
+        TelemetryBatch *batch = &pool[sealedQueue[sealedHead]];
+        if (telemetrySink(batch->data, batch->length)) {
+            stats.published++;
+        } else if (SpoolAppend(batch)) {
+            refused = true;
+        } else {
+            return;
+        }
+
+        sealedHead = (sealedHead + 1) % TELEMETRY_POOL_SIZE;
+        sealedCount--;
+        ReleaseBatch(batch);
+    }
+
+    // live batches go first, the spool follows at its own rate while the sink accepts
+    if (!refused) {
+        StartSpoolDrain();
+    }
+}
+
+static void TelemetryTimerEventHandler(WheelTimer *timer)
+{
+    SealOpenBatch();
+    SendPendingTelemetry();
+}
+
+void GetTelemetryStats(TelemetryStats *outStats)
+{
+    *outStats = stats;
+}
+
+void CloseTelemetry(void)
+{
+    CancelWheelTimer(&telemetryTimer);
+    StopSpoolDrain();
+}
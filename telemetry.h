@@ -0,0 +1,94 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Function signature for the sink publishing a batch.
+/// </summary>
+/// <param name="json">null terminated JSON array of readings</param>
+/// <param name="length">length of the JSON array</param>
+/// <returns>true if the batch was handed over, false to keep it for a later attempt</returns>
+typedef bool (*TelemetrySink)(const char *json, size_t length);
+
+/// <summary>
+///     Counters of the telemetry batcher since InitTelemetry.
+/// </summary>
+typedef struct {
+    /// <summary>Number of readings added</summary>
+    uint32_t readings;
+    /// <summary>Number of batches handed over to the sink</summary>
+    uint32_t published;
+    /// <summary>Number of readings lost because all batch buffers were in use</summary>
+    uint32_t dropped;
+    /// <summary>Number of batches written to the spool</summary>
+    uint32_t spooled;
+    /// <summary>Number of spooled batches handed over to the sink</summary>
+    uint32_t drained;
+    /// <summary>Bytes currently held in the spool</summary>
+    uint32_t spoolBytes;
+    /// <summary>Bytes of spooled batches lost to the spool bound</summary>
+    uint32_t spoolDroppedBytes;
+    /// <summary>Number of times the spool files could not be rotated</summary>
+    uint32_t spoolErrors;
+} TelemetryStats;
+
+/// <summary>
+///     Bounds and drain rate of the telemetry spool.
+/// </summary>
+typedef struct {
+    /// <summary>Flash used by the spool, the older half is dropped when it is exceeded</summary>
+    uint32_t maxBytes;
+    /// <summary>Spooled bytes handed to the sink per drain period at most</summary>
+    uint32_t drainBytesPerPeriod;
+    /// <summary>Drain period in milliseconds</summary>
+    uint32_t drainPeriodMs;
+} TelemetrySpoolConfig;
+
+/// <summary>
+///     Initializes the telemetry batcher. Readings are accumulated into one JSON array
+///     per batch, taken from a fixed pool of buffers, and flushed when the batch is full or
+///     its oldest reading reaches the maximum age. The timer wheel must have been created.
+/// </summary>
+/// <param name="sink">Called to publish a sealed batch</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int InitTelemetry(TelemetrySink sink);
+
+/// <summary>
+///     Keeps batches the sink refuses in an append-only spool on the shared littlefs volume,
+///     they are drained at a bounded rate once the sink accepts batches again. The volume
+///     must have been mounted with w25q128_mount.
+/// </summary>
+/// <param name="config">Spool bounds and drain rate, must stay valid until CloseTelemetry</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int EnableTelemetrySpool(const TelemetrySpoolConfig *config);
+
+/// <summary>
+///     Adds a reading to the current batch.
+/// </summary>
+/// <param name="key">The telemetry item</param>
+/// <param name="value">The telemetry value</param>
+/// <param name="urgent">true to flush the batch right away, e.g. for user interaction</param>
+/// <returns>true if the reading was stored, false if it was dropped</returns>
+bool AddTelemetry(const char *key, const char *value, bool urgent);
+
+/// <summary>
+///     Hands sealed batches to the sink until it refuses one, e.g. after reconnecting. Refused
+///     batches move to the spool when it is enabled, and a pending spool starts draining.
+/// </summary>
+void SendPendingTelemetry(void);
+
+/// <summary>
+///     Gets the counters of the telemetry batcher.
+/// </summary>
+/// <param name="stats">Receives the counters</param>
+void GetTelemetryStats(TelemetryStats *stats);
+
+/// <summary>
+///     Stops the flush and drain timers. Readings which were neither published nor spooled
+///     are discarded.
+/// </summary>
+void CloseTelemetry(void);
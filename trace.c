@@ -0,0 +1,111 @@
+﻿#include <stdbool.h>
+#include <time.h>
+#include <applibs/log.h>
+
+#include "trace.h"
+
+// must be a power of 2
+#define TRACE_DEPTH 512
+
+struct trace_event_t {
+	uint32_t ts_us;
+	uint16_t id;
+	uint16_t seq;
+	uint32_t a0;
+	uint32_t a1;
+};
+
+volatile uint32_t g_trace_mask = 0;
+
+static struct trace_event_t s_trace_ring[TRACE_DEPTH];
+static uint32_t s_trace_head = 0;
+
+static const char *__trace_name(uint16_t id)
+{
+	switch (id) {
+	case traceCurlWrite:
+		return "curl.write";
+	case traceCurlProgress:
+		return "curl.progress";
+	case traceCurlDone:
+		return "curl.done";
+	case traceLfsWrite:
+		return "lfs.write";
+	case traceLfsRead:
+		return "lfs.read";
+	case traceLfsBdRead:
+		return "lfs.bd_read";
+	case traceLfsBdProg:
+		return "lfs.bd_prog";
+	case traceLfsBdErase:
+		return "lfs.bd_erase";
+	case traceSpiTxRx:
+		return "spi.txrx";
+	case traceOtaState:
+		return "ota.state";
+	default:
+		return "unknown";
+	}
+}
+
+void trace_record(uint16_t id, uint32_t a0, uint32_t a1)
+{
+	struct timespec ts;
+	uint32_t idx = __atomic_fetch_add(&s_trace_head, 1, __ATOMIC_RELAXED);
+	struct trace_event_t *p_event = &s_trace_ring[idx & (TRACE_DEPTH - 1)];
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	// the slot still carries the seq of the event it held TRACE_DEPTH records ago, so mark it as
+	// being filled first; idx ^ 0x8000 never matches any index inside the dumped window
+	__atomic_store_n(&p_event->seq, (uint16_t)(idx ^ 0x8000), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	p_event->ts_us = (uint32_t)((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+	p_event->id = id;
+	p_event->a0 = a0;
+	p_event->a1 = a1;
+	// seq is written last so that dump can tell a slot which is still being filled
+	__atomic_store_n(&p_event->seq, (uint16_t)idx, __ATOMIC_RELEASE);
+}
+
+void trace_set_mask(uint32_t mask)
+{
+	g_trace_mask = mask;
+}
+
+void trace_dump(void)
+{
+	uint32_t head = __atomic_load_n(&s_trace_head, __ATOMIC_ACQUIRE);
+	uint32_t first = (head > TRACE_DEPTH) ? (head - TRACE_DEPTH) : 0;
+	uint32_t base_us = 0;
+	bool has_base = false;
+
+	Log_Debug("TRACE: %u events recorded, dumping last %u (mask = 0x%08X)\n", head, head - first, g_trace_mask);
+
+	for (uint32_t idx = first; idx != head; idx++) {
+		struct trace_event_t *p_event = &s_trace_ring[idx & (TRACE_DEPTH - 1)];
+		struct trace_event_t event;
+		uint16_t seq = __atomic_load_n(&p_event->seq, __ATOMIC_ACQUIRE);
+
+		if (seq != (uint16_t)idx) {
+			// overwritten or still being written by another thread
+			continue;
+		}
+
+		event = *p_event;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&p_event->seq, __ATOMIC_RELAXED) != seq) {
+			// reused by a writer while it was being copied
+			continue;
+		}
+
+		if (!has_base) {
+			base_us = event.ts_us;
+			has_base = true;
+		}
+
+		Log_Debug("TRACE: +%10u us %-14s %10u %10u\n", event.ts_us - base_us, __trace_name(event.id), event.a0, event.a1);
+	}
+}
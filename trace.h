@@ -0,0 +1,54 @@
+﻿#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+// Binary trace events are recorded into a fixed ring buffer and only formatted when dumped.
+// Define TRACE_DISABLE to compile every trace point out of the image, otherwise a trace point
+// costs a single mask test while its category is disabled at runtime.
+
+enum trace_category_t
+{
+	traceCatCurl = 0,
+	traceCatLfs,
+	traceCatSpi,
+	traceCatOta,
+};
+
+#define TRACE_ID(cat, n) (((cat) << 8) | (n))
+
+enum trace_id_t
+{
+	traceCurlWrite = TRACE_ID(traceCatCurl, 0),		// a0 = bytes, a1 = bytes accepted
+	traceCurlProgress = TRACE_ID(traceCatCurl, 1),	// a0 = dlnow, a1 = dltotal
+	traceCurlDone = TRACE_ID(traceCatCurl, 2),		// a0 = CURLcode, a1 = resume offset
+	traceLfsWrite = TRACE_ID(traceCatLfs, 0),		// a0 = bytes, a1 = result
+	traceLfsRead = TRACE_ID(traceCatLfs, 1),		// a0 = bytes, a1 = result
+	traceLfsBdRead = TRACE_ID(traceCatLfs, 2),		// a0 = block, a1 = size
+	traceLfsBdProg = TRACE_ID(traceCatLfs, 3),		// a0 = block, a1 = size
+	traceLfsBdErase = TRACE_ID(traceCatLfs, 4),		// a0 = block
+	traceSpiTxRx = TRACE_ID(traceCatSpi, 0),		// a0 = tx_len, a1 = rx_len
+	traceOtaState = TRACE_ID(traceCatOta, 0),		// a0 = status, a1 = error
+};
+
+#define TRACE_CAT_MASK(cat) (1u << (cat))
+#define TRACE_CAT_ALL       (0xFFFFFFFFu)
+
+extern volatile uint32_t g_trace_mask;
+
+void trace_record(uint16_t id, uint32_t a0, uint32_t a1);
+void trace_set_mask(uint32_t mask);
+void trace_dump(void);
+
+#if defined(TRACE_DISABLE)
+#define TRACE(id, a0, a1) do { } while (0)
+#else
+#define TRACE(id, a0, a1)                                            \
+	do {                                                             \
+		if (g_trace_mask & TRACE_CAT_MASK((uint32_t)(id) >> 8)) {    \
+			trace_record((uint16_t)(id), (uint32_t)(a0), (uint32_t)(a1)); \
+		}                                                            \
+	} while (0)
+#endif
+
+#endif